@@ -3,6 +3,10 @@
 #ifndef __WIN32__
 #include <netdb.h>
 #include <resolv.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #endif
 
 struct vpn_ws_config vpn_ws_conf;
@@ -12,10 +16,103 @@ static struct option vpn_ws_options[] = {
         {"key", required_argument, NULL, 2 },
         {"crt", required_argument, NULL, 3 },
         {"no-verify", no_argument, &vpn_ws_conf.ssl_no_verify, 1 },
+	{"no-ktls", no_argument, &vpn_ws_conf.no_ktls, 1 },
 	{"bridge", no_argument, &vpn_ws_conf.bridge, 1 },
+	{"offload", no_argument, &vpn_ws_conf.offload, 1 },
+	{"no-batch", no_argument, &vpn_ws_conf.no_batch, 1 },
+	{"batch-bytes", required_argument, NULL, 4 },
+	{"batch-frames", required_argument, NULL, 5 },
+	{"batch-delay", required_argument, NULL, 6 },
+	{"deflate", no_argument, &vpn_ws_conf.deflate, 1 },
+	{"deflate-no-takeover", no_argument, &vpn_ws_conf.deflate_no_takeover, 1 },
+	{"deflate-min", required_argument, NULL, 7 },
+	{"streams", required_argument, NULL, 8 },
+	{"bind-device", required_argument, NULL, 9 },
+	{"threads", no_argument, &vpn_ws_conf.threads, 1 },
         {NULL, 0, 0, 0}
 };
 
+// permessage-deflate: compressed messages are built in zbuf (after 14 bytes of headroom), inflated in ibuf
+static uint8_t *vpn_ws_zbuf;
+static uint64_t vpn_ws_zbuf_len;
+static uint8_t *vpn_ws_ibuf;
+static uint64_t vpn_ws_ibuf_len;
+
+/*
+	the socket and the tuntap device are non blocking, each direction has its
+	own queue (websocket packets for the server, frames for the tuntap device)
+	flushed when the fd becomes writable. Events are edge triggered: the readiness
+	is remembered until an operation returns EAGAIN. A TLS read can wait for the
+	socket to be writable (and a TLS write for it to be readable), so they
+	remember what they are waiting for.
+*/
+struct vpn_ws_client_queue {
+	uint8_t *buf;
+	uint64_t off;
+	uint64_t pos;
+	uint64_t len;
+};
+
+// over this amount of queued bytes the other side is not read (its data waits in the kernel)
+#define VPN_WS_CLIENT_QUEUE_MAX (1024*1024)
+
+// frames are prefixed by their (native endian) 32 bit length
+static struct vpn_ws_client_queue vpn_ws_tq;
+static int vpn_ws_tap_ready;
+
+/*
+	a websocket connection to the server. With --streams the frames are
+	spread among multiple connections (by flow), each one with its own
+	TLS session, egress queue and aggregated message
+*/
+struct vpn_ws_client_stream {
+	vpn_ws_peer *peer;
+	// the TLS session (NULL for ws://) and the directions offloaded to the kernel
+	void *ssl;
+	int ktls;
+	// websocket packets for the server
+	struct vpn_ws_client_queue wq;
+	// the socket readiness, as seen by the reads and by the writes (TLS can make them want both)
+	int read_ready;
+	int write_ready;
+	int read_want;
+	int write_want;
+	/*
+		vpn-ws-batch: the message being aggregated (with room for the websocket
+		header in front of it). It is sent when full or when the first frame has
+		waited for batch_delay usecs
+	*/
+	uint8_t *agg;
+	uint64_t agg_len;
+	uint64_t agg_frames;
+	struct timeval agg_t;
+#ifndef __WIN32__
+	// --threads: the TLS session is used by both of the threads
+	pthread_mutex_t lock;
+#endif
+};
+
+static struct vpn_ws_client_stream vpn_ws_client_streams[VPN_WS_STREAMS_MAX];
+// the connected streams (a server not supporting --streams gets only one)
+static int vpn_ws_client_streams_n;
+
+#ifdef __WIN32__
+static OVERLAPPED vpn_ws_overlapped_write;
+#endif
+
+// a TLS session cannot be used by two threads at the same time
+static void vpn_ws_client_lock(struct vpn_ws_client_stream *s) {
+#ifndef __WIN32__
+	if (vpn_ws_conf.threads) pthread_mutex_lock(&s->lock);
+#endif
+}
+
+static void vpn_ws_client_unlock(struct vpn_ws_client_stream *s) {
+#ifndef __WIN32__
+	if (vpn_ws_conf.threads) pthread_mutex_unlock(&s->lock);
+#endif
+}
+
 #ifdef __WIN32__
 /*
 	The amount of code here for opening a socket is astonishing....
@@ -63,52 +160,60 @@ static HANDLE _vpn_ws_win32_socket(int family, int type, int protocol) {
 }
 #endif
 
-void vpn_ws_client_destroy(vpn_ws_peer *peer) {
-	if (vpn_ws_conf.ssl_ctx) {
-		vpn_ws_ssl_close(vpn_ws_conf.ssl_ctx);
+void vpn_ws_client_destroy(struct vpn_ws_client_stream *s) {
+	if (s->ssl) {
+		vpn_ws_ssl_close(s->ssl);
+		s->ssl = NULL;
+	}
+	if (s->peer) {
+		vpn_ws_peer_destroy(s->peer);
+		s->peer = NULL;
 	}
-	vpn_ws_peer_destroy(peer);
 }
 
-int vpn_ws_client_read(vpn_ws_peer *peer, uint64_t amount) {
-        uint64_t available = peer->len - peer->pos;
-        if (available < amount) {
-                peer->len += amount;
-                void *tmp = realloc(peer->buf, peer->len);
-                if (!tmp) {
-                        vpn_ws_error("vpn_ws_client_read()/realloc()");
-                        return -1;
-                }
-                peer->buf = tmp;
-        }
-
-	if (vpn_ws_conf.ssl_ctx) {
-		ssize_t rlen = vpn_ws_ssl_read(vpn_ws_conf.ssl_ctx, peer->buf + peer->pos, amount);
+// returns the amount of read bytes, 0 if the socket is not ready
+ssize_t vpn_ws_client_read(struct vpn_ws_client_stream *s, uint64_t amount) {
+	vpn_ws_peer *peer = s->peer;
+	if (vpn_ws_buf_reserve(&peer->buf, &peer->off, &peer->pos, &peer->len, amount)) return -1;
+
+	// even with kTLS OpenSSL reads the (already decrypted) records, as non-data ones need recvmsg()
+	if (s->ssl) {
+		int want = VPN_WS_EVENT_READ;
+		vpn_ws_client_lock(s);
+		ssize_t rlen = vpn_ws_ssl_read(s->ssl, peer->buf + peer->pos, amount, &want);
+		vpn_ws_client_unlock(s);
+		if (rlen < 0) return -1;
 		if (rlen == 0) {
-			return -1;
-		}	
-		if (rlen > 0) {
-        		peer->pos += rlen;
+			s->read_ready &= ~want;
+			s->read_want = want;
 			return 0;
 		}
+		s->read_want = VPN_WS_EVENT_READ;
+		peer->pos += rlen;
 		return rlen;
 	}
 
 	vpn_ws_recv(peer->fd, peer->buf + peer->pos, amount, rlen);
         if (rlen < 0) {
-		if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) return 0;
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+			s->read_ready &= ~VPN_WS_EVENT_READ;
+			return 0;
+		}
 		vpn_ws_error("vpn_ws_client_read()/read()");
 		return -1;
 	}
 	else if (rlen == 0) {
 		return -1;
 	}
+#ifdef __WIN32__
+	// the socket is blocking here, wait for the next event
+	s->read_ready &= ~VPN_WS_EVENT_READ;
+#endif
         peer->pos += rlen;
 
-        return 0;
+        return rlen;
 }
 
-
 int vpn_ws_rnrn(char *buf, size_t len) {
 	if (len < 17) return 0;
 	uint8_t status = 0;
@@ -144,8 +249,37 @@ int vpn_ws_rnrn(char *buf, size_t len) {
 	return vpn_ws_str_to_uint(buf+9, 3);
 }
 
+// check for a response header (name and value, case insensitive)
+static int vpn_ws_has_header(char *buf, size_t len, char *header) {
+	size_t header_len = strlen(header);
+	size_t i;
+	for(i=0;i+header_len+2<=len;i++) {
+		if (buf[i] != '\r' || buf[i+1] != '\n') continue;
+		if (!strncasecmp(buf+i+2, header, header_len)) return 1;
+	}
+	return 0;
+}
+
+// get the value of a response header (case insensitive name), NULL if it is missing
+static char *vpn_ws_get_header(char *buf, size_t len, char *header, size_t *value_len) {
+	size_t header_len = strlen(header);
+	size_t i;
+	for(i=0;i+header_len+3<=len;i++) {
+		if (buf[i] != '\r' || buf[i+1] != '\n') continue;
+		if (strncasecmp(buf+i+2, header, header_len) || buf[i+2+header_len] != ':') continue;
+		char *value = buf+i+3+header_len;
+		char *end = buf + len;
+		while(value < end && *value == ' ') value++;
+		char *ptr = value;
+		while(ptr < end && *ptr != '\r') ptr++;
+		*value_len = ptr - value;
+		return value;
+	}
+	return NULL;
+}
+
 // here the socket is still in blocking state
-int vpn_ws_wait_101(vpn_ws_fd fd, void *ssl) {
+int vpn_ws_wait_101(vpn_ws_fd fd, void *ssl, vpn_ws_peer *peer) {
 	char buf[8192];
 	size_t remains = 8192;
 
@@ -159,7 +293,9 @@ int vpn_ws_wait_101(vpn_ws_fd fd, void *ssl) {
 			remains -= rlen;
 		}
 		else {
-			ssize_t rlen = vpn_ws_ssl_read(ssl, (uint8_t *) buf + (8192-remains), remains);
+			// the socket is still blocking
+			int want = 0;
+			ssize_t rlen = vpn_ws_ssl_read(ssl, (uint8_t *) buf + (8192-remains), remains, &want);
 			if (rlen <= 0) {
 				vpn_ws_error("vpn_ws_wait_101()/vpn_ws_ssl_read()");
                                 return -1;
@@ -168,7 +304,25 @@ int vpn_ws_wait_101(vpn_ws_fd fd, void *ssl) {
 		}
 
 		int code = vpn_ws_rnrn(buf, 8192-remains);
-		if (code) return code;
+		if (code) {
+			peer->vnet = vpn_ws_has_header(buf, 8192-remains, "X-vpn-ws-Offload: on\r\n");
+			peer->multi = vpn_ws_has_header(buf, 8192-remains, "Sec-WebSocket-Protocol: " VPN_WS_BATCH_PROTO "\r\n");
+			// the server does not know about --streams
+			if (!vpn_ws_has_header(buf, 8192-remains, "X-vpn-ws-Streams: on\r\n")) peer->streams_id = 0;
+			size_t ext_len = 0;
+			char *ext = vpn_ws_get_header(buf, 8192-remains, "Sec-WebSocket-Extensions", &ext_len);
+			if (ext) {
+				// the server can only accept what we offered
+				vpn_ws_deflate_params params;
+				if (!vpn_ws_conf.deflate || vpn_ws_deflate_negotiate(ext, ext_len, 0, &params) <= 0) {
+					vpn_ws_warning("invalid websocket extensions: %.*s", (int) ext_len, ext);
+					return -1;
+				}
+				peer->zs = vpn_ws_deflate_new(&params);
+				if (!peer->zs) return -1;
+			}
+			return code;
+		}
 	}
 }
 
@@ -200,15 +354,374 @@ int vpn_ws_full_write(vpn_ws_fd fd, char *buf, size_t len) {
 	return 0;
 }
 
-int vpn_ws_client_write(vpn_ws_peer *peer, uint8_t *buf, uint64_t len) {
-	if (vpn_ws_conf.ssl_ctx) {
-		return vpn_ws_ssl_write(vpn_ws_conf.ssl_ctx, buf, len);
+static int vpn_ws_client_queue_append(struct vpn_ws_client_queue *q, uint8_t *buf, uint64_t len) {
+	if (vpn_ws_buf_reserve(&q->buf, &q->off, &q->pos, &q->len, len)) return -1;
+	memcpy(q->buf + q->pos, buf, len);
+	q->pos += len;
+	return 0;
+}
+
+static void vpn_ws_client_queue_consume(struct vpn_ws_client_queue *q, uint64_t amount) {
+	q->off += amount;
+	if (q->off < q->pos) return;
+	q->off = 0;
+	q->pos = 0;
+}
+
+static uint64_t vpn_ws_client_queue_len(struct vpn_ws_client_queue *q) {
+	return q->pos - q->off;
+}
+
+// write the queued websocket packets until the socket blocks
+static int vpn_ws_client_flush(struct vpn_ws_client_stream *s) {
+	struct vpn_ws_client_queue *q = &s->wq;
+	while(q->pos > q->off && (s->write_ready & s->write_want)) {
+		uint8_t *buf = q->buf + q->off;
+		uint64_t len = q->pos - q->off;
+		int want = VPN_WS_EVENT_WRITE;
+		ssize_t wlen = 0;
+		// with kTLS the kernel builds the records from what we write to the socket
+		if (s->ssl && !(s->ktls & VPN_WS_KTLS_TX)) {
+			vpn_ws_client_lock(s);
+			wlen = vpn_ws_ssl_write(s->ssl, buf, len, &want);
+			vpn_ws_client_unlock(s);
+			if (wlen < 0) return -1;
+		}
+		else {
+			vpn_ws_send(s->peer->fd, buf, len, slen);
+			if (slen <= 0) {
+				if (slen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+					slen = 0;
+				}
+				else {
+					vpn_ws_error("vpn_ws_client_flush()/write()");
+					return -1;
+				}
+			}
+			wlen = slen;
+		}
+		if (wlen == 0) {
+			s->write_ready &= ~want;
+			s->write_want = want;
+			return 0;
+		}
+		s->write_want = VPN_WS_EVENT_WRITE;
+		vpn_ws_client_queue_consume(q, wlen);
 	}
-	return vpn_ws_full_write(peer->fd, (char *)buf, len);
+	return 0;
 }
 
+// queue a websocket packet and try to send it
+int vpn_ws_client_write(struct vpn_ws_client_stream *s, uint8_t *buf, uint64_t len) {
+	if (vpn_ws_client_queue_append(&s->wq, buf, len)) return -1;
+	return vpn_ws_client_flush(s);
+}
 
-int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
+// grow a scratch buffer (preserving its content)
+static int vpn_ws_client_grow(uint8_t **buf, uint64_t *len, uint64_t amount) {
+	if (*len >= amount) return 0;
+	void *tmp = realloc(*buf, amount);
+	if (!tmp) {
+		vpn_ws_error("vpn_ws_client_grow()/realloc()");
+		return -1;
+	}
+	*buf = tmp;
+	*len = amount;
+	return 0;
+}
+
+/*
+	mask a message and queue it, the (masked) websocket header is built
+	in front of it (there must be 14 bytes of headroom). The queue is
+	flushed by the caller, so the packets built in a round are written
+	(and encrypted) together
+*/
+static int vpn_ws_client_send(struct vpn_ws_client_stream *s, uint8_t *buf, uint64_t len, uint8_t *mask) {
+	vpn_ws_peer *peer = s->peer;
+	uint8_t rsv1 = 0;
+	// permessage-deflate: the message is compressed in zbuf (with the same headroom)
+	if (peer->zs && vpn_ws_deflate_wanted(peer->zs, len)) {
+		uint64_t bound = vpn_ws_deflate_bound(len);
+		if (vpn_ws_client_grow(&vpn_ws_zbuf, &vpn_ws_zbuf_len, 14 + bound)) return -1;
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		int64_t zlen = vpn_ws_deflate(peer->zs, &iov, 1, vpn_ws_zbuf + 14, bound);
+		if (zlen < 0) return -1;
+		buf = vpn_ws_zbuf + 14;
+		len = zlen;
+		rsv1 = 0x40;
+	}
+
+	vpn_ws_mask(buf, len, mask);
+
+	uint8_t header[10];
+	uint8_t header_size = vpn_ws_websocket_header(header, len);
+	header[0] |= rsv1;
+	header[1] |= 0x80;
+	uint8_t *ws = buf - header_size - 4;
+	memcpy(ws, header, header_size);
+	memcpy(ws + header_size, mask, 4);
+
+	return vpn_ws_client_queue_append(&s->wq, ws, header_size + 4 + len);
+}
+
+// vpn-ws-batch: send the message being aggregated
+static int vpn_ws_client_batch_flush(struct vpn_ws_client_stream *s, uint8_t *mask) {
+	if (!s->agg_frames) return 0;
+	uint64_t len = s->agg_len;
+	s->agg_len = 0;
+	s->agg_frames = 0;
+	return vpn_ws_client_send(s, s->agg + 14, len, mask);
+}
+
+/*
+	vpn-ws-batch: add a frame to the message being aggregated. Frames not
+	fitting an empty message are sent alone (their length is written in the
+	2 bytes in front of them, the websocket header before it)
+*/
+static int vpn_ws_client_batch_add(struct vpn_ws_client_stream *s, uint8_t *frame, uint64_t len, uint8_t *mask) {
+	if (s->agg_frames && s->agg_len + VPN_WS_BATCH_PREFIX + len > vpn_ws_conf.batch_bytes) {
+		if (vpn_ws_client_batch_flush(s, mask)) return -1;
+	}
+
+	if (VPN_WS_BATCH_PREFIX + len > vpn_ws_conf.batch_bytes) {
+		vpn_ws_batch_prefix(frame - VPN_WS_BATCH_PREFIX, len);
+		return vpn_ws_client_send(s, frame - VPN_WS_BATCH_PREFIX, VPN_WS_BATCH_PREFIX + len, mask);
+	}
+
+	uint8_t *ptr = s->agg + 14 + s->agg_len;
+	vpn_ws_batch_prefix(ptr, len);
+	memcpy(ptr + VPN_WS_BATCH_PREFIX, frame, len);
+	s->agg_len += VPN_WS_BATCH_PREFIX + len;
+	if (s->agg_frames++ == 0) {
+		gettimeofday(&s->agg_t, NULL);
+	}
+
+	if (s->agg_frames >= vpn_ws_conf.batch_frames || vpn_ws_conf.batch_delay <= 0) {
+		return vpn_ws_client_batch_flush(s, mask);
+	}
+	return 0;
+}
+
+// usecs before the aggregated message must be sent (-1 if there is none)
+static int64_t vpn_ws_client_batch_wait(struct vpn_ws_client_stream *s) {
+	if (!s->agg_frames) return -1;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	int64_t elapsed = ((int64_t) (now.tv_sec - s->agg_t.tv_sec) * 1000000) + (now.tv_usec - s->agg_t.tv_usec);
+	if (elapsed >= vpn_ws_conf.batch_delay) return 0;
+	return vpn_ws_conf.batch_delay - elapsed;
+}
+
+/*
+	permessage-deflate: inflate a message in ibuf,
+	returns its size (-1 if it is not valid)
+*/
+static int64_t vpn_ws_client_inflate(vpn_ws_peer *peer, uint8_t *buf, uint64_t len) {
+	if (vpn_ws_inflate_begin(peer->zs, buf, len)) return -1;
+	uint64_t pos = 0;
+	for(;;) {
+		if (pos == vpn_ws_ibuf_len) {
+			if (pos >= VPN_WS_INFLATE_MAX) {
+				vpn_ws_warning("too big compressed message");
+				return -1;
+			}
+			if (vpn_ws_client_grow(&vpn_ws_ibuf, &vpn_ws_ibuf_len, pos ? pos * 2 : 65536)) return -1;
+		}
+		int64_t rlen = vpn_ws_inflate_next(peer->zs, vpn_ws_ibuf + pos, vpn_ws_ibuf_len - pos);
+		if (rlen < 0) return -1;
+		pos += rlen;
+		if (pos < vpn_ws_ibuf_len) return pos;
+	}
+}
+
+// write a frame coming from the server to the tuntap device
+static void vpn_ws_client_tap_write(vpn_ws_peer *peer, vpn_ws_fd tuntap_fd, uint8_t *frame, uint64_t len) {
+#ifndef __WIN32__
+	// the tuntap device wants a virtio-net header the server did not send
+	uint8_t vnet[VPN_WS_VNET_HDR_LEN];
+	memset(vnet, 0, VPN_WS_VNET_HDR_LEN);
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if (vpn_ws_conf.tuntap_vnet && !peer->vnet) {
+		iov[iovcnt].iov_base = vnet;
+		iov[iovcnt].iov_len = VPN_WS_VNET_HDR_LEN;
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = frame;
+	iov[iovcnt].iov_len = len;
+	iovcnt++;
+	// frames already queued go first
+	if (vpn_ws_tq.pos == vpn_ws_tq.off && (vpn_ws_tap_ready & VPN_WS_EVENT_WRITE)) {
+		if (writev(tuntap_fd, iov, iovcnt) >= 0) return;
+		// a frame refused by the kernel, drop it
+		if (errno == EINVAL) return;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			// being not able to write on tuntap is really bad...
+			vpn_ws_error("main()/writev()");
+			vpn_ws_exit(1);
+		}
+		vpn_ws_tap_ready &= ~VPN_WS_EVENT_WRITE;
+	}
+	uint32_t record = iovcnt > 1 ? VPN_WS_VNET_HDR_LEN + len : len;
+	struct vpn_ws_client_queue *q = &vpn_ws_tq;
+	// on memory errors the frame is dropped
+	if (vpn_ws_buf_reserve(&q->buf, &q->off, &q->pos, &q->len, 4 + record)) return;
+	memcpy(q->buf + q->pos, &record, 4);
+	q->pos += 4;
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		memcpy(q->buf + q->pos, iov[i].iov_base, iov[i].iov_len);
+		q->pos += iov[i].iov_len;
+	}
+#else
+	ssize_t wlen = -1;
+	if (!WriteFile(tuntap_fd, frame, len, (LPDWORD) &wlen, &vpn_ws_overlapped_write)) {
+		if (GetLastError() != ERROR_IO_PENDING) {
+			vpn_ws_error("main()/WriteFile()");
+			vpn_ws_exit(1);
+		}
+		if (!GetOverlappedResult(tuntap_fd, &vpn_ws_overlapped_write, (LPDWORD) &wlen, TRUE)) {
+			vpn_ws_error("main()/GetOverlappedResult()");
+			vpn_ws_exit(1);
+		}
+	}
+#endif
+}
+
+#ifndef __WIN32__
+// write the queued frames to the tuntap device
+static void vpn_ws_client_tap_flush(vpn_ws_fd tuntap_fd) {
+	struct vpn_ws_client_queue *q = &vpn_ws_tq;
+	while(q->pos > q->off && (vpn_ws_tap_ready & VPN_WS_EVENT_WRITE)) {
+		uint32_t len;
+		memcpy(&len, q->buf + q->off, 4);
+		if (write(tuntap_fd, q->buf + q->off + 4, len) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				vpn_ws_tap_ready &= ~VPN_WS_EVENT_WRITE;
+				return;
+			}
+			if (errno != EINVAL) {
+				vpn_ws_error("vpn_ws_client_tap_flush()/write()");
+				vpn_ws_exit(1);
+			}
+		}
+		vpn_ws_client_queue_consume(q, 4 + len);
+	}
+}
+#endif
+
+// consume the websocket packets in the read buffer, their frames go to the tuntap device
+static int vpn_ws_client_parse(vpn_ws_peer *peer, vpn_ws_fd tuntap_fd) {
+	for(;;) {
+		uint16_t ws_header = 0;
+		int64_t rlen = vpn_ws_websocket_parse(peer, &ws_header);
+		if (rlen < 0) return -1;
+		if (rlen == 0) return 0;
+		// ignore packet ?
+		if (ws_header == 0) goto decapitate;
+		// is it a masked packet ?
+		uint8_t *ws = peer->buf + peer->off + ws_header;
+		uint64_t ws_len = rlen - ws_header;
+		if (peer->has_mask) {
+			vpn_ws_mask(ws, ws_len, peer->mask);
+		}
+		// a compressed message ?
+		if (peer->deflated) {
+			int64_t zlen = vpn_ws_client_inflate(peer, ws, ws_len);
+			if (zlen < 0) return -1;
+			ws = vpn_ws_ibuf;
+			ws_len = zlen;
+		}
+
+		// a multi-frame message ?
+		if (peer->multi) {
+			uint64_t pos = 0;
+			uint8_t *frame = NULL;
+			int64_t frame_len = 0;
+			while((frame_len = vpn_ws_batch_next(ws, ws_len, &pos, &frame)) > 0) {
+				vpn_ws_client_tap_write(peer, tuntap_fd, frame, frame_len);
+			}
+			// a malformed message
+			if (frame_len < 0) return -1;
+		}
+		else {
+			vpn_ws_client_tap_write(peer, tuntap_fd, ws, ws_len);
+		}
+
+decapitate:
+		vpn_ws_peer_consume(peer, rlen);
+	}
+}
+
+/*
+	send a frame read from the tuntap device to the server (there must
+	be 16 bytes of headroom in front of it). With --streams the flow
+	of the frame chooses the connection
+*/
+static int vpn_ws_client_tap_frame(uint8_t *frame, uint64_t frame_len, uint8_t *mask) {
+	uint8_t *eth = frame;
+	uint64_t eth_len = frame_len;
+	if (vpn_ws_conf.tuntap_vnet) {
+		if (frame_len < VPN_WS_VNET_HDR_LEN) return 0;
+		eth += VPN_WS_VNET_HDR_LEN;
+		eth_len -= VPN_WS_VNET_HDR_LEN;
+	}
+
+	struct vpn_ws_client_stream *s = &vpn_ws_client_streams[0];
+	if (vpn_ws_client_streams_n > 1) {
+		s = &vpn_ws_client_streams[vpn_ws_flow_hash(eth, eth_len) % vpn_ws_client_streams_n];
+	}
+
+	// the server does not want the virtio-net header (the frame is already complete)
+	if (!s->peer->vnet) {
+		frame = eth;
+		frame_len = eth_len;
+	}
+
+	if (s->peer->multi) {
+		return vpn_ws_client_batch_add(s, frame, frame_len, mask);
+	}
+	return vpn_ws_client_send(s, frame, frame_len, mask);
+}
+
+// can the tuntap device be read ? (the stream of the next frame is not known)
+static int vpn_ws_client_congested() {
+	int i;
+	for(i=0;i<vpn_ws_client_streams_n;i++) {
+		if (vpn_ws_client_queue_len(&vpn_ws_client_streams[i].wq) >= VPN_WS_CLIENT_QUEUE_MAX) return 1;
+	}
+	return 0;
+}
+
+// is there something to do without waiting for events ?
+static int vpn_ws_client_busy() {
+	if ((vpn_ws_tap_ready & VPN_WS_EVENT_READ) && !vpn_ws_client_congested()) return 1;
+	if (vpn_ws_client_queue_len(&vpn_ws_tq) && (vpn_ws_tap_ready & VPN_WS_EVENT_WRITE)) return 1;
+	int i;
+	for(i=0;i<vpn_ws_client_streams_n;i++) {
+		struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+		if ((s->read_ready & s->read_want) && vpn_ws_client_queue_len(&vpn_ws_tq) < VPN_WS_CLIENT_QUEUE_MAX) return 1;
+		if (vpn_ws_client_queue_len(&s->wq) && (s->write_ready & s->write_want)) return 1;
+	}
+	return 0;
+}
+
+// destroy all of the streams
+static void vpn_ws_client_disconnect() {
+	int i;
+	for(i=0;i<VPN_WS_STREAMS_MAX;i++) {
+		vpn_ws_client_destroy(&vpn_ws_client_streams[i]);
+	}
+}
+
+/*
+	connect a stream (its peer has already been allocated), streams_id is 0 for
+	a single connection, dev the device the socket is bound to (or NULL)
+*/
+int vpn_ws_connect(struct vpn_ws_client_stream *s, char *name, uint64_t streams_id, char *dev) {
+	vpn_ws_peer *peer = s->peer;
 	static char *cpy = NULL;
 
 	if (cpy) free(cpy);
@@ -216,6 +729,7 @@ int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
 	
 	int ssl = 0;
 	uint16_t port = 80;
+	s->ktls = 0;
 	if (strlen(cpy) < 6) {
 		vpn_ws_warning("invalid websocket url: %s", cpy);
 		return -1;
@@ -284,6 +798,19 @@ int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
 		return -1;
 	}
 
+	// multipath: the route of the device is used
+	if (dev) {
+#ifdef SO_BINDTODEVICE
+		if (setsockopt(peer->fd, SOL_SOCKET, SO_BINDTODEVICE, dev, strlen(dev))) {
+			vpn_ws_error("vpn_ws_connect()/setsockopt()");
+			return -1;
+		}
+#else
+		vpn_ws_warning("vpn_ws_connect(): binding to a device is not supported on this platform");
+		return -1;
+#endif
+	}
+
 	struct sockaddr_in sin;
 	memset(&sin, 0, sizeof(struct sockaddr_in));
 	sin.sin_family = AF_INET;
@@ -318,9 +845,14 @@ int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
 	for(i=0;i<10;i++) secret[i] = rand();
 #endif
 	uint16_t key_len = vpn_ws_base64_encode(secret, 10, key);
+	char streams[64];
+	streams[0] = 0;
+	if (streams_id) {
+		snprintf(streams, 64, "\r\nX-vpn-ws-Streams: %016llx", (unsigned long long) streams_id);
+	}
 	// now build and send the request
 	char buf[8192];
-	int ret = snprintf(buf, 8192, "GET /%s HTTP/1.1\r\nHost: %s%s%s\r\n%sUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %.*s\r\nX-vpn-ws-MAC: %02x:%02x:%02x:%02x:%02x:%02x%s\r\n\r\n",
+	int ret = snprintf(buf, 8192, "GET /%s HTTP/1.1\r\nHost: %s%s%s\r\n%sUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %.*s\r\nX-vpn-ws-MAC: %02x:%02x:%02x:%02x:%02x:%02x%s%s%s%s%s\r\n\r\n",
 		path ? path : "",
 		domain,
 		port_str ? ":" : "",
@@ -334,7 +866,16 @@ int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
 		mac[3],	
 		mac[4],
 		mac[5],
-		vpn_ws_conf.bridge ? "\r\nX-vpn-ws-bridge: on" : ""
+		vpn_ws_conf.bridge ? "\r\nX-vpn-ws-bridge: on" : "",
+		// ask for offloads only if the tuntap device supports them
+		vpn_ws_conf.tuntap_vnet ? "\r\nX-vpn-ws-Offload: on" : "",
+		// old servers ignore it, and keep sending a frame per message
+		vpn_ws_conf.no_batch ? "" : "\r\nSec-WebSocket-Protocol: " VPN_WS_BATCH_PROTO,
+		// any window is fine for our decompressor
+		!vpn_ws_conf.deflate ? "" : vpn_ws_conf.deflate_no_takeover ?
+			"\r\nSec-WebSocket-Extensions: " VPN_WS_DEFLATE_EXT "; client_max_window_bits; server_no_context_takeover; client_no_context_takeover" :
+			"\r\nSec-WebSocket-Extensions: " VPN_WS_DEFLATE_EXT "; client_max_window_bits",
+		streams
 	);
 
 	if (auth) free(auth);
@@ -345,11 +886,13 @@ int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
 	}
 
 	if (ssl) {
-		vpn_ws_conf.ssl_ctx = vpn_ws_ssl_handshake(peer, domain, vpn_ws_conf.ssl_key, vpn_ws_conf.ssl_crt);
-		if (!vpn_ws_conf.ssl_ctx) {
+		s->ssl = vpn_ws_ssl_handshake(peer, domain, vpn_ws_conf.ssl_key, vpn_ws_conf.ssl_crt);
+		if (!s->ssl) {
 			return -1;
 		}
-		if (vpn_ws_ssl_write(vpn_ws_conf.ssl_ctx, (uint8_t *)buf, ret)) {
+		// the socket is still blocking
+		int want = 0;
+		if (vpn_ws_ssl_write(s->ssl, (uint8_t *)buf, ret, &want) != ret) {
 			return -1;
 		}
 	}
@@ -359,16 +902,285 @@ int vpn_ws_connect(vpn_ws_peer *peer, char *name) {
 		}		
 	}
 
-	int http_code = vpn_ws_wait_101(peer->fd, vpn_ws_conf.ssl_ctx);
+	peer->streams_id = streams_id;
+	int http_code = vpn_ws_wait_101(peer->fd, s->ssl, peer);
 	if (http_code != 101) {
 		vpn_ws_warning("error, websocket handshake returned code: %d", http_code);
 		return -1;
 	}
+	if (!vpn_ws_conf.tuntap_vnet) peer->vnet = 0;
+	if (vpn_ws_conf.no_batch) peer->multi = 0;
 
 	vpn_ws_notice("connected to %s port %u (transport: %s)", domain, port, ssl ? "wss": "ws");
+	if (ssl) {
+		// nothing is pending in the TLS buffers, the socket can be written directly from now on
+		s->ktls = vpn_ws_ssl_ktls(s->ssl);
+		vpn_ws_notice("TLS encryption: %s, decryption: %s",
+			(s->ktls & VPN_WS_KTLS_TX) ? "kernel" : "userspace",
+			(s->ktls & VPN_WS_KTLS_RX) ? "kernel" : "userspace");
+	}
+	return 0;
+}
+
+#ifndef __WIN32__
+/*
+	threaded mode (--threads): a thread for each direction. The tx thread reads
+	the tuntap device and writes the sockets, the rx thread reads the sockets and
+	writes the tuntap device, so frames never cross threads and every queue,
+	batch and compression context has a single owner. The main thread connects,
+	and passes its pings to the tx thread (the only writer of the sockets) over
+	a lock-free ring. The TLS reads and writes of a connection are serialized,
+	so the crypto of the two directions runs in parallel only when the kernel
+	encrypts (kTLS) or with ws://
+*/
+struct vpn_ws_client_thread {
+	pthread_t t;
+	// an eventfd on Linux, a pipe elsewhere
+	int notify_fd[2];
+	vpn_ws_fd tuntap_fd;
+	uint8_t *mask;
+	// the packets of the main thread (tx thread only)
+	vpn_ws_ring *ring;
+};
+
+static struct vpn_ws_client_thread vpn_ws_client_tx;
+static struct vpn_ws_client_thread vpn_ws_client_rx;
+// woken up by the threads when the connection fails
+static struct vpn_ws_client_thread vpn_ws_client_main;
+static int vpn_ws_client_stopping;
+
+static int vpn_ws_client_notify_init(struct vpn_ws_client_thread *t) {
+#ifdef __linux__
+	int fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0) {
+		vpn_ws_error("vpn_ws_client_notify_init()/eventfd()");
+		return -1;
+	}
+	t->notify_fd[0] = fd;
+	t->notify_fd[1] = fd;
+#else
+	if (pipe(t->notify_fd)) {
+		vpn_ws_error("vpn_ws_client_notify_init()/pipe()");
+		return -1;
+	}
+	if (vpn_ws_nb(t->notify_fd[0]) || vpn_ws_nb(t->notify_fd[1])) return -1;
+#endif
 	return 0;
 }
 
+static void vpn_ws_client_notify(struct vpn_ws_client_thread *t) {
+	uint64_t one = 1;
+	// a full pipe (or counter) already guarantees a wakeup
+	if (write(t->notify_fd[1], &one, sizeof(uint64_t)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			vpn_ws_error("vpn_ws_client_notify()/write()");
+		}
+	}
+}
+
+static void vpn_ws_client_notify_drain(struct vpn_ws_client_thread *t) {
+	uint64_t buf;
+	while(read(t->notify_fd[0], &buf, sizeof(uint64_t)) > 0);
+}
+
+static short vpn_ws_client_poll_events(int want) {
+	short events = 0;
+	if (want & VPN_WS_EVENT_READ) events |= POLLIN;
+	if (want & VPN_WS_EVENT_WRITE) events |= POLLOUT;
+	return events;
+}
+
+// errors are reported by the next read (or write)
+static int vpn_ws_client_poll_mask(short revents) {
+	int mask = 0;
+	if (revents & (POLLIN|POLLERR|POLLHUP)) mask |= VPN_WS_EVENT_READ;
+	if (revents & (POLLOUT|POLLERR|POLLHUP)) mask |= VPN_WS_EVENT_WRITE;
+	return mask;
+}
+
+// pfd[0] is the notification fd of the thread
+static void vpn_ws_client_poll(struct vpn_ws_client_thread *t, struct pollfd *pfd, int n, int timeout) {
+	pfd[0].fd = t->notify_fd[0];
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	int ret = poll(pfd, n, timeout);
+	if (ret < 0) {
+		if (errno == EINTR) return;
+		vpn_ws_error("vpn_ws_client_poll()/poll()");
+		vpn_ws_exit(1);
+	}
+	if (pfd[0].revents) {
+		vpn_ws_client_notify_drain(t);
+	}
+}
+
+// tap to websocket: pfd[1] is the tuntap device, then the sockets (negative fds are ignored by poll())
+static void *vpn_ws_client_tx_loop(void *arg) {
+	struct vpn_ws_client_thread *t = (struct vpn_ws_client_thread *) arg;
+	// 2 byte header + 8 byte size + 4 bytes masking + 2 bytes of vpn-ws-batch length + the biggest frame
+	static uint8_t mtu[16+VPN_WS_TAP_MAX];
+	struct pollfd pfd[2+VPN_WS_STREAMS_MAX];
+	int tap_ready = VPN_WS_EVENT_READ;
+	int i;
+	while(!__atomic_load_n(&vpn_ws_client_stopping, __ATOMIC_ACQUIRE)) {
+		// the pings of the main thread
+		vpn_ws_ring_msg msg;
+		while(vpn_ws_ring_pop(t->ring, &msg)) {
+			if (vpn_ws_client_queue_append(&vpn_ws_client_streams[msg.id].wq, msg.buf, msg.len)) goto fail;
+		}
+
+		// frames from the tuntap device, unless the server is congested
+		uint64_t frames = VPN_WS_BUDGET_FRAMES;
+		uint64_t budget = VPN_WS_BUDGET_BYTES;
+		while(frames > 0 && budget > 0 && (tap_ready & VPN_WS_EVENT_READ) && !vpn_ws_client_congested()) {
+			vpn_ws_recv(t->tuntap_fd, mtu+16, VPN_WS_TAP_MAX, rlen);
+			if (rlen <= 0) {
+				if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+					tap_ready &= ~VPN_WS_EVENT_READ;
+					break;
+				}
+				vpn_ws_error("vpn_ws_client_tx_loop()/read()");
+				vpn_ws_exit(1);
+			}
+			frames--;
+			budget -= (uint64_t) rlen < budget ? (uint64_t) rlen : budget;
+			if (vpn_ws_client_tap_frame(mtu+16, rlen, t->mask)) goto fail;
+		}
+
+		/*
+			the packets of the whole round in a single write. As in the server
+			the aggregated messages are closed at the end of the round: the
+			thread does nothing else, there are no frames to wait for
+		*/
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			if (vpn_ws_client_batch_flush(&vpn_ws_client_streams[i], t->mask)) goto fail;
+			if (vpn_ws_client_flush(&vpn_ws_client_streams[i])) goto fail;
+		}
+
+		int congested = vpn_ws_client_congested();
+		int timeout = (tap_ready & VPN_WS_EVENT_READ) && !congested ? 0 : -1;
+		pfd[1].fd = (tap_ready & VPN_WS_EVENT_READ) || congested ? -1 : t->tuntap_fd;
+		pfd[1].events = POLLIN;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+			pfd[2+i].fd = vpn_ws_client_queue_len(&s->wq) ? s->peer->fd : -1;
+			pfd[2+i].events = vpn_ws_client_poll_events(s->write_want);
+			pfd[2+i].revents = 0;
+		}
+		pfd[1].revents = 0;
+		vpn_ws_client_poll(t, pfd, 2 + vpn_ws_client_streams_n, timeout);
+		if (pfd[1].revents) tap_ready |= VPN_WS_EVENT_READ;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			vpn_ws_client_streams[i].write_ready |= vpn_ws_client_poll_mask(pfd[2+i].revents);
+		}
+	}
+	return NULL;
+fail:
+	vpn_ws_client_notify(&vpn_ws_client_main);
+	return NULL;
+}
+
+// websocket to tap (the same pfd layout of the tx thread)
+static void *vpn_ws_client_rx_loop(void *arg) {
+	struct vpn_ws_client_thread *t = (struct vpn_ws_client_thread *) arg;
+	struct pollfd pfd[2+VPN_WS_STREAMS_MAX];
+	int i;
+	vpn_ws_tap_ready = VPN_WS_EVENT_WRITE;
+	while(!__atomic_load_n(&vpn_ws_client_stopping, __ATOMIC_ACQUIRE)) {
+		vpn_ws_client_tap_flush(t->tuntap_fd);
+
+		// websocket packets (a budget for each connection), unless the tuntap device is congested
+		int timeout = -1;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+			uint64_t budget = VPN_WS_BUDGET_BYTES;
+			while(budget > 0 && (s->read_ready & s->read_want) && vpn_ws_client_queue_len(&vpn_ws_tq) < VPN_WS_CLIENT_QUEUE_MAX) {
+				ssize_t rlen = vpn_ws_client_read(s, 16384);
+				if (rlen < 0) goto fail;
+				if (rlen == 0) break;
+				if (vpn_ws_client_parse(s->peer, t->tuntap_fd)) goto fail;
+				budget -= (uint64_t) rlen < budget ? (uint64_t) rlen : budget;
+			}
+			// the budget is over, come back soon
+			if (s->read_ready & s->read_want) timeout = 0;
+		}
+
+		int congested = vpn_ws_client_queue_len(&vpn_ws_tq) >= VPN_WS_CLIENT_QUEUE_MAX;
+		pfd[1].fd = vpn_ws_client_queue_len(&vpn_ws_tq) ? t->tuntap_fd : -1;
+		pfd[1].events = POLLOUT;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+			pfd[2+i].fd = congested ? -1 : s->peer->fd;
+			pfd[2+i].events = vpn_ws_client_poll_events(s->read_want);
+			pfd[2+i].revents = 0;
+		}
+		pfd[1].revents = 0;
+		vpn_ws_client_poll(t, pfd, 2 + vpn_ws_client_streams_n, congested ? -1 : timeout);
+		if (pfd[1].revents) vpn_ws_tap_ready |= VPN_WS_EVENT_WRITE;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			vpn_ws_client_streams[i].read_ready |= vpn_ws_client_poll_mask(pfd[2+i].revents);
+		}
+	}
+	return NULL;
+fail:
+	vpn_ws_client_notify(&vpn_ws_client_main);
+	return NULL;
+}
+
+// run the threads until the connection fails
+static void vpn_ws_client_threads_run(vpn_ws_fd tuntap_fd, uint8_t *mask) {
+	vpn_ws_client_tx.tuntap_fd = tuntap_fd;
+	vpn_ws_client_tx.mask = mask;
+	vpn_ws_client_rx.tuntap_fd = tuntap_fd;
+	__atomic_store_n(&vpn_ws_client_stopping, 0, __ATOMIC_RELEASE);
+	if (pthread_create(&vpn_ws_client_tx.t, NULL, vpn_ws_client_tx_loop, &vpn_ws_client_tx)) {
+		vpn_ws_error("vpn_ws_client_threads_run()/pthread_create()");
+		vpn_ws_exit(1);
+	}
+	if (pthread_create(&vpn_ws_client_rx.t, NULL, vpn_ws_client_rx_loop, &vpn_ws_client_rx)) {
+		vpn_ws_error("vpn_ws_client_threads_run()/pthread_create()");
+		vpn_ws_exit(1);
+	}
+
+	// we send a websocket ping every 17 seconds (should be enough for every proxy out there)
+	for(;;) {
+		struct pollfd pfd;
+		pfd.fd = vpn_ws_client_main.notify_fd[0];
+		pfd.events = POLLIN;
+		int ret = poll(&pfd, 1, 17000);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			vpn_ws_error("vpn_ws_client_threads_run()/poll()");
+			vpn_ws_exit(1);
+		}
+		if (ret > 0) break;
+		int i;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			vpn_ws_ring_msg msg;
+			memset(&msg, 0, sizeof(vpn_ws_ring_msg));
+			msg.id = i;
+			msg.buf = (uint8_t *) "\x89\x00";
+			msg.len = 2;
+			// a full ring means a stuck tx thread, the ping is useless
+			vpn_ws_ring_push(vpn_ws_client_tx.ring, &msg);
+		}
+		vpn_ws_client_notify(&vpn_ws_client_tx);
+	}
+
+	__atomic_store_n(&vpn_ws_client_stopping, 1, __ATOMIC_RELEASE);
+	vpn_ws_client_notify(&vpn_ws_client_tx);
+	vpn_ws_client_notify(&vpn_ws_client_rx);
+	pthread_join(vpn_ws_client_tx.t, NULL);
+	pthread_join(vpn_ws_client_rx.t, NULL);
+	vpn_ws_client_notify_drain(&vpn_ws_client_main);
+	vpn_ws_client_notify_drain(&vpn_ws_client_tx);
+	vpn_ws_client_notify_drain(&vpn_ws_client_rx);
+	// pings not sent
+	vpn_ws_ring_msg msg;
+	while(vpn_ws_ring_pop(vpn_ws_client_tx.ring, &msg));
+}
+#endif
+
 int main(int argc, char *argv[]) {
 
 #ifndef __WIN32__
@@ -382,6 +1194,11 @@ int main(int argc, char *argv[]) {
 	WSAStartup(MAKEWORD(1, 1), &wsaData);
 #endif
 
+	vpn_ws_conf.batch_bytes = 16384;
+	vpn_ws_conf.batch_frames = 64;
+	vpn_ws_conf.batch_delay = 50;
+	vpn_ws_conf.deflate_min = 128;
+
 	int option_index = 0;
 	for(;;) {
                 int c = getopt_long(argc, argv, "", vpn_ws_options, &option_index);
@@ -398,6 +1215,28 @@ int main(int argc, char *argv[]) {
                         case 3:
                                 vpn_ws_conf.ssl_crt = optarg;
                                 break;
+			case 4:
+				vpn_ws_conf.batch_bytes = strtoull(optarg, NULL, 10);
+				break;
+			case 5:
+				vpn_ws_conf.batch_frames = strtoull(optarg, NULL, 10);
+				break;
+			case 6:
+				vpn_ws_conf.batch_delay = atoi(optarg);
+				break;
+			case 7:
+				vpn_ws_conf.deflate_min = strtoull(optarg, NULL, 10);
+				break;
+			case 8:
+				vpn_ws_conf.streams = atoi(optarg);
+				break;
+			case 9:
+				if (vpn_ws_conf.streams_dev_n >= VPN_WS_STREAMS_MAX) {
+					vpn_ws_warning("too many devices, max %d", VPN_WS_STREAMS_MAX);
+					vpn_ws_exit(1);
+				}
+				vpn_ws_conf.streams_dev[vpn_ws_conf.streams_dev_n++] = optarg;
+				break;
                         case '?':
                                 break;
                         default:
@@ -414,6 +1253,35 @@ int main(int argc, char *argv[]) {
 	vpn_ws_conf.tuntap_name = argv[optind];
 	vpn_ws_conf.server_addr = argv[optind+1];
 
+	if (!vpn_ws_conf.no_batch) {
+		// room for at least a full sized frame
+		if (vpn_ws_conf.batch_bytes < 2048) vpn_ws_conf.batch_bytes = 2048;
+		if (vpn_ws_conf.batch_frames < 1) vpn_ws_conf.batch_frames = 1;
+	}
+
+	if (vpn_ws_conf.streams < 1) vpn_ws_conf.streams = 1;
+	if (vpn_ws_conf.streams > VPN_WS_STREAMS_MAX) vpn_ws_conf.streams = VPN_WS_STREAMS_MAX;
+#ifdef __WIN32__
+	if (vpn_ws_conf.streams > 1) {
+		vpn_ws_warning("--streams is not supported on this platform, using a single connection");
+		vpn_ws_conf.streams = 1;
+	}
+	if (vpn_ws_conf.threads) {
+		vpn_ws_warning("--threads is not supported on this platform");
+		vpn_ws_conf.threads = 0;
+	}
+#endif
+
+	int i;
+	if (!vpn_ws_conf.no_batch) {
+		for(i=0;i<vpn_ws_conf.streams;i++) {
+			vpn_ws_client_streams[i].agg = vpn_ws_malloc(14 + vpn_ws_conf.batch_bytes);
+			if (!vpn_ws_client_streams[i].agg) {
+				vpn_ws_exit(1);
+			}
+		}
+	}
+
 	struct timeval tv;
 #ifndef __OpenBSD__
 	// initialize rnd engine
@@ -447,11 +1315,42 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	vpn_ws_peer *peer = NULL;
+#ifndef __WIN32__
+	// the tuntap device is registered once, the socket at every connection
+	int queue = vpn_ws_event_queue(2);
+	if (queue < 0) {
+		vpn_ws_exit(1);
+	}
+	void *events = vpn_ws_event_events(64);
+	if (!events) {
+		vpn_ws_exit(1);
+	}
+	if (vpn_ws_event_add_rw(queue, tuntap_fd)) {
+		vpn_ws_exit(1);
+	}
+	vpn_ws_tap_ready = VPN_WS_EVENT_READ|VPN_WS_EVENT_WRITE;
+
+	if (vpn_ws_conf.threads) {
+		if (vpn_ws_client_notify_init(&vpn_ws_client_main) ||
+			vpn_ws_client_notify_init(&vpn_ws_client_tx) ||
+			vpn_ws_client_notify_init(&vpn_ws_client_rx)) {
+			vpn_ws_exit(1);
+		}
+		vpn_ws_client_tx.ring = vpn_ws_ring_new(64);
+		if (!vpn_ws_client_tx.ring) {
+			vpn_ws_exit(1);
+		}
+		for(i=0;i<VPN_WS_STREAMS_MAX;i++) {
+			pthread_mutex_init(&vpn_ws_client_streams[i].lock, NULL);
+		}
+	}
+#endif
 
 	int throttle = -1;
 	// back here whenever the server disconnect
 reconnect:
+	vpn_ws_client_disconnect();
+	vpn_ws_client_streams_n = 0;
 	if (throttle > -1) {
 		vpn_ws_log("disconnected");
 	}
@@ -459,22 +1358,70 @@ reconnect:
 	throttle++;
 	if (throttle) sleep(throttle);
 
-	peer = vpn_ws_calloc(sizeof(vpn_ws_peer));
-        if (!peer) {
-		goto reconnect;
-        }
-	memcpy(peer->mac, vpn_ws_conf.tuntap_mac, 6);
+	// the server groups the connections of the client by a random id
+	uint64_t streams_id = 0;
+	while(vpn_ws_conf.streams > 1 && !streams_id) {
+#ifdef __OpenBSD__
+		streams_id = ((uint64_t) arc4random() << 32) | arc4random();
+#else
+		streams_id = ((uint64_t) rand() << 42) ^ ((uint64_t) rand() << 21) ^ (uint64_t) rand();
+#endif
+	}
 
-	if (vpn_ws_connect(peer, vpn_ws_conf.server_addr)) {
-		vpn_ws_client_destroy(peer);
-		goto reconnect;
+	int streams = vpn_ws_conf.streams;
+	for(i=0;i<streams;i++) {
+		struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+		s->peer = vpn_ws_peer_new();
+		if (!s->peer) {
+			goto reconnect;
+		}
+		memcpy(s->peer->mac, vpn_ws_conf.tuntap_mac, 6);
+
+		char *dev = NULL;
+		if (vpn_ws_conf.streams_dev_n > 0) {
+			dev = vpn_ws_conf.streams_dev[i % vpn_ws_conf.streams_dev_n];
+		}
+		if (vpn_ws_connect(s, vpn_ws_conf.server_addr, streams_id, dev)) {
+			goto reconnect;
+		}
+		// an old server, the first connection is enough
+		if (streams_id && !s->peer->streams_id) {
+			if (i > 0) {
+				goto reconnect;
+			}
+			vpn_ws_warning("the server does not support --streams, using a single connection");
+			streams = 1;
+		}
+
+		// frames aggregated (or queued) for the previous connection are lost
+		s->agg_len = 0;
+		s->agg_frames = 0;
+		vpn_ws_client_queue_consume(&s->wq, vpn_ws_client_queue_len(&s->wq));
+
+		if (vpn_ws_nb(s->peer->fd)) {
+			goto reconnect;
+		}
+
+		// TLS could already have buffered records
+		s->read_ready = VPN_WS_EVENT_READ|VPN_WS_EVENT_WRITE;
+		s->write_ready = VPN_WS_EVENT_READ|VPN_WS_EVENT_WRITE;
+		s->read_want = VPN_WS_EVENT_READ;
+		s->write_want = VPN_WS_EVENT_WRITE;
+
+#ifndef __WIN32__
+		// in threaded mode the threads poll the sockets by themselves
+		if (!vpn_ws_conf.threads && vpn_ws_event_add_rw(queue, s->peer->fd)) {
+			goto reconnect;
+		}
+#endif
 	}
+	vpn_ws_client_streams_n = streams;
 
-	// we set the socket in non blocking mode, albeit the code paths are all blocking
-	// it is only a secuity measure to avoid dead-blocking the process (as an example select() on Linux is a bit flacky)
-	if (vpn_ws_nb(peer->fd)) {
-		vpn_ws_client_destroy(peer);
-                goto reconnect;
+	// the kernel can send super-frames only if the server accepts them
+	if (vpn_ws_conf.tuntap_vnet) {
+		if (vpn_ws_tuntap_offload(tuntap_fd, vpn_ws_client_streams[0].peer->vnet ? VPN_WS_OFFLOAD_TSO : VPN_WS_OFFLOAD_NONE)) {
+			vpn_ws_exit(1);
+		}
 	}
 
 	uint8_t mask[4];
@@ -491,18 +1438,16 @@ reconnect:
 #endif
 
 #ifndef __WIN32__
-	fd_set rset;
-	// find the highest fd
-	int max_fd = peer->fd;
-	if (tuntap_fd > max_fd) max_fd = tuntap_fd;
-	max_fd++;
+	if (vpn_ws_conf.threads) {
+		vpn_ws_client_threads_run(tuntap_fd, mask);
+		goto reconnect;
+	}
 #else
 	WSAEVENT ev = WSACreateEvent();
-	WSAEventSelect((SOCKET)peer->fd, ev, FD_READ);
+	WSAEventSelect((SOCKET)vpn_ws_client_streams[0].peer->fd, ev, FD_READ);
 	OVERLAPPED overlapped_read;
 	memset(&overlapped_read, 0, sizeof(OVERLAPPED));
-	OVERLAPPED overlapped_write;
-	memset(&overlapped_write, 0, sizeof(OVERLAPPED));
+	memset(&vpn_ws_overlapped_write, 0, sizeof(OVERLAPPED));
 	overlapped_read.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
 	if (!overlapped_read.hEvent) {
 		vpn_ws_error("main()/CreateEvent()");
@@ -516,117 +1461,128 @@ reconnect:
 #endif
 
 	for(;;) {
+		// the aggregated messages have waited enough ?
+		int64_t agg_wait = -1;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+			int64_t wait = vpn_ws_client_batch_wait(s);
+			if (wait == 0) {
+				if (vpn_ws_client_batch_flush(s, mask)) {
+					goto reconnect;
+				}
+			}
+			else if (wait > 0 && (agg_wait < 0 || wait < agg_wait)) {
+				agg_wait = wait;
+			}
+		}
+		int busy = vpn_ws_client_busy();
 #ifndef __WIN32__
-		FD_ZERO(&rset);
-		FD_SET(peer->fd, &rset);
-		FD_SET(tuntap_fd, &rset);
-		tv.tv_sec = 17;
-		tv.tv_usec = 0;
 		// we send a websocket ping every 17 seconds (if inactive, should be enough
 		// for every proxy out there)
-		int ret = select(max_fd, &rset, NULL, NULL, &tv);
+		int timeout = 17000;
+		// sub-millisecond delays are busy polled
+		if (agg_wait > 0) timeout = agg_wait / 1000;
+		if (busy) timeout = 0;
+		int ret = vpn_ws_event_wait(queue, events, timeout);
 		if (ret < 0) {
 			// the process manager will save us here
-			vpn_ws_error("main()/select()");
 			vpn_ws_exit(1);
 		}
-		if (ret == 0) {
+		int j;
+		for(i=0;i<ret;i++) {
+			int fd = vpn_ws_event_fd(events, i);
+			if (fd == tuntap_fd) {
+				vpn_ws_tap_ready |= vpn_ws_event_mask(events, i);
+				continue;
+			}
+			for(j=0;j<vpn_ws_client_streams_n;j++) {
+				if (fd == vpn_ws_client_streams[j].peer->fd) {
+					vpn_ws_client_streams[j].read_ready |= vpn_ws_event_mask(events, i);
+					vpn_ws_client_streams[j].write_ready |= vpn_ws_event_mask(events, i);
+					break;
+				}
+			}
+		}
+		if (ret == 0 && timeout == 17000) {
 #else
-		DWORD ret = WaitForMultipleObjects(2, waiting_objects, FALSE, 17000);
+		DWORD ret = WaitForMultipleObjects(2, waiting_objects, FALSE, busy ? 0 : agg_wait > 0 ? (agg_wait + 999) / 1000 : 17000);
 		if (ret == WAIT_FAILED) {
 			vpn_ws_error("main()/WaitForMultipleObjects()");
 			vpn_ws_exit(1);
 		}
-		if (ret == WAIT_TIMEOUT) {
+		if (ret == WAIT_OBJECT_0) {
+			vpn_ws_client_streams[0].read_ready |= VPN_WS_EVENT_READ;
+			WSAResetEvent(ev);
+		}
+		if (ret == WAIT_TIMEOUT && !busy && agg_wait < 0) {
 #endif
-
-		// too much inactivity, send a ping
-			if (vpn_ws_client_write(peer, (uint8_t *) "\x89\x00", 2)) {
-				vpn_ws_client_destroy(peer);
-                		goto reconnect;
-			}			
+			// too much inactivity, send a ping (on every connection)
+			for(i=0;i<vpn_ws_client_streams_n;i++) {
+				if (vpn_ws_client_write(&vpn_ws_client_streams[i], (uint8_t *) "\x89\x00", 2)) {
+					goto reconnect;
+				}
+			}
 			continue;
 		}
 
-
-#ifndef __WIN32__
-		if (FD_ISSET(peer->fd, &rset)) {
-#else
-		if (ret == WAIT_OBJECT_0) {
-#endif
-			if (vpn_ws_client_read(peer, 8192)) {
-				vpn_ws_client_destroy(peer);
-                		goto reconnect;
+		// the queues first (a TLS write could wait for the socket to be readable)
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			if (vpn_ws_client_flush(&vpn_ws_client_streams[i])) {
+				goto reconnect;
 			}
-			
-#ifdef __WIN32__
-			WSAResetEvent(ev);
+		}
+#ifndef __WIN32__
+		vpn_ws_client_tap_flush(tuntap_fd);
 #endif
-			// start getting websocket packets
-			for(;;) {
-				uint16_t ws_header = 0;
-				int64_t rlen = vpn_ws_websocket_parse(peer, &ws_header);
+
+		// websocket packets (a budget for each connection), unless the tuntap device is congested
+		uint64_t budget;
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			struct vpn_ws_client_stream *s = &vpn_ws_client_streams[i];
+			budget = VPN_WS_BUDGET_BYTES;
+			while(budget > 0 && (s->read_ready & s->read_want) && vpn_ws_client_queue_len(&vpn_ws_tq) < VPN_WS_CLIENT_QUEUE_MAX) {
+				ssize_t rlen = vpn_ws_client_read(s, 16384);
 				if (rlen < 0) {
-					vpn_ws_client_destroy(peer);
-                                	goto reconnect;
+					goto reconnect;
 				}
 				if (rlen == 0) break;
-				// ignore packet ?
-				if (ws_header == 0) goto decapitate;
-				// is it a masked packet ?
-				uint8_t *ws = peer->buf + ws_header;
-				uint64_t ws_len = rlen - ws_header;
-				if (peer->has_mask) {
-                			uint16_t i;
-                			for (i=0;i<ws_len;i++) {
-                         			ws[i] = ws[i] ^ peer->mask[i % 4];
-                			}
-				}
-
-#ifndef __WIN32__
-				if (vpn_ws_full_write(tuntap_fd, (char *)ws, ws_len)) {
-					// being not able to write on tuntap is really bad...
-					vpn_ws_exit(1);
+				if (vpn_ws_client_parse(s->peer, tuntap_fd)) {
+					goto reconnect;
 				}
-#else
-				ssize_t wlen = -1;
-				if (!WriteFile(tuntap_fd, ws, ws_len, (LPDWORD) &wlen, &overlapped_write)) {
-					if (GetLastError() != ERROR_IO_PENDING) {
-						vpn_ws_error("main()/WriteFile()");
-						vpn_ws_exit(1);
-					}
-					if (!GetOverlappedResult(tuntap_fd, &overlapped_write, (LPDWORD) &wlen, TRUE)) {
-						vpn_ws_error("main()/GetOverlappedResult()");
-                                        	vpn_ws_exit(1);
-					}	
-				}	
-#endif
-
-decapitate:
-				memmove(peer->buf, peer->buf + rlen, peer->pos - rlen);
-        			peer->pos -= rlen;
+				budget -= (uint64_t) rlen < budget ? (uint64_t) rlen : budget;
 			}
 		}
 
-		
 #ifndef __WIN32__
-		if (FD_ISSET(tuntap_fd, &rset)) {
+		// frames from the tuntap device, unless the server is congested
+		uint64_t frames = VPN_WS_BUDGET_FRAMES;
+		budget = VPN_WS_BUDGET_BYTES;
+		while(frames > 0 && budget > 0 && (vpn_ws_tap_ready & VPN_WS_EVENT_READ) && !vpn_ws_client_congested()) {
 			// we use this buffer for the websocket packet too
-			// 2 byte header + 2 byte size + 4 bytes masking + mtu
-			uint8_t mtu[8+1500];
-			vpn_ws_recv(tuntap_fd, mtu+8, 1500, rlen);
+			// 2 byte header + 8 byte size + 4 bytes masking + 2 bytes of vpn-ws-batch length + the biggest frame
+			static uint8_t mtu[16+VPN_WS_TAP_MAX];
+			vpn_ws_recv(tuntap_fd, mtu+16, VPN_WS_TAP_MAX, rlen);
 			if (rlen <= 0) {
-				if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) continue;
+				if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+					vpn_ws_tap_ready &= ~VPN_WS_EVENT_READ;
+					break;
+				}
 				vpn_ws_error("main()/read()");
                         	vpn_ws_exit(1);
 			}
+			frames--;
+			budget -= (uint64_t) rlen < budget ? (uint64_t) rlen : budget;
+			if (vpn_ws_client_tap_frame(mtu+16, rlen, mask)) {
+				goto reconnect;
+			}
+		}
 #else
-		if (ret == WAIT_OBJECT_0+1 || WaitForSingleObject(overlapped_read.hEvent, 0) == WAIT_OBJECT_0) {
-			uint8_t mtu[8+1500];
+		if (!vpn_ws_client_congested() && (ret == WAIT_OBJECT_0+1 || WaitForSingleObject(overlapped_read.hEvent, 0) == WAIT_OBJECT_0)) {
+			static uint8_t mtu[16+1500];
 			ssize_t rlen = -1;
 			// the tuntap is not reading, call ReadFile
 			if (!tuntap_is_reading) {
-				if (!ReadFile(tuntap_fd, mtu+8, 1500, (LPDWORD) &rlen, &overlapped_read)) {
+				if (!ReadFile(tuntap_fd, mtu+16, 1500, (LPDWORD) &rlen, &overlapped_read)) {
 					if (GetLastError() != ERROR_IO_PENDING) {
 						vpn_ws_error("main()/ReadFile()");
 						vpn_ws_exit(1);
@@ -646,40 +1602,17 @@ decapitate:
 				tuntap_is_reading = 0;
 				SetEvent(overlapped_read.hEvent);
 			}
-#endif
-
-
-			// mask packet
-			ssize_t i;
-			for (i=0;i<rlen;i++) {
-                        	mtu[8+i] = mtu[8+i] ^ mask[i % 4];
+			if (vpn_ws_client_tap_frame(mtu+16, rlen, mask)) {
+				goto reconnect;
 			}
-
-			mtu[4] = mask[0];
-                        mtu[5] = mask[1];
-                        mtu[6] = mask[2];
-                        mtu[7] = mask[3];
-
-			if (rlen < 126) {
-				mtu[2] = 0x82;
-				mtu[3] = rlen | 0x80;
-				if (vpn_ws_client_write(peer, mtu + 2, rlen + 6)) {
-					vpn_ws_client_destroy(peer);
-					goto reconnect;
-				}
-			}
-			else {
-				mtu[0] = 0x82;
-				mtu[1] = 126 | 0x80;
-				mtu[2] = (uint8_t) ((rlen >> 8) & 0xff);
-				mtu[3] = (uint8_t) (rlen & 0xff);
-				if (vpn_ws_client_write(peer, mtu, rlen + 8)) {
-					vpn_ws_client_destroy(peer);
-					goto reconnect;
-				}
+		}
+#endif
+		// the packets of the whole round in a single write (and with TLS in full sized records)
+		for(i=0;i<vpn_ws_client_streams_n;i++) {
+			if (vpn_ws_client_flush(&vpn_ws_client_streams[i])) {
+				goto reconnect;
 			}
 		}
-
 	}
 
 	return 0;
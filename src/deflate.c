@@ -0,0 +1,329 @@
+#include "vpn-ws.h"
+#include <zlib.h>
+
+/*
+	permessage-deflate (RFC 7692): a message is compressed with raw deflate and
+	sync flushed, the empty stored block (00 00 ff ff) at its end is stripped by
+	the sender and appended again by the receiver.
+	The contexts survive between messages (unless a side asked for no context
+	takeover), they are allocated when the first message is compressed (or inflated)
+*/
+
+// speed matters more than ratio here
+#define VPN_WS_DEFLATE_LEVEL	Z_BEST_SPEED
+// the ratio is checked every VPN_WS_DEFLATE_SAMPLE compressed bytes ...
+#define VPN_WS_DEFLATE_SAMPLE	(256 * 1024)
+// ... if the output is bigger than VPN_WS_DEFLATE_RATIO% of the input ...
+#define VPN_WS_DEFLATE_RATIO	90
+// ... the next VPN_WS_DEFLATE_BACKOFF bytes are sent uncompressed
+#define VPN_WS_DEFLATE_BACKOFF	(16 * 1024 * 1024)
+
+struct vpn_ws_deflate {
+	z_stream out;
+	z_stream in;
+	uint8_t out_ready;
+	uint8_t in_ready;
+	int out_bits;
+	// reset the compressor (or the decompressor) after each message
+	uint8_t out_no_takeover;
+	uint8_t in_no_takeover;
+	// the message being inflated: the trailer has been appended, the sender ended the stream
+	uint8_t in_tail;
+	uint8_t in_end;
+	// compressed bytes (in and out) of the current sample
+	uint64_t sample_in;
+	uint64_t sample_out;
+	// bytes still to send uncompressed (the ratio was poor)
+	uint64_t backoff;
+};
+
+// the parameters of a permessage-deflate offer (or response), 0 bits means not specified
+struct vpn_ws_deflate_offer {
+	uint8_t server_no_takeover;
+	uint8_t client_no_takeover;
+	int server_bits;
+	// -1 if specified without a value (allowed only in offers)
+	int client_bits;
+};
+
+static void vpn_ws_deflate_trim(char **buf, uint64_t *len) {
+	while(*len > 0 && (**buf == ' ' || **buf == '\t')) {
+		(*buf)++;
+		(*len)--;
+	}
+	while(*len > 0 && ((*buf)[*len-1] == ' ' || (*buf)[*len-1] == '\t')) (*len)--;
+}
+
+// a window bits value (8-15, it can be quoted), -1 if it is not valid
+static int vpn_ws_deflate_bits(char *value, uint64_t len) {
+	if (len >= 2 && value[0] == '"' && value[len-1] == '"') {
+		value++;
+		len -= 2;
+	}
+	if (len < 1 || len > 2) return -1;
+	int bits = 0;
+	uint64_t i;
+	for(i=0;i<len;i++) {
+		if (!isdigit((int) value[i])) return -1;
+		bits = (bits * 10) + (value[i] - '0');
+	}
+	if (bits < 8 || bits > 15) return -1;
+	return bits;
+}
+
+/*
+	parse an element of a Sec-WebSocket-Extensions header.
+	Returns 1 if it is a valid permessage-deflate one, 0 if it is another extension, -1 if it is not valid
+*/
+static int vpn_ws_deflate_offer(char *buf, uint64_t len, struct vpn_ws_deflate_offer *o) {
+	memset(o, 0, sizeof(struct vpn_ws_deflate_offer));
+	int first = 1;
+	while(len > 0 || first) {
+		char *semicolon = memchr(buf, ';', len);
+		uint64_t param_len = semicolon ? (uint64_t) (semicolon - buf) : len;
+		char *param = buf;
+		buf += param_len;
+		len -= param_len;
+		if (semicolon) {
+			buf++;
+			len--;
+		}
+		vpn_ws_deflate_trim(&param, &param_len);
+
+		if (first) {
+			if (param_len != sizeof(VPN_WS_DEFLATE_EXT)-1 || strncasecmp(param, VPN_WS_DEFLATE_EXT, param_len)) return 0;
+			first = 0;
+			continue;
+		}
+
+		char *value = memchr(param, '=', param_len);
+		uint64_t value_len = 0;
+		uint64_t name_len = param_len;
+		if (value) {
+			name_len = value - param;
+			value++;
+			value_len = param_len - (name_len + 1);
+			vpn_ws_deflate_trim(&value, &value_len);
+		}
+		vpn_ws_deflate_trim(&param, &name_len);
+
+		// every parameter can be specified only once
+		if (name_len == 26 && !strncasecmp(param, "server_no_context_takeover", 26) && !value && !o->server_no_takeover) {
+			o->server_no_takeover = 1;
+		}
+		else if (name_len == 26 && !strncasecmp(param, "client_no_context_takeover", 26) && !value && !o->client_no_takeover) {
+			o->client_no_takeover = 1;
+		}
+		else if (name_len == 22 && !strncasecmp(param, "server_max_window_bits", 22) && value && !o->server_bits) {
+			o->server_bits = vpn_ws_deflate_bits(value, value_len);
+			if (o->server_bits < 0) return -1;
+		}
+		else if (name_len == 22 && !strncasecmp(param, "client_max_window_bits", 22) && !o->client_bits) {
+			o->client_bits = value ? vpn_ws_deflate_bits(value, value_len) : -1;
+			if (value && o->client_bits < 0) return -1;
+		}
+		else {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/*
+	server: accept the first usable permessage-deflate offer of the client (1, 0 if there is none).
+	client: parse the response of the server (1, 0 if compression has been refused, -1 if it is not valid)
+*/
+int vpn_ws_deflate_negotiate(char *buf, uint64_t len, int server, vpn_ws_deflate_params *p) {
+	memset(p, 0, sizeof(vpn_ws_deflate_params));
+	while(len > 0) {
+		char *comma = memchr(buf, ',', len);
+		uint64_t offer_len = comma ? (uint64_t) (comma - buf) : len;
+		struct vpn_ws_deflate_offer o;
+		int ret = vpn_ws_deflate_offer(buf, offer_len, &o);
+		buf += offer_len;
+		len -= offer_len;
+		if (comma) {
+			buf++;
+			len--;
+		}
+		if (ret == 0) continue;
+
+		if (!server) {
+			// the server can only set a value we can honour (zlib cannot compress with a 256 bytes window)
+			if (ret < 0 || o.client_bits < 0 || o.client_bits == 8) return -1;
+			p->out_bits = o.client_bits ? o.client_bits : 15;
+			p->out_no_takeover = o.client_no_takeover || vpn_ws_conf.deflate_no_takeover;
+			p->in_no_takeover = o.server_no_takeover;
+			return 1;
+		}
+
+		// fallback to the next offer
+		if (ret < 0 || o.server_bits == 8) continue;
+		p->out_bits = o.server_bits ? o.server_bits : 15;
+		p->bits_offered = o.server_bits;
+		p->out_no_takeover = o.server_no_takeover || vpn_ws_conf.deflate_no_takeover;
+		// the server can ask it even if the client did not offer it
+		p->in_no_takeover = o.client_no_takeover || vpn_ws_conf.deflate_no_takeover;
+		return 1;
+	}
+	return 0;
+}
+
+// the value of the Sec-WebSocket-Extensions header accepting an offer (-1 if it does not fit)
+int vpn_ws_deflate_response(vpn_ws_deflate_params *p, char *buf, uint64_t len) {
+	int ret = snprintf(buf, len, "%s%s%s", VPN_WS_DEFLATE_EXT,
+		p->out_no_takeover ? "; server_no_context_takeover" : "",
+		p->in_no_takeover ? "; client_no_context_takeover" : "");
+	if (ret <= 0 || (uint64_t) ret >= len) return -1;
+	if (p->bits_offered) {
+		int ret2 = snprintf(buf + ret, len - ret, "; server_max_window_bits=%d", p->out_bits);
+		if (ret2 <= 0 || (uint64_t) ret2 >= len - ret) return -1;
+		ret += ret2;
+	}
+	return ret;
+}
+
+struct vpn_ws_deflate *vpn_ws_deflate_new(vpn_ws_deflate_params *p) {
+	struct vpn_ws_deflate *zs = vpn_ws_calloc(sizeof(struct vpn_ws_deflate));
+	if (!zs) return NULL;
+	zs->out_bits = p->out_bits;
+	zs->out_no_takeover = p->out_no_takeover;
+	zs->in_no_takeover = p->in_no_takeover;
+	return zs;
+}
+
+void vpn_ws_deflate_free(struct vpn_ws_deflate *zs) {
+	if (zs->out_ready) deflateEnd(&zs->out);
+	if (zs->in_ready) inflateEnd(&zs->in);
+	free(zs);
+}
+
+/*
+	check if a message should be compressed: it must not be too small, and the
+	last sample must have been compressed well enough (the incompressible
+	traffic, like TLS, would only burn cpu)
+*/
+int vpn_ws_deflate_wanted(struct vpn_ws_deflate *zs, uint64_t len) {
+	if (len < vpn_ws_conf.deflate_min) return 0;
+	if (zs->backoff > 0) {
+		zs->backoff -= len < zs->backoff ? len : zs->backoff;
+		return 0;
+	}
+	return 1;
+}
+
+// the room needed for a compressed message (the conservative deflateBound() plus the flush)
+uint64_t vpn_ws_deflate_bound(uint64_t len) {
+	return len + ((len + 7) >> 3) + ((len + 63) >> 6) + 5 + 6;
+}
+
+/*
+	compress a message (made of iovcnt parts), out must be vpn_ws_deflate_bound() bytes.
+	Returns the compressed size, -1 on error (the context is no more usable)
+*/
+int64_t vpn_ws_deflate(struct vpn_ws_deflate *zs, struct iovec *iov, int iovcnt, uint8_t *out, uint64_t out_len) {
+	z_stream *z = &zs->out;
+	if (!zs->out_ready) {
+		memset(z, 0, sizeof(z_stream));
+		if (deflateInit2(z, VPN_WS_DEFLATE_LEVEL, Z_DEFLATED, -zs->out_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			vpn_ws_log("vpn_ws_deflate()/deflateInit2(): unable to initialize the compressor");
+			return -1;
+		}
+		zs->out_ready = 1;
+	}
+
+	z->next_out = out;
+	z->avail_out = out_len;
+	uint64_t len = 0;
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		if (iov[i].iov_len == 0) continue;
+		z->next_in = iov[i].iov_base;
+		z->avail_in = iov[i].iov_len;
+		if (deflate(z, Z_NO_FLUSH) != Z_OK || z->avail_in > 0) goto error;
+		len += iov[i].iov_len;
+	}
+	if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_out == 0) goto error;
+
+	uint64_t zlen = out_len - z->avail_out;
+	// strip the empty stored block
+	if (zlen < 4) goto error;
+	zlen -= 4;
+	if (zs->out_no_takeover) deflateReset(z);
+
+	zs->sample_in += len;
+	zs->sample_out += zlen;
+	if (zs->sample_in >= VPN_WS_DEFLATE_SAMPLE) {
+		if (zs->sample_out * 100 > zs->sample_in * VPN_WS_DEFLATE_RATIO) {
+			zs->backoff = VPN_WS_DEFLATE_BACKOFF;
+			// a new compressor will be allocated when compressing again (the receiver does not care)
+			deflateEnd(z);
+			zs->out_ready = 0;
+		}
+		zs->sample_in = 0;
+		zs->sample_out = 0;
+	}
+	return zlen;
+
+error:
+	vpn_ws_log("vpn_ws_deflate()/deflate(): unable to compress the message");
+	return -1;
+}
+
+// start inflating a message
+int vpn_ws_inflate_begin(struct vpn_ws_deflate *zs, uint8_t *buf, uint64_t len) {
+	z_stream *z = &zs->in;
+	if (!zs->in_ready) {
+		memset(z, 0, sizeof(z_stream));
+		// the window of the sender can only be smaller
+		if (inflateInit2(z, -15) != Z_OK) {
+			vpn_ws_log("vpn_ws_inflate_begin()/inflateInit2(): unable to initialize the decompressor");
+			return -1;
+		}
+		zs->in_ready = 1;
+	}
+	z->next_in = buf;
+	z->avail_in = len;
+	zs->in_tail = 0;
+	return 0;
+}
+
+/*
+	inflate the current message in out, call it again until the returned size
+	is smaller than out_len (the whole message has been inflated).
+	Returns -1 if the message is not valid
+*/
+int64_t vpn_ws_inflate_next(struct vpn_ws_deflate *zs, uint8_t *out, uint64_t out_len) {
+	static uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	z_stream *z = &zs->in;
+	z->next_out = out;
+	z->avail_out = out_len;
+	for(;;) {
+		if (z->avail_in == 0 && !zs->in_tail && !zs->in_end) {
+			z->next_in = tail;
+			z->avail_in = 4;
+			zs->in_tail = 1;
+		}
+		int ret = inflate(z, Z_SYNC_FLUSH);
+		// the sender ended the stream (with a final block), the next message will start a new one
+		if (ret == Z_STREAM_END) {
+			z->avail_in = 0;
+			zs->in_end = 1;
+			break;
+		}
+		// nothing more to inflate
+		if (ret == Z_BUF_ERROR) break;
+		if (ret != Z_OK) {
+			vpn_ws_log("vpn_ws_inflate_next()/inflate(): invalid compressed message");
+			return -1;
+		}
+		if (z->avail_out == 0) break;
+		if (z->avail_in == 0 && zs->in_tail) break;
+	}
+	// the message is complete
+	if (z->avail_out > 0 && (zs->in_no_takeover || zs->in_end)) {
+		inflateReset(z);
+		zs->in_end = 0;
+	}
+	return out_len - z->avail_out;
+}
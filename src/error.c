@@ -3,7 +3,13 @@
 static void vpn_ws_do_log(FILE *stream, const char *fmt, va_list args)
 {
 	time_t t = time(NULL);
-	fprintf(stream, "[%.*s] ", 24, ctime(&t));
+#ifndef __WIN32__
+	char ts[26];
+	ctime_r(&t, ts);
+#else
+	char *ts = ctime(&t);
+#endif
+	fprintf(stream, "[%.*s] ", 24, ts);
 	vfprintf(stream, fmt, args);
 	fputc('\n', stream);
 }
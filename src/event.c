@@ -13,28 +13,20 @@ int vpn_ws_event_queue(int n) {
 	return ret;
 }
 
-int vpn_ws_event_read_to_write(int queue, int fd) {
+/*
+	peers are registered (edge triggered) for both reading and writing,
+	so there is no need to switch modes when a write cannot be completed
+*/
+int vpn_ws_event_add_rw(int queue, int fd) {
 	struct epoll_event ev;
-        ev.events = EPOLLOUT;
-        ev.data.fd = fd;
-        int ret = epoll_ctl(queue, EPOLL_CTL_MOD, fd, &ev);
-        if (ret < 0) {
-                vpn_ws_error("vpn_ws_event_read_to_write()/epoll_ctl()");
-                return -1;
-        }
-        return ret;
-}
-
-int vpn_ws_event_write_to_read(int queue, int fd) {
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.fd = fd;
-        int ret = epoll_ctl(queue, EPOLL_CTL_MOD, fd, &ev);
-        if (ret < 0) {
-                vpn_ws_error("vpn_ws_event_read_to_write()/epoll_ctl()");
-                return -1;
-        }
-        return ret;
+	ev.events = EPOLLIN|EPOLLOUT|EPOLLET;
+	ev.data.fd = fd;
+	int ret = epoll_ctl(queue, EPOLL_CTL_ADD, fd, &ev);
+	if (ret < 0) {
+		vpn_ws_error("vpn_ws_event_add_rw()/epoll_ctl()");
+		return -1;
+	}
+	return ret;
 }
 
 int vpn_ws_event_add_read(int queue, int fd) {
@@ -49,8 +41,9 @@ int vpn_ws_event_add_read(int queue, int fd) {
 	return ret;
 }
 
-int vpn_ws_event_wait(int queue, void *events) {
-	int ret = epoll_wait(queue, events, 64, -1);
+// timeout is in milliseconds (-1 for waiting forever)
+int vpn_ws_event_wait(int queue, void *events, int timeout) {
+	int ret = epoll_wait(queue, events, 64, timeout);
 	if (ret < 0) {
 		vpn_ws_error("vpn_ws_event_wait()/epoll_wait()");
                 return -1;
@@ -67,6 +60,15 @@ int vpn_ws_event_fd(void *events, int i) {
 	return epoll_events[i].data.fd;
 }
 
+int vpn_ws_event_mask(void *events, int i) {
+	struct epoll_event *epoll_events = (struct epoll_event *) events;
+	int mask = 0;
+	// errors and hangups are reported by read()
+	if (epoll_events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) mask |= VPN_WS_EVENT_READ;
+	if (epoll_events[i].events & EPOLLOUT) mask |= VPN_WS_EVENT_WRITE;
+	return mask;
+}
+
 #elif defined(__FreeBSD__) || defined(__APPLE__) || defined(__OpenBSD__)
 
 #include <sys/event.h>
@@ -80,35 +82,13 @@ int vpn_ws_event_queue(int n) {
         return ret;
 }
 
-int vpn_ws_event_read_to_write(int queue, int fd) {
-	struct kevent kev;
+int vpn_ws_event_add_rw(int queue, int fd) {
+	struct kevent kev[2];
 
-	EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
-        if (kevent(queue, &kev, 1, NULL, 0, NULL) < 0) {
-		vpn_ws_error("vpn_ws_event_read_to_write()/kevent()");
-                return -1;
-        }
-
-        EV_SET(&kev, fd, EVFILT_WRITE, EV_ADD, 0, 0, 0);
-        if (kevent(queue, &kev, 1, NULL, 0, NULL) < 0) {
-		vpn_ws_error("vpn_ws_event_read_to_write()/kevent()");
-                return -1;
-        }
-        return 0;
-}
-
-int vpn_ws_event_write_to_read(int queue, int fd) {
-	struct kevent kev;
-        
-        EV_SET(&kev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
-        if (kevent(queue, &kev, 1, NULL, 0, NULL) < 0) {
-                vpn_ws_error("vpn_ws_event_write_to_read()/kevent()");
-                return -1;
-        }
-        
-        EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
-        if (kevent(queue, &kev, 1, NULL, 0, NULL) < 0) {
-                vpn_ws_error("vpn_ws_event_write_to_read()/kevent()");
+	EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD|EV_CLEAR, 0, 0, 0);
+	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD|EV_CLEAR, 0, 0, 0);
+        if (kevent(queue, kev, 2, NULL, 0, NULL) < 0) {
+                vpn_ws_error("vpn_ws_event_add_rw()/kevent()");
                 return -1;
         }
         return 0;
@@ -125,8 +105,11 @@ int vpn_ws_event_add_read(int queue, int fd) {
         return 0;
 }
 
-int vpn_ws_event_wait(int queue, void *events) {
-        int ret = kevent(queue, NULL, 0, events, 64, NULL);
+int vpn_ws_event_wait(int queue, void *events, int timeout) {
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+        int ret = kevent(queue, NULL, 0, events, 64, timeout < 0 ? NULL : &ts);
         if (ret < 0) {
                 vpn_ws_error("vpn_ws_event_wait()/kevent()");
         }
@@ -142,17 +125,19 @@ int vpn_ws_event_fd(void *events, int i) {
         return k_events[i].ident;
 }
 
+int vpn_ws_event_mask(void *events, int i) {
+        struct kevent *k_events = (struct kevent *) events;
+	if (k_events[i].filter == EVFILT_WRITE) return VPN_WS_EVENT_WRITE;
+        return VPN_WS_EVENT_READ;
+}
+
 #elif defined(__WIN32__)
 
 int vpn_ws_event_queue(int n) {
 	return -1;
 }
 
-int vpn_ws_event_read_to_write(int queue, vpn_ws_fd fd) {
-	return -1;
-}
-
-int vpn_ws_event_write_to_read(int queue, vpn_ws_fd fd) {
+int vpn_ws_event_add_rw(int queue, vpn_ws_fd fd) {
 	return -1;
 }
 
@@ -160,7 +145,7 @@ int vpn_ws_event_add_read(int queue, vpn_ws_fd fd) {
 	return -1;
 }
 
-int vpn_ws_event_wait(int queue, void *events) {
+int vpn_ws_event_wait(int queue, void *events, int timeout) {
 	return -1;
 }
 
@@ -172,4 +157,8 @@ int vpn_ws_event_fd(void *events, int i) {
 	return -1;
 }
 
+int vpn_ws_event_mask(void *events, int i) {
+	return 0;
+}
+
 #endif
@@ -0,0 +1,78 @@
+#include "vpn-ws.h"
+
+/*
+
+	flow hashing (--streams)
+
+	the frames of a flow (addresses, protocol and ports) always get the same
+	hash, so they take the same connection and keep their order.
+	IPv4 fragments have no ports, so (all of) the frames of fragmented packets
+	are hashed only by addresses and protocol. Frames that are not IP (ARP and
+	so on) hash to 0.
+
+*/
+
+// FNV-1a
+static uint64_t vpn_ws_flow_mix(uint64_t h, uint8_t *buf, uint64_t len) {
+	uint64_t i;
+	for(i=0;i<len;i++) {
+		h ^= buf[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+uint64_t vpn_ws_flow_hash(uint8_t *eth, uint64_t len) {
+	if (len < 14) return 0;
+	uint64_t off = 12;
+	uint16_t type = (eth[off] << 8) | eth[off+1];
+	off += 2;
+	// skip 802.1Q (and 802.1ad) tags
+	while((type == 0x8100 || type == 0x88a8) && len >= off + 4) {
+		type = (eth[off+2] << 8) | eth[off+3];
+		off += 4;
+	}
+
+	uint8_t *ip = eth + off;
+	uint64_t ip_len = len - off;
+	uint8_t *l4 = NULL;
+	uint64_t l4_len = 0;
+	uint8_t proto = 0;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	if (type == 0x0800) {
+		if (ip_len < 20) return 0;
+		uint64_t ihl = (ip[0] & 0x0f) * 4;
+		if (ihl < 20 || ip_len < ihl) return 0;
+		proto = ip[9];
+		h = vpn_ws_flow_mix(h, ip + 12, 8);
+		// not a fragment (no more fragments flag, offset 0)
+		if (!(ip[6] & 0x3f) && !ip[7]) {
+			l4 = ip + ihl;
+			l4_len = ip_len - ihl;
+		}
+	}
+	else if (type == 0x86dd) {
+		if (ip_len < 40) return 0;
+		// extension headers are not followed
+		proto = ip[6];
+		h = vpn_ws_flow_mix(h, ip + 8, 32);
+		l4 = ip + 40;
+		l4_len = ip_len - 40;
+	}
+	else {
+		return 0;
+	}
+
+	h = vpn_ws_flow_mix(h, &proto, 1);
+	// tcp, udp, sctp and udplite start with the ports
+	if (l4 && l4_len >= 4 && (proto == 6 || proto == 17 || proto == 132 || proto == 136)) {
+		h = vpn_ws_flow_mix(h, l4, 4);
+	}
+
+	// the low bits of FNV are weak, finalize them
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
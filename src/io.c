@@ -1,99 +1,375 @@
 #include "vpn-ws.h"
 
+/*
+	egress: frames are written directly when nothing is queued, otherwise
+	the egress queue of the peer points to them (frames living in a frame buffer
+	are referenced, only the unsent part of the others is copied). The queue of
+	a stream is flushed with a single writev(), tap devices instead get
+	exactly one frame for each write.
+	In pipeline mode frames are always queued, and the queues are flushed
+	at the end of the cycle.
+*/
+
+static ssize_t vpn_ws_writev_fd(vpn_ws_fd fd, struct iovec *iov, int iovcnt) {
+#ifndef __WIN32__
+	return writev(fd, iov, iovcnt);
+#else
+	ssize_t total = 0;
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		vpn_ws_send(fd, iov[i].iov_base, iov[i].iov_len, wlen);
+		if (wlen < 0) return total > 0 ? total : -1;
+		total += wlen;
+		if ((size_t) wlen < iov[i].iov_len) break;
+	}
+	return total;
+#endif
+}
+
+// account written bytes
+static void vpn_ws_peer_egress_sub(vpn_ws_peer *peer, uint64_t amount) {
+	__atomic_sub_fetch(&peer->out_bytes, amount, __ATOMIC_RELAXED);
+	if (peer->worker) {
+		__atomic_store_n(&peer->worker->egress_bytes, peer->worker->egress_bytes - amount, __ATOMIC_RELAXED);
+	}
+}
+
+// remove amount bytes from the head of the egress queue
+static void vpn_ws_peer_dequeue(vpn_ws_peer *peer, uint64_t amount) {
+	uint64_t freed = 0;
+	peer->out_head = vpn_ws_frames_consume(peer->out_head, amount, &freed);
+	if (!peer->out_head) peer->out_tail = NULL;
+	peer->out_frames -= freed;
+	vpn_ws_peer_egress_sub(peer, amount);
+}
+
+// append a frame to the egress queue (it will point to the buffer, no copy is made)
+static int vpn_ws_peer_enqueue(vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *data, uint64_t len) {
+	vpn_ws_frame *frame = vpn_ws_frame_new(fb, data, len);
+	if (!frame) return -1;
+	if (peer->out_tail) {
+		peer->out_tail->next = frame;
+	}
+	else {
+		peer->out_head = frame;
+	}
+	peer->out_tail = frame;
+	peer->out_frames++;
+	__atomic_add_fetch(&peer->out_bytes, len, __ATOMIC_RELAXED);
+	if (peer->worker) {
+		__atomic_store_n(&peer->worker->egress_bytes, peer->worker->egress_bytes + len, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/*
+	flush the egress queue until EAGAIN.
+	Returns 1 when the queue is empty, 0 if data is still pending, -1 on error
+*/
 int vpn_ws_continue_write(vpn_ws_peer *peer) {
-	vpn_ws_send(peer->fd, peer->write_buf, peer->write_pos, wlen);
-        if (wlen < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
-                        return 0;
-                }
-                return -1;
-        }
-        if (wlen == 0) return -1;
+	// with io_uring the data is always pending until the completion
+	if (peer->worker && peer->worker->uring) {
+		return vpn_ws_uring_send(peer->worker->uring, peer);
+	}
+	// tap devices consume a whole frame for each write
+	int iov_max = peer->raw ? 1 : VPN_WS_IOV_MAX;
+	while(peer->out_head) {
+		struct iovec iov[VPN_WS_IOV_MAX];
+		int iovcnt = 0;
+		vpn_ws_frame *frame = peer->out_head;
+		while(frame && iovcnt < iov_max) {
+			iov[iovcnt].iov_base = frame->data + frame->pos;
+			iov[iovcnt].iov_len = frame->len - frame->pos;
+			iovcnt++;
+			frame = frame->next;
+		}
 
-	peer->tx+=wlen;
+		ssize_t wlen = vpn_ws_writev_fd(peer->fd, iov, iovcnt);
+		if (wlen < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+				return 0;
+			}
+			// the tap device refused the frame (a bogus virtio-net header ?), drop it
+			if (peer->raw && errno == EINVAL) {
+				__atomic_add_fetch(&peer->drops, 1, __ATOMIC_RELAXED);
+				vpn_ws_peer_dequeue(peer, iov[0].iov_len);
+				continue;
+			}
+			return -1;
+		}
+		if (wlen == 0) return -1;
+
+		__atomic_add_fetch(&peer->tx, wlen, __ATOMIC_RELAXED);
 
-        memmove(peer->write_buf, peer->write_buf + wlen, peer->write_pos - wlen);
-        peer->write_pos -= wlen;
-        // if the whole buffer has been written, signal it
-        if (peer->write_pos == 0) return 1;
-        return 0;
+		if (peer->raw) wlen = iov[0].iov_len;
+		vpn_ws_peer_dequeue(peer, wlen);
+		// short write, retry until EAGAIN (as events are edge triggered)
+	}
+	return 1;
 }
 
-int vpn_ws_write(vpn_ws_peer *peer, uint8_t *buf, uint64_t amount) {
-	uint64_t available = peer->write_len - peer->write_pos;
-	if (available < amount) {
-                peer->write_len += amount;
-                void *tmp = realloc(peer->write_buf, peer->write_len);
-                if (!tmp) {
-                        vpn_ws_error("vpn_ws_write()/realloc()");
-                        return -1;
-                }
-                peer->write_buf = tmp;
-        }
+/*
+	try to write a frame directly, only if nothing is queued before it.
+	Returns 1 if it has been fully written, 0 if (part of it) must be queued, -1 on error
+*/
+static int vpn_ws_write_direct(vpn_ws_peer *peer, struct iovec *iov, int iovcnt, uint64_t *written) {
+	*written = 0;
+	if (peer->out_head || (peer->worker && (peer->worker->uring || vpn_ws_conf.pipeline))) return 0;
 
-	memcpy(peer->write_buf + peer->write_pos, buf, amount);
-	peer->write_pos += amount;
+	ssize_t wlen = vpn_ws_writev_fd(peer->fd, iov, iovcnt);
+	if (wlen < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+			return 0;
+		}
+		// the tap device refused the frame, drop it
+		if (peer->raw && errno == EINVAL) {
+			__atomic_add_fetch(&peer->drops, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+		return -1;
+	}
+	if (wlen == 0) return -1;
+	__atomic_add_fetch(&peer->tx, wlen, __ATOMIC_RELAXED);
+	// tap devices never do short writes
+	if (peer->raw) return 1;
+	*written = wlen;
+	uint64_t len = 0;
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		len += iov[i].iov_len;
+	}
+	return *written == len;
+}
 
-	return vpn_ws_continue_write(peer);
+// the data is pending, flush it when possible
+static int vpn_ws_write_pending(vpn_ws_peer *peer) {
+	// pipeline mode: flush it at the end of the cycle (unless it is already waiting for the peer)
+	if (peer->worker && vpn_ws_conf.pipeline) {
+		if (!peer->is_writing) {
+			vpn_ws_worker_defer_write(peer->worker, peer);
+		}
+		return 0;
+	}
+	if (peer->worker && peer->worker->uring) {
+		return vpn_ws_uring_send(peer->worker->uring, peer);
+	}
+	// the rest will be flushed when the peer becomes writable
+	return 0;
 }
 
-int vpn_ws_write_websocket(vpn_ws_peer *peer, uint8_t *buf, uint64_t amount) {
-	uint8_t header_size = 2;
-	uint8_t header[10];
+/*
+	write a frame (made of iovcnt parts) to a peer, the unsent part is copied.
+	Returns 1 if it has been fully written, 0 if (part of it) has been queued, -1 on error
+*/
+int vpn_ws_writev(vpn_ws_peer *peer, struct iovec *iov, int iovcnt) {
+	uint64_t written = 0;
+	int ret = vpn_ws_write_direct(peer, iov, iovcnt, &written);
+	if (ret != 0) return ret;
 
-	header[0] = 0x82;
-	if (amount < 126) {
-		header[1] = amount;
+	uint64_t len = 0;
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		len += iov[i].iov_len;
 	}
-	else if (amount <= (uint16_t) 0xffff) {
-		header_size = 4;
-		header[1] = 126;
-		header[2] = (uint8_t) ((amount >> 8) & 0xff);
-		header[3] = (uint8_t) (amount & 0xff);	
+	len -= written;
+
+	vpn_ws_fbuf *fb = vpn_ws_fbuf_new(len);
+	if (!fb) return -1;
+	uint64_t pos = 0;
+	for(i=0;i<iovcnt;i++) {
+		uint64_t iov_len = iov[i].iov_len;
+		if (written >= iov_len) {
+			written -= iov_len;
+			continue;
+		}
+		memcpy(fb->data + pos, (uint8_t *) iov[i].iov_base + written, iov_len - written);
+		pos += iov_len - written;
+		written = 0;
+	}
+	ret = vpn_ws_peer_enqueue(peer, fb, fb->data, len);
+	vpn_ws_fbuf_unref(fb);
+	if (ret) return -1;
+	return vpn_ws_write_pending(peer);
+}
+
+// write a frame living in a frame buffer, the queue will reference it
+int vpn_ws_write_fbuf(vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *buf, uint64_t amount) {
+	if (!fb) return vpn_ws_write(peer, buf, amount);
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = amount;
+	uint64_t written = 0;
+	int ret = vpn_ws_write_direct(peer, &iov, 1, &written);
+	if (ret != 0) return ret;
+	if (vpn_ws_peer_enqueue(peer, fb, buf + written, amount - written)) return -1;
+	return vpn_ws_write_pending(peer);
+}
+
+int vpn_ws_write(vpn_ws_peer *peer, uint8_t *buf, uint64_t amount) {
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = amount;
+	return vpn_ws_writev(peer, &iov, 1);
+}
+
+/*
+	permessage-deflate: compress a message (made of iovcnt parts) in a new frame
+	buffer, it is encapsulated in place (with RSV1 set) and referenced by the queue
+*/
+static int vpn_ws_write_deflate(vpn_ws_peer *peer, struct iovec *iov, int iovcnt) {
+	uint64_t len = 0;
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		len += iov[i].iov_len;
+	}
+	uint64_t bound = vpn_ws_deflate_bound(len);
+	vpn_ws_fbuf *fb = vpn_ws_fbuf_new(VPN_WS_HEADROOM + bound);
+	if (!fb) return -1;
+	int64_t zlen = vpn_ws_deflate(peer->zs, iov, iovcnt, fb->data + VPN_WS_HEADROOM, bound);
+	if (zlen < 0) {
+		vpn_ws_fbuf_unref(fb);
+		return -1;
+	}
+	uint64_t ws_len = 0;
+	uint8_t *ws = vpn_ws_websocket_prepend(fb->data + VPN_WS_HEADROOM, zlen, VPN_WS_HEADROOM, &ws_len);
+	ws[0] |= 0x40;
+	int ret = vpn_ws_write_fbuf(peer, fb, ws, ws_len);
+	vpn_ws_fbuf_unref(fb);
+	return ret;
+}
+
+/*
+	encapsulate a frame in a websocket packet, the header (followed by prefix_len
+	bytes of prefix) and the body are written together. When they cannot be sent
+	directly only the header is copied, the body (living in fb, if not NULL) is referenced
+*/
+static int vpn_ws_write_message(vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *prefix, uint8_t prefix_len, uint8_t *buf, uint64_t amount) {
+	if (peer->zs && vpn_ws_deflate_wanted(peer->zs, prefix_len + amount)) {
+		struct iovec iov[2];
+		iov[0].iov_base = prefix;
+		iov[0].iov_len = prefix_len;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = amount;
+		return vpn_ws_write_deflate(peer, iov, 2);
+	}
+
+	uint8_t header[10 + VPN_WS_BATCH_PREFIX + VPN_WS_VNET_HDR_LEN];
+	uint8_t header_size = vpn_ws_websocket_header(header, prefix_len + amount);
+	memcpy(header + header_size, prefix, prefix_len);
+	header_size += prefix_len;
+
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_size;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = amount;
+	if (!fb) return vpn_ws_writev(peer, iov, 2);
+
+	uint64_t written = 0;
+	int ret = vpn_ws_write_direct(peer, iov, 2, &written);
+	if (ret != 0) return ret;
+
+	if (written < header_size) {
+		vpn_ws_fbuf *hfb = vpn_ws_fbuf_new(header_size - written);
+		if (!hfb) return -1;
+		memcpy(hfb->data, header + written, header_size - written);
+		ret = vpn_ws_peer_enqueue(peer, hfb, hfb->data, header_size - written);
+		vpn_ws_fbuf_unref(hfb);
+		if (ret) return -1;
+		written = header_size;
+	}
+	written -= header_size;
+	if (vpn_ws_peer_enqueue(peer, fb, buf + written, amount - written)) return -1;
+	return vpn_ws_write_pending(peer);
+}
+
+/*
+	vpn-ws-batch: close the message being aggregated (it is encapsulated in
+	place, the buffer has headroom) and write it.
+	Returns like vpn_ws_write_fbuf(), 1 if there was nothing to close
+*/
+int vpn_ws_aggregate_close(vpn_ws_peer *peer) {
+	vpn_ws_fbuf *fb = peer->agg;
+	if (!fb) return 1;
+	uint64_t len = peer->agg_len;
+	peer->agg = NULL;
+	peer->agg_len = 0;
+	peer->agg_frames = 0;
+	int ret = 0;
+	if (peer->zs && vpn_ws_deflate_wanted(peer->zs, len)) {
+		struct iovec iov;
+		iov.iov_base = fb->data + VPN_WS_HEADROOM;
+		iov.iov_len = len;
+		ret = vpn_ws_write_deflate(peer, &iov, 1);
 	}
 	else {
-		header_size = 10;
-		header[1] = 127;
-		header[2] = (uint8_t) ((amount >> 56) & 0xff);
-		header[3] = (uint8_t) ((amount >> 48) & 0xff);
-		header[4] = (uint8_t) ((amount >> 40) & 0xff); 
-		header[5] = (uint8_t) ((amount >> 32) & 0xff);
-		header[6] = (uint8_t) ((amount >> 24) & 0xff);
-		header[7] = (uint8_t) ((amount >> 16) & 0xff);
-		header[8] = (uint8_t) ((amount >> 8) & 0xff);
-		header[9] = (uint8_t) (amount & 0xff);
-	}
-
-        uint64_t available = peer->write_len - peer->write_pos;
-        if (available < (amount+header_size)) {
-                peer->write_len += amount + header_size;
-                void *tmp = realloc(peer->write_buf, peer->write_len);
-                if (!tmp) {
-                        vpn_ws_error("vpn_ws_write_websocket()/realloc()");
-                        return -1;
-                }
-                peer->write_buf = tmp;
-        }
-
-	memcpy(peer->write_buf + peer->write_pos, header, header_size);
-        memcpy(peer->write_buf + peer->write_pos +header_size, buf, amount);
-        peer->write_pos += amount + header_size;
-
-        return vpn_ws_continue_write(peer);
+		uint64_t ws_len = 0;
+		uint8_t *ws = vpn_ws_websocket_prepend(fb->data + VPN_WS_HEADROOM, len, VPN_WS_HEADROOM, &ws_len);
+		ret = vpn_ws_write_fbuf(peer, fb, ws, ws_len);
+	}
+	vpn_ws_fbuf_unref(fb);
+	return ret;
 }
 
-int vpn_ws_read(vpn_ws_peer *peer, uint64_t amount) {
-	uint64_t available = peer->len - peer->pos;
-	if (available < amount) {
-		peer->len += amount;
-		void *tmp = realloc(peer->buf, peer->len);
-		if (!tmp) {
-			vpn_ws_error("vpn_ws_read()/realloc()");
-			return -1;
-		}
-		peer->buf = tmp;
+// the result of two consecutive writes
+static int vpn_ws_write_merge(int ret1, int ret2) {
+	if (ret1 < 0 || ret2 < 0) return -1;
+	return ret1 && ret2;
+}
+
+/*
+	vpn-ws-batch peers: frames are copied in the message being aggregated,
+	closed when it is full or at the end of the cycle. Frames that would not
+	fit an empty message are sent in a message of their own, referenced as usual
+*/
+static int vpn_ws_aggregate(vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *prefix, uint8_t prefix_len, uint8_t *buf, uint64_t amount) {
+	uint64_t len = prefix_len + amount;
+	int ret = 1;
+	if (peer->agg && peer->agg_len + VPN_WS_BATCH_PREFIX + len > vpn_ws_conf.batch_bytes) {
+		ret = vpn_ws_aggregate_close(peer);
+		if (ret < 0) return -1;
+	}
+
+	if (VPN_WS_BATCH_PREFIX + len > vpn_ws_conf.batch_bytes) {
+		uint8_t header[VPN_WS_BATCH_PREFIX + VPN_WS_VNET_HDR_LEN];
+		vpn_ws_batch_prefix(header, len);
+		memcpy(header + VPN_WS_BATCH_PREFIX, prefix, prefix_len);
+		return vpn_ws_write_merge(ret, vpn_ws_write_message(peer, fb, header, VPN_WS_BATCH_PREFIX + prefix_len, buf, amount));
 	}
 
+	if (!peer->agg) {
+		peer->agg = vpn_ws_fbuf_new(VPN_WS_HEADROOM + vpn_ws_conf.batch_bytes);
+		if (!peer->agg) return -1;
+		vpn_ws_worker_aggregate(peer->worker, peer);
+	}
+
+	uint8_t *ptr = peer->agg->data + VPN_WS_HEADROOM + peer->agg_len;
+	vpn_ws_batch_prefix(ptr, len);
+	memcpy(ptr + VPN_WS_BATCH_PREFIX, prefix, prefix_len);
+	memcpy(ptr + VPN_WS_BATCH_PREFIX + prefix_len, buf, amount);
+	peer->agg_len += VPN_WS_BATCH_PREFIX + len;
+	peer->agg_frames++;
+
+	if (peer->agg_frames >= vpn_ws_conf.batch_frames) {
+		return vpn_ws_write_merge(ret, vpn_ws_aggregate_close(peer));
+	}
+	return ret;
+}
+
+static int vpn_ws_write_websocket_prefix(vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *prefix, uint8_t prefix_len, uint8_t *buf, uint64_t amount) {
+	if (peer->multi) {
+		return vpn_ws_aggregate(peer, fb, prefix, prefix_len, buf, amount);
+	}
+	return vpn_ws_write_message(peer, fb, prefix, prefix_len, buf, amount);
+}
+
+int vpn_ws_write_websocket(vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *buf, uint64_t amount) {
+	return vpn_ws_write_websocket_prefix(peer, fb, NULL, 0, buf, amount);
+}
+
+int vpn_ws_read(vpn_ws_peer *peer, uint64_t amount) {
+	if (vpn_ws_peer_reserve(peer, amount)) return -1;
+
 	vpn_ws_recv(peer->fd, peer->buf + peer->pos, amount, rlen);
 	if (rlen < 0) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
@@ -103,32 +379,278 @@ int vpn_ws_read(vpn_ws_peer *peer, uint64_t amount) {
 	}
 	if (rlen == 0) return -1;
 
-	peer->rx += rlen;
+	__atomic_add_fetch(&peer->rx, rlen, __ATOMIC_RELAXED);
 	peer->pos += rlen;
+	peer->t_seen = vpn_ws_now();
 
 	return 1;
 }
 
-int vpn_ws_manage_fd(int queue, vpn_ws_fd fd) {
-	// when 1 invoke the event wait loop
+/*
+	the result of a write to a peer: on EAGAIN the remaining data will be flushed
+	when the peer becomes writable, on error it is destroyed.
+	Returns 1 if the peer has been destroyed.
+*/
+static int vpn_ws_peer_write_result(vpn_ws_worker *w, vpn_ws_peer *b_peer, int wret) {
+	if (wret < 0) {
+		vpn_ws_peer_destroy(b_peer);
+		return 1;
+	}
+	if (wret == 0) {
+		b_peer->is_writing = 1;
+	}
+	return 0;
+}
+
+/*
+	a frame can be queued only if the egress limits allow it (frames written
+	directly never hit them). With the drop-broadcast policy broadcasts and
+	multicasts can only use half of the limits, leaving room for unicast.
+	Returns 1 if the frame must not be queued
+*/
+static int vpn_ws_egress_full(vpn_ws_peer *peer, uint8_t *eth, uint64_t len) {
+	if (peer->out_bytes == 0) return 0;
+	uint8_t shift = vpn_ws_conf.egress_policy == VPN_WS_EGRESS_DROP_BROADCAST && (eth[0] & 1);
+
+	uint64_t limit = vpn_ws_conf.egress_limit >> shift;
+	if (limit && peer->out_bytes + len > limit) return 1;
+
+	limit = vpn_ws_conf.egress_global_limit >> shift;
+	if (limit) {
+		uint64_t total = 0;
+		int i;
+		for(i=0;i<vpn_ws_conf.workers_n;i++) {
+			total += __atomic_load_n(&vpn_ws_conf.workers[i].egress_bytes, __ATOMIC_RELAXED);
+		}
+		if (total + len > limit) return 1;
+	}
+	return 0;
+}
+
+/*
+	apply the egress policy to a frame not fitting the limits,
+	returns 1 if the peer has been destroyed
+*/
+static int vpn_ws_egress_overflow(vpn_ws_worker *w, vpn_ws_peer *b_peer) {
+	// never disconnect the tuntap device
+	if (vpn_ws_conf.egress_policy == VPN_WS_EGRESS_DISCONNECT && !b_peer->raw) {
+		vpn_ws_announce_peer(b_peer, "disconnecting slow");
+		__atomic_add_fetch(&w->egress_disconnects, 1, __ATOMIC_RELAXED);
+		vpn_ws_peer_destroy(b_peer);
+		return 1;
+	}
+	__atomic_add_fetch(&b_peer->drops, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&w->egress_drops, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// write a frame completed by vpn_ws_vnet_finish() (there is headroom for the websocket header)
+static int vpn_ws_vnet_write(vpn_ws_fbuf *fb, uint8_t *eth, uint64_t len, void *data) {
+	vpn_ws_peer *peer = (vpn_ws_peer *) data;
+	if (peer->raw) {
+		return vpn_ws_write_fbuf(peer, fb, eth, len);
+	}
+	if (peer->multi || peer->zs) {
+		return vpn_ws_write_websocket(peer, fb, eth, len);
+	}
+	uint64_t ws_len = 0;
+	uint8_t *ws = vpn_ws_websocket_prepend(eth, len, VPN_WS_HEADROOM, &ws_len);
+	return vpn_ws_write_fbuf(peer, fb, ws, ws_len);
+}
+
+/*
+	a frame from an offload peer to a peer without offloads: the virtio-net
+	header is stripped, checksums and segmentation are completed in software
+*/
+static int vpn_ws_write_vnet_strip(vpn_ws_peer *b_peer, vpn_ws_fbuf *fb, uint8_t *vnet, uint8_t *eth, uint64_t eth_len) {
+	if (vpn_ws_vnet_pending(vnet)) {
+		if (vpn_ws_vnet_finish(vnet, eth, eth_len, vpn_ws_vnet_write, b_peer)) return -1;
+		return b_peer->out_head ? 0 : 1;
+	}
+	if (b_peer->raw) {
+		return vpn_ws_write_fbuf(b_peer, fb, eth, eth_len);
+	}
+	return vpn_ws_write_websocket(b_peer, fb, eth, eth_len);
+}
+
+// a frame to an offload peer from a peer without offloads: an empty virtio-net header is added
+static int vpn_ws_write_vnet_add(vpn_ws_peer *b_peer, vpn_ws_fbuf *fb, uint8_t *eth, uint64_t eth_len) {
+	uint8_t vnet[VPN_WS_VNET_HDR_LEN];
+	memset(vnet, 0, VPN_WS_VNET_HDR_LEN);
+	if (!b_peer->raw) {
+		return vpn_ws_write_websocket_prefix(b_peer, fb, vnet, VPN_WS_VNET_HDR_LEN, eth, eth_len);
+	}
+	// tap devices need the whole frame in a single write
+	vpn_ws_fbuf *vfb = vpn_ws_fbuf_new(VPN_WS_VNET_HDR_LEN + eth_len);
+	if (!vfb) return -1;
+	memcpy(vfb->data, vnet, VPN_WS_VNET_HDR_LEN);
+	memcpy(vfb->data + VPN_WS_VNET_HDR_LEN, eth, eth_len);
+	int ret = vpn_ws_write_fbuf(b_peer, vfb, vfb->data, VPN_WS_VNET_HDR_LEN + eth_len);
+	vpn_ws_fbuf_unref(vfb);
+	return ret;
+}
+
+/*
+	write an ethernet frame to a peer, ws is the same frame already encapsulated
+	in a (unmasked) websocket packet (NULL if there was no headroom for it).
+	vnet is the virtio-net header in front of eth (NULL if the sender has no offloads).
+	All of them live in fb (if not NULL), so they can be queued without copies
+*/
+int vpn_ws_peer_write_frame(vpn_ws_worker *w, vpn_ws_peer *b_peer, vpn_ws_fbuf *fb, uint8_t *ws, uint64_t ws_len, uint8_t *vnet, uint8_t *eth, uint64_t eth_len) {
+	if (vpn_ws_egress_full(b_peer, eth, b_peer->raw ? eth_len : eth_len + 10)) {
+		return vpn_ws_egress_overflow(w, b_peer);
+	}
+
+	int wret = -1;
+	if (vnet && !b_peer->vnet) {
+		wret = vpn_ws_write_vnet_strip(b_peer, fb, vnet, eth, eth_len);
+	}
+	else if (!vnet && b_peer->vnet) {
+		wret = vpn_ws_write_vnet_add(b_peer, fb, eth, eth_len);
+	}
+	else {
+		// the virtio-net header (if any) goes with the frame
+		uint8_t *frame = vnet ? vnet : eth;
+		uint64_t frame_len = vnet ? eth_len + VPN_WS_VNET_HDR_LEN : eth_len;
+		// if we are writing a websocket packet to a raw device
+		// we need to remove the websocket header
+		if (b_peer->raw) {
+			wret = vpn_ws_write_fbuf(b_peer, fb, frame, frame_len);
+		}
+		// multi-frame (and compressing) peers need a different encapsulation
+		else if (!ws || b_peer->multi || b_peer->zs) {
+			wret = vpn_ws_write_websocket(b_peer, fb, frame, frame_len);
+		}
+		else {
+			wret = vpn_ws_write_fbuf(b_peer, fb, ws, ws_len);
+		}
+	}
+	return vpn_ws_peer_write_result(w, b_peer, wret);
+}
+
+// the shortest of the enabled peer timeouts
+static time_t vpn_ws_peer_timer_interval() {
+	time_t interval = 0;
+	int values[3] = { vpn_ws_conf.handshake_timeout, vpn_ws_conf.idle_timeout, vpn_ws_conf.ping_interval };
+	int i;
+	for(i=0;i<3;i++) {
+		if (values[i] > 0 && (!interval || values[i] < interval)) interval = values[i];
+	}
+	return interval;
+}
+
+/*
+	the peer timer: before the handshake it enforces the handshake deadline,
+	after it the idle timeout and the server pings (raw peers have no timer)
+*/
+static void vpn_ws_peer_timeout(vpn_ws_worker *w, vpn_ws_timer *t) {
+	vpn_ws_peer *peer = (vpn_ws_peer *) t->data;
+	if (peer->dead) return;
+	time_t now = vpn_ws_now();
+	time_t next = 0;
+
+	if (!peer->handshake) {
+		if (vpn_ws_conf.handshake_timeout > 0) {
+			time_t deadline = peer->t + vpn_ws_conf.handshake_timeout;
+			if (now >= deadline) {
+				vpn_ws_log("handshake timeout for peer %d", peer->fd);
+				vpn_ws_peer_destroy(peer);
+				return;
+			}
+			next = deadline;
+		}
+	}
+	else if (peer->handshake == 1) {
+		if (vpn_ws_conf.idle_timeout > 0) {
+			time_t deadline = peer->t_seen + vpn_ws_conf.idle_timeout;
+			if (now >= deadline) {
+				vpn_ws_log("idle timeout for peer %d", peer->fd);
+				vpn_ws_peer_destroy(peer);
+				return;
+			}
+			next = deadline;
+		}
+		if (vpn_ws_conf.ping_interval > 0) {
+			time_t last = peer->t_seen > peer->t_ping ? peer->t_seen : peer->t_ping;
+			time_t due = last + vpn_ws_conf.ping_interval;
+			if (now >= due) {
+				// the client answers with a pong (or any other frame) refreshing t_seen
+				if (vpn_ws_peer_write_result(w, peer, vpn_ws_write(peer, (uint8_t *) "\x89\x00", 2))) return;
+				peer->t_ping = now;
+				due = now + vpn_ws_conf.ping_interval;
+			}
+			if (!next || due < next) next = due;
+		}
+	}
+	else {
+		// closing
+		return;
+	}
+
+	if (!next) {
+		// nothing to check after the handshake
+		if (peer->handshake) return;
+		next = now + vpn_ws_peer_timer_interval();
+	}
+	vpn_ws_timer_add(w, t, next);
+}
+
+void vpn_ws_peer_timer_start(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	if (peer->raw) return;
+	time_t interval = vpn_ws_peer_timer_interval();
+	if (!interval) return;
+	peer->t_seen = vpn_ws_now();
+	peer->timer.func = vpn_ws_peer_timeout;
+	peer->timer.data = peer;
+	vpn_ws_timer_add(w, &peer->timer, vpn_ws_now() + interval);
+}
+
+/*
+	send a frame to all of the registered peers of the worker (or only to the bridge ones)
+	peer is the sender (NULL if the frame comes from another worker), streams_id
+	its client when it stripes (it gets nothing back from its other connections)
+*/
+int vpn_ws_flood(vpn_ws_worker *w, vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *ws, uint64_t ws_len, uint8_t *vnet, uint8_t *eth, uint64_t eth_len, uint8_t bridges_only, uint64_t streams_id) {
 	int dirty = 0;
+	// only the peers with a MAC (or only the bridges)
+	vpn_ws_peer_list *l = bridges_only ? &w->bridges : &w->registered;
+	uint64_t i;
+	for(i=0;i<l->n;i++) {
+		vpn_ws_peer *b_peer = l->peers[i];
+		// myself (or destroyed in this cycle) ?
+		if (b_peer == peer || b_peer->dead) continue;
+		// only one connection of a striping client
+		if (b_peer->streams_id && (b_peer->streams_id == streams_id || __atomic_load_n(&b_peer->stream_secondary, __ATOMIC_RELAXED))) continue;
+		if (vpn_ws_peer_write_frame(w, b_peer, fb, ws, ws_len, vnet, eth, eth_len)) dirty = 1;
+	}
+
+#ifndef __WIN32__
+	// only the worker receiving the frame propagates it
+	if (!peer) return dirty;
+	int j;
+	for(j=0;j<vpn_ws_conf.workers_n;j++) {
+		vpn_ws_worker *b_w = &vpn_ws_conf.workers[j];
+		if (b_w == w) continue;
+		vpn_ws_worker_post(w, b_w, bridges_only ? VPN_WS_MSG_FLOOD : VPN_WS_MSG_BROADCAST, vpn_ws_invalid_fd, streams_id, vnet, eth, eth_len);
+	}
+#endif
+	return dirty;
+}
 
+int vpn_ws_manage_fd(vpn_ws_worker *w, vpn_ws_fd fd, int mask) {
 	// check if the fd can be in the peers list
 #ifndef __WIN32__
-	if (fd > vpn_ws_conf.peers_n) {
+	if (fd >= w->peers_n) {
 		return -1;
 	}
 	// first of all find a valid peer
-	vpn_ws_peer *peer = vpn_ws_conf.peers[fd];
+	vpn_ws_peer *peer = w->peers[fd];
 #else
 	// TODO find a solution for windows
 	vpn_ws_peer *peer = NULL;
 #endif
-	if (!peer) {
-		vpn_ws_log("[BUG] fd %d not found", fd);
-		close(fd);
-		return -1;
-	}
+	// already destroyed in this cycle
+	if (!peer) return 0;
 
 	// is it valid ?
 	if (peer->fd != fd) {
@@ -138,107 +660,144 @@ int vpn_ws_manage_fd(int queue, vpn_ws_fd fd) {
 		return -1;
 	}
 
-	// is a writing peer ?
-
-	if (peer->is_writing) {
+	// flush pending data
+	if ((mask & VPN_WS_EVENT_WRITE) && peer->is_writing) {
 		int ret = vpn_ws_continue_write(peer);
 		if (ret < 0) {
 			vpn_ws_peer_destroy(peer);
 			return -1;
 		}
-		if (ret == 0) return 0;
-		peer->is_writing = 0;
-		// if handshake is higher than 1, it means we want to close the connection
-		// and to set it as dirty ....
-		if (peer->handshake > 1) {
-			vpn_ws_peer_destroy(peer);
-			return -1;
+		if (ret > 0) {
+			peer->is_writing = 0;
+			// if handshake is higher than 1, it means we want to close the connection
+			if (peer->handshake > 1) {
+				vpn_ws_peer_destroy(peer);
+				return -1;
+			}
 		}
-		return vpn_ws_event_write_to_read(queue, peer->fd);
 	}
 
-	int ret = vpn_ws_read(peer, 8192);
-	if (ret < 0) {
-		vpn_ws_peer_destroy(peer);
-		return -1;
+	// the peer will be read by the scheduler
+	if (mask & VPN_WS_EVENT_READ) {
+		peer->readable = 1;
+		vpn_ws_worker_ready(w, peer);
 	}
-	// again ...
-	if (ret == 0) return 0;
+	return 0;
+}
 
-again:
+/*
+	serve a ready peer within the frames/bytes budget: consume the buffered
+	frames and read more until the socket is drained.
+	Returns 1 if the peer has still data to consume, -1 if it has been destroyed
+*/
+int vpn_ws_peer_serve(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	w->budget_frames = VPN_WS_BUDGET_FRAMES;
+	w->budget_bytes = VPN_WS_BUDGET_BYTES;
 
-	// has completed handshake ?
-	if (!peer->handshake) {
-		int64_t hret = vpn_ws_handshake(queue, peer);
-		if (hret < 0) {
+	for(;;) {
+		int ret = vpn_ws_peer_process(w, peer);
+		if (ret != 0) return ret;
+
+		// nothing more to read (always the case with io_uring)
+		if (!peer->readable) return 0;
+
+		uint64_t rx = peer->rx;
+		// a tap device with offloads can return GSO super-frames
+		ret = vpn_ws_read(peer, peer->raw && peer->vnet ? VPN_WS_TAP_MAX : 8192);
+		if (ret < 0) {
 			vpn_ws_peer_destroy(peer);
 			return -1;
 		}
 		// again ...
-		if (hret == 0) return dirty;
-		peer->handshake++;
-		memmove(peer->buf, peer->buf + hret, peer->pos - hret);
-		peer->pos -= hret;
-	}
-
-	uint8_t *data = NULL;
-	uint64_t data_len = 0;
-	uint8_t *mac = NULL;
-	uint16_t ws_header = 0;
-	int64_t ws_ret = 0;
+		if (ret == 0) {
+			peer->readable = 0;
+			return 0;
+		}
 
-	if (peer->raw) {
-		// check if there are more data to parse ...
-		if (peer->pos == 0) return dirty;
-		data = peer->buf;
-		data_len = peer->pos;
-		mac = data;
-		ws_ret = data_len;
-		goto parsed;
+		// a short read from a stream means the socket has been drained,
+		// raw devices instead return a single frame per read (so we need to get EAGAIN)
+		if (!peer->raw && peer->rx - rx < 8192) peer->readable = 0;
 	}
+}
 
-	// do we have a full websocket packet ?
-	ws_ret = vpn_ws_websocket_parse(peer, &ws_header);
-	if (ws_ret < 0) {
-		vpn_ws_peer_destroy(peer);
-		return -1;
+// release the references held by the batch
+static void vpn_ws_batch_release(vpn_ws_worker *w, uint64_t n) {
+	uint64_t i;
+	for(i=0;i<n;i++) {
+		if (w->batch[i].fb) vpn_ws_fbuf_unref(w->batch[i].fb);
 	}
-	// again
-	if (ws_ret == 0) return dirty;
-	// ignore packet ?
-	if (ws_header == 0) goto decapitate;
+}
 
-	uint8_t *ws = peer->buf + ws_header;
-	uint64_t ws_len = ws_ret - ws_header;
+/*
+	route the frames parsed from a peer: the broadcast and multicast ones
+	are flooded, the others are looked up in the MAC map all together.
+	The frames still live in the read buffer (or in the buffer they have been
+	inflated in), referenced by the batch
+*/
+static void vpn_ws_peer_route(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	uint64_t n = w->batch_n;
+	if (n == 0) return;
+	w->batch_n = 0;
 
-	// set body to send
-	data = peer->buf;
-	data_len = ws_ret;
+	vpn_ws_macmap_lookup_batch(w->batch, n);
 
-	// if the packed is masked, de-mask it
-	if (peer->has_mask) {
-		uint16_t i;
-		for (i=0;i<ws_len;i++) {
-			 ws[i] = ws[i] ^ peer->mask[i % 4];	
+	uint64_t i;
+	for(i=0;i<n;i++) {
+		vpn_ws_batch_frame *f = &w->batch[i];
+		if (f->flood) {
+			vpn_ws_flood(w, peer, f->fb, f->ws, f->ws_len, f->vnet, f->eth, f->eth_len, 0, peer->streams_id);
+			continue;
+		}
+
+		// if not found forward to all bridge peers
+		if (!f->found) {
+			vpn_ws_flood(w, peer, f->fb, f->ws, f->ws_len, f->vnet, f->eth, f->eth_len, 1, peer->streams_id);
+			continue;
+		}
+
+		vpn_ws_route *route = &f->route;
+		// never send a frame back to where it came from
+		if (route->peer == peer) continue;
+
+		// the peer is owned by another worker
+		if (route->worker != w) {
+#ifndef __WIN32__
+			vpn_ws_worker_post(w, route->worker, VPN_WS_MSG_UNICAST, route->fd, route->id, f->vnet, f->eth, f->eth_len);
+#endif
+			continue;
 		}
-		// move the header and clear the mask bit
-		memmove(peer->buf+4, peer->buf, ws_header - 4);	
-		peer->buf[5] &= 0x7f;
 
-		data+=4;
-		data_len-=4;
+		// destroyed by a previous frame of the batch ?
+		if (route->peer->dead) continue;
+
+		vpn_ws_peer_write_frame(w, route->peer, f->fb, f->ws, f->ws_len, f->vnet, f->eth, f->eth_len);
 	}
 
-	// set the mac address
-	mac = ws;
+	vpn_ws_batch_release(w, n);
+}
 
-parsed:
+/*
+	check a frame parsed from a peer (collecting its MAC) and add it to the batch.
+	data is the frame encapsulated in a (unmasked) websocket packet (NULL if it
+	is not available), both live in fb. Returns -1 if the peer has been destroyed
+*/
+static int vpn_ws_peer_frame(vpn_ws_worker *w, vpn_ws_peer *peer, vpn_ws_fbuf *fb, uint8_t *data, uint64_t data_len, uint8_t *mac, uint64_t frame_len) {
+	uint8_t *vnet = NULL;
+
+	// offload peers prepend a virtio-net header
+	if (peer->vnet) {
+		if (frame_len < VPN_WS_VNET_HDR_LEN) return 0;
+		vnet = mac;
+		mac += VPN_WS_VNET_HDR_LEN;
+		frame_len -= VPN_WS_VNET_HDR_LEN;
+		if (!vpn_ws_vnet_valid(vnet, frame_len)) return 0;
+	}
 
 	// do we have a full ethernet frame header ?
-	if (data_len < 14) goto decapitate;
+	if (frame_len < 14) return 0;
 
 	// get src MAC addr
-	if (!vpn_ws_mac_is_valid(mac+6)) goto decapitate;
+	if (!vpn_ws_mac_is_valid(mac+6)) return 0;
 
 	// if the MAC has been already collected, compare it
 
@@ -253,18 +812,23 @@ parsed:
 					// This might be a situation that the interfacce mac address changed
 					uint8_t mac_updated[6];
 					if (vpn_ws_update_tuntap_mac(mac_updated) < 0) {
-						goto decapitate;
+						return 0;
 					}
+					vpn_ws_macmap_del(peer->mac, peer);
 					memcpy(peer->mac, mac_updated, 6);
+					if (vpn_ws_macmap_add(peer->mac, peer)) {
+						vpn_ws_peer_destroy(peer);
+						return -1;
+					}
 					vpn_ws_log("Interface MAC address updated [%02X:%02X:%02X:%02X:%02X:%02X]",
 						peer->mac[0], peer->mac[1], peer->mac[2], peer->mac[3], peer->mac[4], peer->mac[5]);  
 					if (memcmp(peer->mac, mac+6, 6)) {
-						goto decapitate;
+						return 0;
 					}
 				}
 				else
 				{
-					goto decapitate;
+					return 0;
 				}
 			}
 			else
@@ -278,132 +842,340 @@ parsed:
 	}
 	else {
 		memcpy(peer->mac, mac+6, 6);
+		if (vpn_ws_macmap_add(peer->mac, peer)) {
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
 		vpn_ws_announce_peer(peer, "registered new");
 		peer->mac_collected = 1;
+		if (vpn_ws_worker_index(w, peer)) {
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
 	}
 
 	// get dst MAC addr
-	if (vpn_ws_mac_is_zero(mac)) goto decapitate;
+	if (vpn_ws_mac_is_zero(mac)) return 0;
 	// check if src MAC is different from dst MAC, loops are evil
-	if (vpn_ws_mac_is_loop(mac, mac+6)) goto decapitate;
+	if (vpn_ws_mac_is_loop(mac, mac+6)) return 0;
+
+	uint8_t *eth = mac;
+	uint64_t eth_len = frame_len;
+	if (peer->raw) {
+		// encapsulate it once for all of the websocket peers (the buffer has headroom)
+		data = vpn_ws_websocket_prepend(data, data_len, data - peer->buf, &data_len);
+		if (!data) data_len = 0;
+	}
 
+	// the batch holds a reference to the buffer (so the read buffer cannot be rewound)
+	if (fb) fb->refs++;
+	vpn_ws_batch_frame *f = &w->batch[w->batch_n++];
+	f->fb = fb;
+	f->ws = data;
+	f->ws_len = data_len;
+	f->vnet = vnet;
+	f->eth = eth;
+	f->eth_len = eth_len;
 	// check for broadcast/multicast
-	// append packet to each peer write buffer ...
-	// attempt to call write for each one
-	if ((!vpn_ws_conf.no_multicast && vpn_ws_mac_is_multicast(mac)) || (!vpn_ws_conf.no_broadcast && vpn_ws_mac_is_broadcast(mac))) {
-		// iterate over all peers and write to them
-		uint64_t i;
-		for(i=0;i<vpn_ws_conf.peers_n;i++) {
-			vpn_ws_peer *b_peer = vpn_ws_conf.peers[i];
-			if (!b_peer) continue;
-			// myself ?
-			if (b_peer->fd == peer->fd) continue;
-			// already accounted ?
-			if (!b_peer->mac_collected) continue;
-
-			int wret = -1;
-			// if we are writing a websocket packet to a raw device
-			// we need to remove the websocket header
-			if (b_peer->raw && !peer->raw) {
-				wret = vpn_ws_write(b_peer, peer->buf+ws_header, ws_ret-ws_header);
-			}
-			else if (!b_peer->raw && peer->raw) {
-				wret = vpn_ws_write_websocket(b_peer, data, data_len);
-			}
-			else {
-				wret = vpn_ws_write(b_peer, data, data_len);
-			}
+	f->flood = (!vpn_ws_conf.no_multicast && vpn_ws_mac_is_multicast(mac)) || (!vpn_ws_conf.no_broadcast && vpn_ws_mac_is_broadcast(mac));
+	f->found = 0;
 
-			if (wret < 0) {
-				vpn_ws_peer_destroy(b_peer);
-				dirty = 1;
-				continue;
-			}
+	// out of pipeline mode each frame is routed as soon as it is parsed
+	if (w->batch_n >= (vpn_ws_conf.pipeline ? VPN_WS_BATCH : 1)) {
+		vpn_ws_peer_route(w, peer);
+	}
 
-			if (wret == 0) {
-				dirty = 1;
-				if (!b_peer->is_writing) {
-					if (vpn_ws_event_read_to_write(queue, b_peer->fd)) {
-						vpn_ws_peer_destroy(b_peer);
-					}
-				}
-			}	
+	return 0;
+}
+
+/*
+	permessage-deflate: inflate a message in a new frame buffer (after the
+	headroom), growing it as needed up to VPN_WS_INFLATE_MAX bytes.
+	Returns NULL if the message is not valid (or too big)
+*/
+vpn_ws_fbuf *vpn_ws_peer_inflate(vpn_ws_peer *peer, uint8_t *buf, uint64_t len, uint64_t *out_len) {
+	if (vpn_ws_inflate_begin(peer->zs, buf, len)) return NULL;
+	uint64_t size = len < 1024 ? 4096 : len * 4;
+	if (size > VPN_WS_INFLATE_MAX) size = VPN_WS_INFLATE_MAX;
+	vpn_ws_fbuf *fb = vpn_ws_fbuf_new(VPN_WS_HEADROOM + size);
+	if (!fb) return NULL;
+	uint64_t pos = VPN_WS_HEADROOM;
+	for(;;) {
+		uint64_t room = size - (pos - VPN_WS_HEADROOM);
+		int64_t rlen = vpn_ws_inflate_next(peer->zs, fb->data + pos, room);
+		if (rlen < 0) goto error;
+		pos += rlen;
+		if ((uint64_t) rlen < room) break;
+		// the buffer is full and the message is not over
+		if (size >= VPN_WS_INFLATE_MAX) {
+			vpn_ws_log("too big compressed message from peer %d", peer->fd);
+			goto error;
 		}
+		size *= 2;
+		if (size > VPN_WS_INFLATE_MAX) size = VPN_WS_INFLATE_MAX;
+		vpn_ws_fbuf *new_fb = vpn_ws_fbuf_new(VPN_WS_HEADROOM + size);
+		if (!new_fb) goto error;
+		memcpy(new_fb->data, fb->data, pos);
+		vpn_ws_fbuf_unref(fb);
+		fb = new_fb;
+	}
+	*out_len = pos - VPN_WS_HEADROOM;
+	return fb;
+error:
+	vpn_ws_fbuf_unref(fb);
+	return NULL;
+}
+
+/*
+	parse the data in the read buffer of a peer, returns -1 if the peer
+	has been destroyed, 1 if the budget has been exhausted
+*/
+static int vpn_ws_peer_parse(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	// the peer will be closed after the last write, ignore further data
+	if (peer->handshake > 1) {
+		vpn_ws_peer_consume(peer, peer->pos - peer->off);
+		return 0;
+	}
+
+again:
+
+	// has completed handshake ?
+	if (!peer->handshake) {
+		int64_t hret = vpn_ws_handshake(peer);
+		if (hret < 0) {
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
+		// again ...
+		if (hret == 0) return 0;
+		peer->handshake++;
+		vpn_ws_peer_consume(peer, hret);
+		// the MAC could have been announced in the handshake
+		if (vpn_ws_worker_index(w, peer)) {
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
+	}
+
+	// out of budget ? the remaining frames will be consumed at the next round
+	if (peer->pos > peer->off && (w->budget_frames == 0 || w->budget_bytes == 0)) return 1;
+
+	uint16_t ws_header = 0;
+	int64_t ws_ret = 0;
+
+	if (peer->raw) {
+		// check if there are more data to parse ...
+		if (peer->pos == peer->off) return 0;
+		ws_ret = peer->pos - peer->off;
+		if (vpn_ws_peer_frame(w, peer, peer->rbuf, peer->buf + peer->off, ws_ret, peer->buf + peer->off, ws_ret)) return -1;
 		goto decapitate;
 	}
 
-	// find the MAC addr in the MAC map
-	// attempt to call write
-	vpn_ws_peer *b_peer = vpn_ws_peer_by_mac(mac);
-	if (!b_peer) {
-		// if not found, search in bridge peers
-		b_peer = vpn_ws_peer_by_bridge_mac(mac);
-		// if not found forward to all bridget peers
-		if (!b_peer) {
-			uint64_t i;
-                	for(i=0;i<vpn_ws_conf.peers_n;i++) {
-                        	vpn_ws_peer *b_peer = vpn_ws_conf.peers[i];
-                        	if (!b_peer) continue;
-                        	// myself ?
-                        	if (b_peer->fd == peer->fd) continue;
-                        	// already accounted ?
-                        	if (!b_peer->mac_collected) continue;	
-				// is a bridge ?
-				if (!b_peer->bridge) continue;
-				int wret = -1;
-        			if (b_peer->raw && !peer->raw) {
-                			wret = vpn_ws_write(b_peer, peer->buf+ws_header, ws_ret-ws_header);
-        			}
-        			else if (!b_peer->raw && peer->raw) {
-                			wret = vpn_ws_write_websocket(b_peer, data, data_len);
-        			}
-        			else {
-                			wret = vpn_ws_write(b_peer, data, data_len);
-        			}
-        			if (wret < 0) {
-                			vpn_ws_peer_destroy(b_peer);
-                			dirty = 1;
-        			}
-        			else if (wret == 0) {
-                			dirty = 1;
-                			if (!b_peer->is_writing) {
-                        			if (vpn_ws_event_read_to_write(queue, b_peer->fd)) {
-                                			vpn_ws_peer_destroy(b_peer);
-						}
-                        		}
-                		}
-			}
-			goto decapitate;
+	// do we have a full websocket packet ?
+	ws_ret = vpn_ws_websocket_parse(peer, &ws_header);
+	if (ws_ret < 0) {
+		vpn_ws_peer_destroy(peer);
+		return -1;
+	}
+	// again
+	if (ws_ret == 0) return 0;
+	// ignore packet ?
+	if (ws_header == 0) goto decapitate;
+
+	uint8_t *ws = peer->buf + peer->off + ws_header;
+	uint64_t ws_len = ws_ret - ws_header;
+
+	// if the packed is masked, de-mask it
+	if (peer->has_mask) {
+		vpn_ws_mask(ws, ws_len, peer->mask);
+	}
+
+	// a compressed message, inflated in a new buffer
+	vpn_ws_fbuf *fb = peer->rbuf;
+	if (peer->deflated) {
+		fb = vpn_ws_peer_inflate(peer, ws, ws_len, &ws_len);
+		if (!fb) {
+			vpn_ws_peer_destroy(peer);
+			return -1;
 		}
+		ws = fb->data + VPN_WS_HEADROOM;
 	}
 
-	int wret = -1;
-	if (b_peer->raw && !peer->raw) {
-		wret = vpn_ws_write(b_peer, peer->buf+ws_header, ws_ret-ws_header);
+	int ret = 0;
+	// a multi-frame message, its frames will be encapsulated again for the other peers
+	if (peer->multi) {
+		uint64_t pos = 0;
+		uint8_t *frame = NULL;
+		int64_t frame_len = 0;
+		while((frame_len = vpn_ws_batch_next(ws, ws_len, &pos, &frame)) > 0) {
+			ret = vpn_ws_peer_frame(w, peer, fb, NULL, 0, frame, frame_len);
+			if (ret) break;
+		}
+		// a malformed message
+		if (!ret && frame_len < 0) {
+			if (fb != peer->rbuf) vpn_ws_fbuf_unref(fb);
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
 	}
-	else if (!b_peer->raw && peer->raw) {
-		wret = vpn_ws_write_websocket(b_peer, data, data_len);
+	else if (peer->deflated) {
+		// encapsulate it again (uncompressed) for the other peers
+		uint64_t data_len = 0;
+		uint8_t *data = vpn_ws_websocket_prepend(ws, ws_len, VPN_WS_HEADROOM, &data_len);
+		ret = vpn_ws_peer_frame(w, peer, fb, data, data_len, ws, ws_len);
 	}
 	else {
-		wret = vpn_ws_write(b_peer, data, data_len);
-	}
-	if (wret < 0) {
-        	vpn_ws_peer_destroy(b_peer);
-                dirty = 1;
-	}
-	else if (wret == 0) {
-		dirty = 1;
-		if (!b_peer->is_writing) {
-			if (vpn_ws_event_read_to_write(queue, b_peer->fd)) {
-				vpn_ws_peer_destroy(b_peer);
-			}
+		// set body to send
+		uint8_t *data = peer->buf + peer->off;
+		uint64_t data_len = ws_ret;
+
+		if (peer->has_mask) {
+			// move the header and clear the mask bit
+			memmove(data+4, data, ws_header - 4);	
+			data[5] &= 0x7f;
+
+			data+=4;
+			data_len-=4;
 		}
+
+		ret = vpn_ws_peer_frame(w, peer, fb, data, data_len, ws, ws_len);
 	}
 
+	if (fb != peer->rbuf) vpn_ws_fbuf_unref(fb);
+	if (ret) return -1;
+
 decapitate:
-	memmove(peer->buf, peer->buf + ws_ret, peer->pos - ws_ret);
-	peer->pos -= ws_ret;
+	vpn_ws_peer_consume(peer, ws_ret);
+	w->budget_frames--;
+	w->budget_bytes -= (uint64_t) ws_ret < w->budget_bytes ? (uint64_t) ws_ret : w->budget_bytes;
 	goto again;
 	// never here
 	return -1;
 }
+
+/*
+	consume the data in the read buffer of a peer, returns -1 if the peer
+	has been destroyed, 1 if the budget has been exhausted
+*/
+int vpn_ws_peer_process(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	int ret = vpn_ws_peer_parse(w, peer);
+	if (ret < 0) {
+		vpn_ws_batch_release(w, w->batch_n);
+		w->batch_n = 0;
+		return ret;
+	}
+	vpn_ws_peer_route(w, peer);
+	return ret;
+}
+
+// io_uring mode: manage the completion of a peer op
+int vpn_ws_uring_manage(vpn_ws_worker *w, vpn_ws_uring_cqe *cqe) {
+	vpn_ws_uring_op *op = cqe->op;
+	vpn_ws_peer *peer = NULL;
+
+	// the peer could have been destroyed (and the fd reused) in the meantime
+	if (op->fd >= 0 && (uint64_t) op->fd < w->peers_n) {
+		peer = w->peers[op->fd];
+		if (peer && peer->id != op->id) peer = NULL;
+	}
+
+	if (op->type == VPN_WS_URING_SEND) {
+		if (!peer) goto free_send;
+		peer->uring_sending--;
+		// the tap device refused the frame, drop it
+		if (op->raw && cqe->res == -EINVAL) {
+			__atomic_add_fetch(&peer->drops, 1, __ATOMIC_RELAXED);
+		}
+		else if (cqe->res <= 0) {
+			vpn_ws_frames_free(op->frames);
+			free(op);
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
+		else {
+			__atomic_add_fetch(&peer->tx, cqe->res, __ATOMIC_RELAXED);
+		}
+		// tap devices consume the whole frame
+		uint64_t written = op->raw ? op->frames->len - op->frames->pos : (uint64_t) cqe->res;
+		vpn_ws_peer_egress_sub(peer, written);
+		op->frames = vpn_ws_frames_consume(op->frames, written, NULL);
+		// short write, submit the remaining part
+		if (op->frames) {
+			if (vpn_ws_uring_resend(w->uring, op)) {
+				vpn_ws_frames_free(op->frames);
+				free(op);
+				vpn_ws_peer_destroy(peer);
+				return -1;
+			}
+			peer->uring_sending++;
+			return 0;
+		}
+free_send:
+		vpn_ws_frames_free(op->frames);
+		free(op);
+		if (!peer) return 0;
+		// frames queued in the meantime ?
+		if (peer->out_head) {
+			if (vpn_ws_uring_send(w->uring, peer)) {
+				vpn_ws_peer_destroy(peer);
+				return -1;
+			}
+			return 0;
+		}
+		if (peer->uring_sending) return 0;
+		peer->is_writing = 0;
+		// if handshake is higher than 1, it means we want to close the connection
+		if (peer->handshake > 1) {
+			vpn_ws_peer_destroy(peer);
+			return -1;
+		}
+		return 0;
+	}
+
+	// receive
+	if (!peer || peer->uring_recv != op) {
+		vpn_ws_uring_put(w->uring, cqe);
+		if (!cqe->more) free(op);
+		return 0;
+	}
+
+	if (cqe->res <= 0) {
+		// out of provided buffers or spurious wakeup of a raw device, retry
+		if (cqe->res == -ENOBUFS || cqe->res == -EAGAIN) {
+			if (!cqe->more && vpn_ws_uring_recv(w->uring, peer)) goto error;
+			return 0;
+		}
+		vpn_ws_uring_put(w->uring, cqe);
+		goto error;
+	}
+
+	if (vpn_ws_peer_reserve(peer, cqe->res)) {
+		vpn_ws_uring_put(w->uring, cqe);
+		goto error;
+	}
+	memcpy(peer->buf + peer->pos, cqe->buf, cqe->res);
+	vpn_ws_uring_put(w->uring, cqe);
+	__atomic_add_fetch(&peer->rx, cqe->res, __ATOMIC_RELAXED);
+	peer->pos += cqe->res;
+	peer->t_seen = vpn_ws_now();
+
+	// the multishot receive has been terminated by the kernel, rearm it
+	if (!cqe->more && vpn_ws_uring_recv(w->uring, peer)) goto error;
+
+	// a raw device returns a frame per read, it must be consumed before the next one
+	if (peer->raw) {
+		return vpn_ws_peer_serve(w, peer) < 0 ? -1 : 0;
+	}
+
+	vpn_ws_worker_ready(w, peer);
+	return 0;
+
+error:
+	// no more completions for the op ?
+	if (!cqe->more) {
+		peer->uring_recv = NULL;
+		free(op);
+	}
+	vpn_ws_peer_destroy(peer);
+	return -1;
+}
@@ -6,6 +6,9 @@
 
 */
 
+// learned MACs, always allocated and released with the write lock held
+static vpn_ws_pool vpn_ws_macs_pool = { sizeof(vpn_ws_mac), 256, NULL };
+
 int vpn_ws_mac_is_zero(uint8_t *buf) {
         if (buf[0] != 0) return 0;
         if (buf[1] != 0) return 0;
@@ -50,46 +53,400 @@ int vpn_ws_mac_is_multicast(uint8_t *buf) {
 	return 0;
 }
 
-vpn_ws_peer *vpn_ws_peer_by_mac(uint8_t *buf) {
+/*
+	the forwarding table is an open-addressing (linear probing) hash map
+	keyed on the 48bit MAC address. Slots are never tombstoned: on removal
+	the following entries of the cluster are shifted back, so lookups
+	always stop at the first empty slot.
+
+	MACs announced by a peer (handshake or first frame) always win over
+	MACs learned behind a bridge peer.
+
+	Learned MACs are kept in a per-peer list ordered by last use (head is
+	the most recent), so aging and evictions only need to look at the tail.
+*/
+
+#ifndef __WIN32__
+static pthread_rwlock_t vpn_ws_macmap_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/*
+	in multi-worker mode the table is read by every worker,
+	writes (registrations and learning) are serialized
+*/
+static void vpn_ws_macmap_rlock() {
+#ifndef __WIN32__
+	if (vpn_ws_conf.workers_n > 1) pthread_rwlock_rdlock(&vpn_ws_macmap_rwlock);
+#endif
+}
+
+static void vpn_ws_macmap_wlock() {
+#ifndef __WIN32__
+	if (vpn_ws_conf.workers_n > 1) pthread_rwlock_wrlock(&vpn_ws_macmap_rwlock);
+#endif
+}
+
+static void vpn_ws_macmap_unlock() {
+#ifndef __WIN32__
+	if (vpn_ws_conf.workers_n > 1) pthread_rwlock_unlock(&vpn_ws_macmap_rwlock);
+#endif
+}
+
+static uint64_t vpn_ws_mac_key(uint8_t *mac) {
+	return ((uint64_t) mac[0] << 40) |
+		((uint64_t) mac[1] << 32) |
+		((uint64_t) mac[2] << 24) |
+		((uint64_t) mac[3] << 16) |
+		((uint64_t) mac[4] << 8) |
+		(uint64_t) mac[5];
+}
+
+static uint64_t vpn_ws_mac_hash(uint64_t key) {
+	key *= 0x9E3779B97F4A7C15ULL;
+	return key ^ (key >> 29);
+}
+
+static vpn_ws_macmap_slot *vpn_ws_macmap_find(uint64_t key) {
+	if (!vpn_ws_conf.macmap_size) return NULL;
+	uint64_t mask = vpn_ws_conf.macmap_size - 1;
+	uint64_t i = vpn_ws_mac_hash(key) & mask;
+	for(;;) {
+		vpn_ws_macmap_slot *slot = &vpn_ws_conf.macmap[i];
+		// the zero MAC is never valid, so we use it as the empty marker
+		if (!slot->key) return NULL;
+		if (slot->key == key) return slot;
+		i = (i + 1) & mask;
+	}
+	// never here
+	return NULL;
+}
+
+static vpn_ws_macmap_slot *vpn_ws_macmap_insert(uint64_t key) {
+	uint64_t mask = vpn_ws_conf.macmap_size - 1;
+	uint64_t i = vpn_ws_mac_hash(key) & mask;
+	while(vpn_ws_conf.macmap[i].key) {
+		i = (i + 1) & mask;
+	}
+	vpn_ws_conf.macmap[i].key = key;
+	vpn_ws_conf.macmap_n++;
+	return &vpn_ws_conf.macmap[i];
+}
+
+static int vpn_ws_macmap_grow() {
+	uint64_t old_size = vpn_ws_conf.macmap_size;
+	vpn_ws_macmap_slot *old = vpn_ws_conf.macmap;
+
+	uint64_t size = old_size ? old_size * 2 : 256;
+	vpn_ws_macmap_slot *slots = vpn_ws_calloc(sizeof(vpn_ws_macmap_slot) * size);
+	if (!slots) return -1;
+
+	vpn_ws_conf.macmap = slots;
+	vpn_ws_conf.macmap_size = size;
+	vpn_ws_conf.macmap_n = 0;
+
 	uint64_t i;
-	for(i=0;i<vpn_ws_conf.peers_n;i++) {
-        	vpn_ws_peer *b_peer = vpn_ws_conf.peers[i];
-                if (!b_peer) continue;
-		if (!b_peer->mac_collected) continue;
-		if (!memcmp(b_peer->mac, buf, 6)) return b_peer;
+	for(i=0;i<old_size;i++) {
+		if (!old[i].key) continue;
+		vpn_ws_macmap_slot *slot = vpn_ws_macmap_insert(old[i].key);
+		slot->peer = old[i].peer;
+		slot->entry = old[i].entry;
 	}
 
-	return NULL;
+	if (old) free(old);
+	return 0;
+}
+
+static vpn_ws_macmap_slot *vpn_ws_macmap_get(uint64_t key) {
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_find(key);
+	if (slot) return slot;
+
+	// keep the load factor under 50%
+	if ((vpn_ws_conf.macmap_n + 1) * 2 > vpn_ws_conf.macmap_size) {
+		if (vpn_ws_macmap_grow()) return NULL;
+	}
+
+	return vpn_ws_macmap_insert(key);
 }
 
-vpn_ws_peer *vpn_ws_peer_by_bridge_mac(uint8_t *buf) {
-        uint64_t i;
-        for(i=0;i<vpn_ws_conf.peers_n;i++) {
-                vpn_ws_peer *b_peer = vpn_ws_conf.peers[i];
-                if (!b_peer) continue;
-                if (!b_peer->mac_collected) continue;
-		vpn_ws_mac *b_mac = b_peer->macs;
-		while(b_mac) {
-                	if (!memcmp(b_mac->mac, buf, 6)) return b_peer;
-			b_mac = b_mac->next;
+static void vpn_ws_macmap_remove(vpn_ws_macmap_slot *slot) {
+	uint64_t mask = vpn_ws_conf.macmap_size - 1;
+	uint64_t i = slot - vpn_ws_conf.macmap;
+	uint64_t j = i;
+	// backward shift deletion
+	for(;;) {
+		j = (j + 1) & mask;
+		if (!vpn_ws_conf.macmap[j].key) break;
+		uint64_t home = vpn_ws_mac_hash(vpn_ws_conf.macmap[j].key) & mask;
+		// can the entry in j be moved to the hole in i ?
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			vpn_ws_conf.macmap[i] = vpn_ws_conf.macmap[j];
+			i = j;
 		}
-        }
+	}
+	memset(&vpn_ws_conf.macmap[i], 0, sizeof(vpn_ws_macmap_slot));
+	vpn_ws_conf.macmap_n--;
+}
 
-        return NULL;
+static void vpn_ws_mac_unlink(vpn_ws_mac *b_mac) {
+	vpn_ws_peer *peer = b_mac->peer;
+	if (b_mac->prev) b_mac->prev->next = b_mac->next;
+	else peer->macs = b_mac->next;
+	if (b_mac->next) b_mac->next->prev = b_mac->prev;
+	else peer->macs_tail = b_mac->prev;
+	b_mac->prev = NULL;
+	b_mac->next = NULL;
+	peer->macs_n--;
 }
 
-int vpn_ws_bridge_collect_mac(vpn_ws_peer *peer, uint8_t *mac) {
-	// check if the mac is already collected
+static void vpn_ws_mac_link(vpn_ws_peer *peer, vpn_ws_mac *b_mac) {
+	b_mac->peer = peer;
+	b_mac->prev = NULL;
+	b_mac->next = peer->macs;
+	if (peer->macs) peer->macs->prev = b_mac;
+	else peer->macs_tail = b_mac;
+	peer->macs = b_mac;
+	peer->macs_n++;
+}
+
+// remove a learned MAC from both the peer list and the forwarding table
+static void vpn_ws_mac_forget(vpn_ws_mac *b_mac) {
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_find(vpn_ws_mac_key(b_mac->mac));
+	if (slot && slot->entry == b_mac) {
+		vpn_ws_macmap_remove(slot);
+	}
+	vpn_ws_mac_unlink(b_mac);
+	vpn_ws_pool_free(&vpn_ws_macs_pool, b_mac);
+}
+
+static int vpn_ws_mac_is_expired(vpn_ws_mac *b_mac) {
+	if (!vpn_ws_conf.mac_aging) return 0;
+	return vpn_ws_now() - b_mac->t > vpn_ws_conf.mac_aging;
+}
+
+/*
+	--streams: a connection joins the group of the peer owning its MAC (if it
+	has the same id), otherwise it starts a new one (taking over the MAC)
+*/
+static int vpn_ws_streams_join(vpn_ws_macmap_slot *slot, vpn_ws_peer *peer) {
+	vpn_ws_peer *owner = slot->peer;
+	if (owner && !slot->entry && owner->streams && owner->streams->id == peer->streams_id && owner->streams->n < VPN_WS_STREAMS_MAX) {
+		vpn_ws_streams *streams = owner->streams;
+		streams->peers[streams->n++] = peer;
+		peer->streams = streams;
+		__atomic_store_n(&peer->stream_secondary, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	vpn_ws_streams *streams = vpn_ws_calloc(sizeof(vpn_ws_streams));
+	if (!streams) return -1;
+	streams->id = peer->streams_id;
+	streams->peers[streams->n++] = peer;
+	peer->streams = streams;
+	return 0;
+}
+
+// the first of the remaining connections gets the floods
+static void vpn_ws_streams_leave(vpn_ws_peer *peer) {
+	vpn_ws_streams *streams = peer->streams;
+	peer->streams = NULL;
+	uint64_t i;
+	for(i=0;i<streams->n;i++) {
+		if (streams->peers[i] != peer) continue;
+		memmove(&streams->peers[i], &streams->peers[i+1], sizeof(vpn_ws_peer *) * (streams->n - i - 1));
+		streams->n--;
+		break;
+	}
+	if (!streams->n) {
+		free(streams);
+		return;
+	}
+	__atomic_store_n(&streams->peers[0]->stream_secondary, 0, __ATOMIC_RELAXED);
+}
+
+int vpn_ws_macmap_add(uint8_t *mac, vpn_ws_peer *peer) {
+	vpn_ws_macmap_wlock();
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_get(vpn_ws_mac_key(mac));
+	if (!slot) {
+		vpn_ws_macmap_unlock();
+		return -1;
+	}
+	if (peer->streams_id && !peer->streams) {
+		int ret = vpn_ws_streams_join(slot, peer);
+		if (ret) {
+			vpn_ws_macmap_unlock();
+			return ret < 0 ? -1 : 0;
+		}
+	}
+	// a directly connected peer takes over a learned MAC
+	if (slot->entry) {
+		vpn_ws_mac_unlink(slot->entry);
+		vpn_ws_pool_free(&vpn_ws_macs_pool, slot->entry);
+		slot->entry = NULL;
+	}
+	slot->peer = peer;
+	vpn_ws_macmap_unlock();
+	return 0;
+}
+
+void vpn_ws_macmap_del(uint8_t *mac, vpn_ws_peer *peer) {
+	vpn_ws_macmap_wlock();
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_find(vpn_ws_mac_key(mac));
+	vpn_ws_streams *streams = peer->streams;
+	if (streams) {
+		vpn_ws_streams_leave(peer);
+		// the other connections of the client keep the MAC
+		if (slot && slot->peer == peer && !slot->entry && streams->n) {
+			slot->peer = streams->peers[0];
+			vpn_ws_macmap_unlock();
+			return;
+		}
+	}
+	// the MAC could have been taken over by another peer
+	if (slot && slot->peer == peer && !slot->entry) {
+		vpn_ws_macmap_remove(slot);
+	}
+	vpn_ws_macmap_unlock();
+}
+
+/*
+	find the peer owning the destination MAC of a frame, returns -1 if not found
+	(route->peer can be safely used only by the owning worker)
+*/
+static int vpn_ws_macmap_lookup_locked(uint8_t *buf, uint64_t len, vpn_ws_route *route) {
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_find(vpn_ws_mac_key(buf));
+	// expired MACs are released by the learning path
+	if (!slot || (slot->entry && vpn_ws_mac_is_expired(slot->entry))) return -1;
+	vpn_ws_peer *peer = slot->peer;
+	// a striping client, the frames of a flow always take the same connection
+	if (!slot->entry && peer->streams && peer->streams->n > 1) {
+		peer = peer->streams->peers[vpn_ws_flow_hash(buf, len) % peer->streams->n];
+	}
+	route->peer = peer;
+	route->worker = peer->worker;
+	route->fd = peer->fd;
+	route->id = peer->id;
+	return 0;
+}
+
+int vpn_ws_macmap_lookup(uint8_t *buf, uint64_t len, vpn_ws_route *route) {
+	vpn_ws_macmap_rlock();
+	int ret = vpn_ws_macmap_lookup_locked(buf, len, route);
+	vpn_ws_macmap_unlock();
+	return ret;
+}
+
+// find the destinations of a batch of unicast frames, taking the lock only once
+void vpn_ws_macmap_lookup_batch(vpn_ws_batch_frame *frames, uint64_t n) {
+	uint64_t i;
+	vpn_ws_macmap_rlock();
+	for(i=0;i<n;i++) {
+		if (frames[i].flood) continue;
+		frames[i].found = !vpn_ws_macmap_lookup_locked(frames[i].eth, frames[i].eth_len, &frames[i].route);
+	}
+	vpn_ws_macmap_unlock();
+}
+
+static void vpn_ws_bridge_mac_expire(vpn_ws_peer *peer) {
+	while(peer->macs_tail && vpn_ws_mac_is_expired(peer->macs_tail)) {
+		vpn_ws_mac_forget(peer->macs_tail);
+	}
+}
+
+// release expired MACs (they are at the tail of the list)
+void vpn_ws_bridge_mac_aging(vpn_ws_peer *peer) {
+	vpn_ws_macmap_wlock();
+	vpn_ws_bridge_mac_expire(peer);
+	vpn_ws_macmap_unlock();
+}
+
+void vpn_ws_bridge_forget_macs(vpn_ws_peer *peer) {
+	vpn_ws_macmap_wlock();
+	while(peer->macs) {
+		vpn_ws_mac_forget(peer->macs);
+	}
+	vpn_ws_macmap_unlock();
+}
+
+// call fn for each MAC learned behind the peer
+int vpn_ws_bridge_foreach_mac(vpn_ws_peer *peer, int (*fn)(vpn_ws_mac *, void *), void *data) {
+	int ret = 0;
+	vpn_ws_macmap_rlock();
 	vpn_ws_mac *b_mac = peer->macs;
 	while(b_mac) {
-		if (!memcmp(b_mac->mac, mac, 6)) return 0;
+		ret = fn(b_mac, data);
+		if (ret) break;
 		b_mac = b_mac->next;
 	}
+	vpn_ws_macmap_unlock();
+	return ret;
+}
 
-	b_mac = vpn_ws_malloc(sizeof(vpn_ws_mac));
-	if (!b_mac) return -1;
-	memcpy(b_mac->mac, mac, 6);
-	b_mac->next = peer->macs;
-	peer->macs = b_mac;
+static int vpn_ws_bridge_learn_mac(vpn_ws_peer *peer, uint8_t *mac) {
+	uint64_t key = vpn_ws_mac_key(mac);
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_find(key);
+	vpn_ws_mac *b_mac = NULL;
+	if (slot) {
+		// owned by a directly connected peer
+		if (!slot->entry) return 0;
+		b_mac = slot->entry;
+		if (b_mac->peer == peer) {
+			// refresh (at most once per second)
+			time_t now = vpn_ws_now();
+			if (b_mac->t != now) {
+				b_mac->t = now;
+				if (b_mac->prev) {
+					vpn_ws_mac_unlink(b_mac);
+					vpn_ws_mac_link(peer, b_mac);
+				}
+			}
+			return 0;
+		}
+		// the MAC moved behind another peer, re-home it
+		vpn_ws_mac_unlink(b_mac);
+	}
+
+	// make room for the new MAC
+	if (vpn_ws_conf.mac_limit && peer->macs_n >= vpn_ws_conf.mac_limit) {
+		vpn_ws_bridge_mac_expire(peer);
+		if (peer->macs_n >= vpn_ws_conf.mac_limit) {
+			vpn_ws_mac_forget(peer->macs_tail);
+		}
+	}
+
+	if (!b_mac) {
+		b_mac = vpn_ws_pool_calloc(&vpn_ws_macs_pool);
+		if (!b_mac) return -1;
+		memcpy(b_mac->mac, mac, 6);
+		// the eviction could have moved slots around
+		slot = vpn_ws_macmap_get(key);
+		if (!slot) {
+			vpn_ws_pool_free(&vpn_ws_macs_pool, b_mac);
+			return -1;
+		}
+		slot->entry = b_mac;
+	}
+	else {
+		// the eviction could have moved slots around
+		slot = vpn_ws_macmap_find(key);
+	}
+
+	b_mac->t = vpn_ws_now();
+	vpn_ws_mac_link(peer, b_mac);
+	slot->peer = peer;
 	return 0;
 }
+
+int vpn_ws_bridge_collect_mac(vpn_ws_peer *peer, uint8_t *mac) {
+	// fast path: already collected (or owned by a directly connected peer)
+	vpn_ws_macmap_rlock();
+	vpn_ws_macmap_slot *slot = vpn_ws_macmap_find(vpn_ws_mac_key(mac));
+	if (slot && (!slot->entry || (slot->entry->peer == peer && slot->entry->t == vpn_ws_now()))) {
+		vpn_ws_macmap_unlock();
+		return 0;
+	}
+	vpn_ws_macmap_unlock();
+
+	vpn_ws_macmap_wlock();
+	int ret = vpn_ws_bridge_learn_mac(peer, mac);
+	vpn_ws_macmap_unlock();
+	return ret;
+}
@@ -10,19 +10,152 @@ static struct option vpn_ws_options[] = {
 	{"no-multicast", no_argument, &vpn_ws_conf.no_multicast, 1 },
 	{"uid", required_argument, NULL, 3 },
 	{"gid", required_argument, NULL, 4 },
+	{"mac-aging", required_argument, NULL, 5 },
+	{"mac-limit", required_argument, NULL, 6 },
+	{"workers", required_argument, NULL, 7 },
+	{"io-uring", no_argument, &vpn_ws_conf.io_uring, 1 },
+	{"idle-timeout", required_argument, NULL, 8 },
+	{"handshake-timeout", required_argument, NULL, 9 },
+	{"ping", required_argument, NULL, 10 },
+	{"egress-limit", required_argument, NULL, 11 },
+	{"egress-global-limit", required_argument, NULL, 12 },
+	{"egress-policy", required_argument, NULL, 13 },
+	{"pipeline", no_argument, &vpn_ws_conf.pipeline, 1 },
+	{"offload", no_argument, &vpn_ws_conf.offload, 1 },
+	{"no-batch", no_argument, &vpn_ws_conf.no_batch, 1 },
+	{"batch-bytes", required_argument, NULL, 14 },
+	{"batch-frames", required_argument, NULL, 15 },
+	{"deflate", no_argument, &vpn_ws_conf.deflate, 1 },
+	{"deflate-no-takeover", no_argument, &vpn_ws_conf.deflate_no_takeover, 1 },
+	{"deflate-min", required_argument, NULL, 16 },
 	{"help", no_argument, NULL, '?' },
 	{NULL, 0, 0, 0}
 };
 
+// io_uring mode: dispatch the completions of a cycle
+static void vpn_ws_worker_uring_loop(vpn_ws_worker *w, vpn_ws_fd server_fd) {
+	if (server_fd != vpn_ws_invalid_fd) {
+		if (vpn_ws_worker_uring_arm(w, VPN_WS_URING_ACCEPT, server_fd)) return;
+	}
+
+	for(;;) {
+		// do not block if there are peers waiting to be served
+		if (vpn_ws_uring_wait(w->uring, w->ready_head ? 0 : vpn_ws_timers_timeout(w))) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		vpn_ws_now_update();
+
+		vpn_ws_uring_cqe cqe;
+		while(vpn_ws_uring_next(w->uring, &cqe)) {
+			vpn_ws_uring_op *op = cqe.op;
+			// cancellations and linked polls
+			if (!op) continue;
+			if (op->type == VPN_WS_URING_ACCEPT) {
+				if (cqe.res >= 0) {
+					vpn_ws_peer_create(w, cqe.res, NULL);
+				}
+				else {
+					errno = -cqe.res;
+					vpn_ws_error("vpn_ws_worker_uring_loop()/accept()");
+				}
+				if (!cqe.more && vpn_ws_uring_accept(w->uring, op)) return;
+				continue;
+			}
+			// messages from other workers ?
+			if (op->type == VPN_WS_URING_POLL) {
+				vpn_ws_worker_drain(w);
+				if (!cqe.more && vpn_ws_uring_poll(w->uring, op)) return;
+				continue;
+			}
+			vpn_ws_uring_manage(w, &cqe);
+		}
+
+		vpn_ws_worker_run(w);
+		vpn_ws_timers_run(w);
+		vpn_ws_worker_close_messages(w);
+		vpn_ws_worker_flush_writes(w);
+		vpn_ws_worker_reap(w);
+
+		if (w->wakeup) {
+			vpn_ws_worker_flush(w);
+		}
+	}
+}
+
+/*
+	the event loop of a worker, server_fd is valid only in single-worker mode
+	(otherwise the main thread is the acceptor)
+*/
+void vpn_ws_worker_loop(vpn_ws_worker *w, vpn_ws_fd server_fd) {
+	if (w->uring) {
+		vpn_ws_worker_uring_loop(w, server_fd);
+		return;
+	}
+
+	for(;;) {
+		// do not block if there are peers waiting to be served
+		int ret = vpn_ws_event_wait(w->queue, w->events, w->ready_head ? 0 : vpn_ws_timers_timeout(w));
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		vpn_ws_now_update();
+
+#ifndef __WIN32__
+		int i;
+		for(i=0;i<ret;i++) {
+			int fd = vpn_ws_event_fd(w->events, i);
+			// a new connection ?
+			if (fd == server_fd) {
+				vpn_ws_peer_accept(w, server_fd);
+				continue;
+			}
+
+			// messages from other workers ?
+			if (w->rings && fd == w->notify_fd[0]) {
+				vpn_ws_worker_drain(w);
+				continue;
+			}
+
+			// events are edge triggered, they must be all consumed
+			// (peers destroyed in this cycle are unregistered, but their fd is still open)
+			vpn_ws_manage_fd(w, fd, vpn_ws_event_mask(w->events, i));
+		}
+
+		vpn_ws_worker_run(w);
+		vpn_ws_timers_run(w);
+		vpn_ws_worker_close_messages(w);
+		vpn_ws_worker_flush_writes(w);
+		vpn_ws_worker_reap(w);
+
+		if (w->wakeup) {
+			vpn_ws_worker_flush(w);
+		}
+#else
+#endif
+	}
+}
+
 int main(int argc, char *argv[]) {
 	int option_index = 0;
-	int event_queue = -1;
+	int workers = 1;
 
 	vpn_ws_fd server_fd;
 	vpn_ws_fd tuntap_fd;
 
 	setbuf(stdout, NULL);
 
+	vpn_ws_conf.mac_aging = 300;
+	vpn_ws_conf.mac_limit = 1024;
+	vpn_ws_conf.handshake_timeout = 30;
+	vpn_ws_conf.egress_limit = 8 * 1024 * 1024;
+	vpn_ws_conf.batch_bytes = 16384;
+	vpn_ws_conf.batch_frames = 64;
+	vpn_ws_conf.deflate_min = 128;
+
 #ifndef __WIN32__
 	sigset_t sset;
 	sigemptyset(&sset);
@@ -50,6 +183,54 @@ int main(int argc, char *argv[]) {
 			case 4:
 				vpn_ws_conf.gid = optarg;
 				break;
+			case 5:
+				vpn_ws_conf.mac_aging = atoi(optarg);
+				break;
+			case 6:
+				vpn_ws_conf.mac_limit = strtoull(optarg, NULL, 10);
+				break;
+			case 7:
+				workers = atoi(optarg);
+				break;
+			case 8:
+				vpn_ws_conf.idle_timeout = atoi(optarg);
+				break;
+			case 9:
+				vpn_ws_conf.handshake_timeout = atoi(optarg);
+				break;
+			case 10:
+				vpn_ws_conf.ping_interval = atoi(optarg);
+				break;
+			case 11:
+				vpn_ws_conf.egress_limit = strtoull(optarg, NULL, 10);
+				break;
+			case 12:
+				vpn_ws_conf.egress_global_limit = strtoull(optarg, NULL, 10);
+				break;
+			case 13:
+				if (!strcmp(optarg, "tail-drop")) {
+					vpn_ws_conf.egress_policy = VPN_WS_EGRESS_TAIL_DROP;
+				}
+				else if (!strcmp(optarg, "drop-broadcast")) {
+					vpn_ws_conf.egress_policy = VPN_WS_EGRESS_DROP_BROADCAST;
+				}
+				else if (!strcmp(optarg, "disconnect")) {
+					vpn_ws_conf.egress_policy = VPN_WS_EGRESS_DISCONNECT;
+				}
+				else {
+					vpn_ws_log("invalid egress policy: %s", optarg);
+					vpn_ws_exit(1);
+				}
+				break;
+			case 14:
+				vpn_ws_conf.batch_bytes = strtoull(optarg, NULL, 10);
+				break;
+			case 15:
+				vpn_ws_conf.batch_frames = strtoull(optarg, NULL, 10);
+				break;
+			case 16:
+				vpn_ws_conf.deflate_min = strtoull(optarg, NULL, 10);
+				break;
 			case '?':
 				fprintf(stdout, "usage: %s [options] <address>\n", argv[0]);
 				fprintf(stdout, "\t--tuntap <device>\tcreate the specified tuntap device and attach to the engine\n");
@@ -59,6 +240,24 @@ int main(int argc, char *argv[]) {
 				fprintf(stdout, "\t--no-multicast\t\tdisable multicast management\n");
 				fprintf(stdout, "\t--uid <user or uid>\tdrop privileges to the specified user/uid\n");
 				fprintf(stdout, "\t--gid <group or gid>\tdrop privileges to the specified group/did\n");
+				fprintf(stdout, "\t--mac-aging <secs>\tforget MACs learned behind bridge peers after <secs> of inactivity (default 300, 0 to disable)\n");
+				fprintf(stdout, "\t--mac-limit <n>\t\tmax number of MACs learned behind a single bridge peer (default 1024, 0 for unlimited)\n");
+				fprintf(stdout, "\t--workers <n>\t\tspread peers over <n> threads (default 1)\n");
+				fprintf(stdout, "\t--io-uring\t\tuse io_uring instead of epoll (linux only)\n");
+				fprintf(stdout, "\t--idle-timeout <secs>\tdisconnect peers not sending anything for <secs> (default 0, disabled)\n");
+				fprintf(stdout, "\t--handshake-timeout <secs>\tdisconnect peers not completing the handshake in <secs> (default 30, 0 to disable)\n");
+				fprintf(stdout, "\t--ping <secs>\t\tsend a websocket ping to peers idle for <secs> (default 0, disabled)\n");
+				fprintf(stdout, "\t--egress-limit <bytes>\tmax bytes queued for a single peer (default 8388608, 0 for unlimited)\n");
+				fprintf(stdout, "\t--egress-global-limit <bytes>\tmax bytes queued for all of the peers (default 0, unlimited)\n");
+				fprintf(stdout, "\t--egress-policy <policy>\twhat to do when a limit is hit: tail-drop (default), drop-broadcast or disconnect\n");
+				fprintf(stdout, "\t--pipeline\t\troute the frames of a read in batch, and write to each peer once per cycle\n");
+				fprintf(stdout, "\t--offload\t\tenable checksum and segmentation offloads on the tuntap device and for the peers asking for them\n");
+				fprintf(stdout, "\t--no-batch\t\tdo not accept the vpn-ws-batch subprotocol (multiple frames in a websocket message)\n");
+				fprintf(stdout, "\t--batch-bytes <bytes>\tmax size of a vpn-ws-batch message (default 16384)\n");
+				fprintf(stdout, "\t--batch-frames <n>\tmax number of frames in a vpn-ws-batch message (default 64)\n");
+				fprintf(stdout, "\t--deflate\t\taccept the permessage-deflate extension (compressed messages)\n");
+				fprintf(stdout, "\t--deflate-no-takeover\treset the compression contexts after each message (less memory, worse ratio)\n");
+				fprintf(stdout, "\t--deflate-min <bytes>\tdo not compress messages smaller than <bytes> (default 128)\n");
 				fprintf(stdout, "\t--help\t\t\tthis help\n");
 				exit(0);
 			default:
@@ -71,6 +270,10 @@ int main(int argc, char *argv[]) {
 		vpn_ws_conf.server_addr = argv[optind];
 	}
 
+	// room for at least a full sized frame
+	if (vpn_ws_conf.batch_bytes < 2048) vpn_ws_conf.batch_bytes = 2048;
+	if (vpn_ws_conf.batch_frames < 1) vpn_ws_conf.batch_frames = 1;
+
 	if (!vpn_ws_conf.server_addr) {
 		vpn_ws_log("you need to specify a socket address");
     vpn_ws_exit(1);
@@ -81,29 +284,48 @@ int main(int argc, char *argv[]) {
 		vpn_ws_exit(1);
 	}
 
-	if (vpn_ws_nb(server_fd)) {
+	vpn_ws_now_update();
+
+	if (vpn_ws_workers_init(workers)) {
 		vpn_ws_exit(1);
 	}
 
-	event_queue = vpn_ws_event_queue(256);
-	if (event_queue < 0) {
-		vpn_ws_exit(1);
+	// in multi-worker mode the main thread blocks in accept()
+	if (vpn_ws_conf.workers_n == 1) {
+		if (vpn_ws_nb(server_fd)) {
+			vpn_ws_exit(1);
+		}
 	}
 
+	// the tuntap device is always managed by the first worker
+	vpn_ws_worker *w = &vpn_ws_conf.workers[0];
+
 	if (vpn_ws_conf.tuntap_name) {
 		tuntap_fd = vpn_ws_tuntap(vpn_ws_conf.tuntap_name);
 		if (tuntap_fd < 0) {
 			vpn_ws_exit(1);
 		}
 
-		vpn_ws_peer_create(event_queue, tuntap_fd, vpn_ws_conf.tuntap_mac);
-		if (!vpn_ws_conf.peers) {
+		vpn_ws_peer_create(w, tuntap_fd, vpn_ws_conf.tuntap_mac);
+		if (!w->peers) {
 			vpn_ws_exit(1);
 		}
+		if (vpn_ws_conf.tuntap_vnet) {
+#ifndef __WIN32__
+			w->peers[tuntap_fd]->vnet = 1;
+#endif
+			// the provided buffers of io_uring cannot hold super-frames, checksums only
+			if (vpn_ws_tuntap_offload(tuntap_fd, vpn_ws_conf.io_uring ? VPN_WS_OFFLOAD_CSUM : VPN_WS_OFFLOAD_TSO)) {
+				vpn_ws_exit(1);
+			}
+		}
 		if (vpn_ws_conf.bridge) {
 #ifndef __WIN32__
 
-			vpn_ws_conf.peers[tuntap_fd]->bridge = 1;
+			w->peers[tuntap_fd]->bridge = 1;
+			if (vpn_ws_worker_index(w, w->peers[tuntap_fd])) {
+				vpn_ws_exit(1);
+			}
 #endif
 		}
 	}
@@ -167,39 +389,19 @@ int main(int argc, char *argv[]) {
         }
 #endif
 
-	if (vpn_ws_event_add_read(event_queue, server_fd)) {
-		vpn_ws_exit(1);
+	if (vpn_ws_conf.workers_n > 1) {
+		if (vpn_ws_workers_start()) {
+			vpn_ws_exit(1);
+		}
+		vpn_ws_acceptor_loop(server_fd);
+		return 0;
 	}
 
-
-	void *events = vpn_ws_event_events(64);
-	if (!events) {
+	if (!w->uring && vpn_ws_event_add_read(w->queue, server_fd)) {
 		vpn_ws_exit(1);
 	}
 
-	for(;;) {
-		int ret = vpn_ws_event_wait(event_queue, events);
-		if (ret <= 0) {
-			if (ret < 0 && errno == EINTR) continue;
-			break;
-		}
-
-#ifndef __WIN32__
-		int i;
-		for(i=0;i<ret;i++) {
-			int fd = vpn_ws_event_fd(events, i);
-			// a new connection ?
-			if (fd == server_fd) {
-				vpn_ws_peer_accept(event_queue, server_fd);
-				continue;
-			}
-
-			// on peer modification, exit the cycle
-			if (vpn_ws_manage_fd(event_queue, fd)) break;
-		}
-#else
-#endif
-	}
+	vpn_ws_worker_loop(w, server_fd);
 
 	return 0;
 }
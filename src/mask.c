@@ -0,0 +1,112 @@
+#include "vpn-ws.h"
+
+/*
+
+	websocket masking (and unmasking, it is the same xor)
+
+	the mask is applied 8, 16 or 32 bytes at a time, the best implementation
+	for the running cpu is chosen at the first call.
+	All of the payloads start at mask offset 0, so a block (multiple of 4 bytes)
+	is xor'ed with the mask repeated.
+
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VPN_WS_MASK_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VPN_WS_MASK_NEON
+#include <arm_neon.h>
+#endif
+
+// the remaining bytes (pos is a multiple of 4)
+static void vpn_ws_mask_tail(uint8_t *buf, uint64_t pos, uint64_t len, uint8_t *mask) {
+	for(;pos<len;pos++) {
+		buf[pos] ^= mask[pos % 4];
+	}
+}
+
+static void vpn_ws_mask_scalar(uint8_t *buf, uint64_t len, uint8_t *mask) {
+	uint64_t m;
+	memcpy(&m, mask, 4);
+	memcpy(((uint8_t *) &m) + 4, mask, 4);
+	uint64_t pos = 0;
+	for(;pos+8<=len;pos+=8) {
+		uint64_t v;
+		memcpy(&v, buf + pos, 8);
+		v ^= m;
+		memcpy(buf + pos, &v, 8);
+	}
+	vpn_ws_mask_tail(buf, pos, len, mask);
+}
+
+#ifdef VPN_WS_MASK_X86
+__attribute__((target("sse2")))
+static void vpn_ws_mask_sse2(uint8_t *buf, uint64_t len, uint8_t *mask) {
+	int32_t m;
+	memcpy(&m, mask, 4);
+	__m128i vm = _mm_set1_epi32(m);
+	uint64_t pos = 0;
+	for(;pos+16<=len;pos+=16) {
+		__m128i v = _mm_loadu_si128((__m128i *) (buf + pos));
+		_mm_storeu_si128((__m128i *) (buf + pos), _mm_xor_si128(v, vm));
+	}
+	vpn_ws_mask_tail(buf, pos, len, mask);
+}
+
+__attribute__((target("avx2")))
+static void vpn_ws_mask_avx2(uint8_t *buf, uint64_t len, uint8_t *mask) {
+	int32_t m;
+	memcpy(&m, mask, 4);
+	__m256i vm = _mm256_set1_epi32(m);
+	uint64_t pos = 0;
+	for(;pos+32<=len;pos+=32) {
+		__m256i v = _mm256_loadu_si256((__m256i *) (buf + pos));
+		_mm256_storeu_si256((__m256i *) (buf + pos), _mm256_xor_si256(v, vm));
+	}
+	// at most 31 bytes left
+	vpn_ws_mask_scalar(buf + pos, len - pos, mask);
+}
+#endif
+
+#ifdef VPN_WS_MASK_NEON
+static void vpn_ws_mask_neon(uint8_t *buf, uint64_t len, uint8_t *mask) {
+	uint32_t m;
+	memcpy(&m, mask, 4);
+	uint8x16_t vm = vreinterpretq_u8_u32(vdupq_n_u32(m));
+	uint64_t pos = 0;
+	for(;pos+16<=len;pos+=16) {
+		uint8x16_t v = vld1q_u8(buf + pos);
+		vst1q_u8(buf + pos, veorq_u8(v, vm));
+	}
+	vpn_ws_mask_tail(buf, pos, len, mask);
+}
+#endif
+
+static void (*vpn_ws_mask_fn)(uint8_t *, uint64_t, uint8_t *);
+
+// choose the implementation (racing threads will pick the same one)
+static void vpn_ws_mask_init() {
+	void (*fn)(uint8_t *, uint64_t, uint8_t *) = vpn_ws_mask_scalar;
+#ifdef VPN_WS_MASK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = vpn_ws_mask_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		fn = vpn_ws_mask_sse2;
+	}
+#endif
+#ifdef VPN_WS_MASK_NEON
+	fn = vpn_ws_mask_neon;
+#endif
+	vpn_ws_mask_fn = fn;
+}
+
+// xor a websocket payload with its mask
+void vpn_ws_mask(uint8_t *buf, uint64_t len, uint8_t *mask) {
+	if (!vpn_ws_mask_fn) vpn_ws_mask_init();
+	vpn_ws_mask_fn(buf, len, mask);
+}
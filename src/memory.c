@@ -1,35 +1,151 @@
 #include "vpn-ws.h"
 
+#ifndef __WIN32__
+static pthread_mutex_t vpn_ws_peers_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// in multi-worker mode protects the peers tables from the control interface
+void vpn_ws_peers_lock() {
+#ifndef __WIN32__
+	if (vpn_ws_conf.workers_n > 1) pthread_mutex_lock(&vpn_ws_peers_mutex);
+#endif
+}
+
+void vpn_ws_peers_unlock() {
+#ifndef __WIN32__
+	if (vpn_ws_conf.workers_n > 1) pthread_mutex_unlock(&vpn_ws_peers_mutex);
+#endif
+}
+
+// objects are 16 bytes aligned (a free one stores the pointer to the next), the big ones are cache line aligned
+#define VPN_WS_POOL_ALIGN(x) ((x) < VPN_WS_CACHELINE ? (((x) + 15) & ~((uint64_t) 15)) : (((x) + VPN_WS_CACHELINE - 1) & ~((uint64_t) VPN_WS_CACHELINE - 1)))
+
+static void *vpn_ws_slab_new(uint64_t amount) {
+#ifndef __WIN32__
+	void *ptr = NULL;
+	int ret = posix_memalign(&ptr, VPN_WS_CACHELINE, amount);
+	if (ret) {
+		errno = ret;
+		vpn_ws_error("vpn_ws_slab_new()/posix_memalign()");
+		return NULL;
+	}
+	return ptr;
+#else
+	return vpn_ws_malloc(amount);
+#endif
+}
+
+void *vpn_ws_pool_malloc(vpn_ws_pool *pool) {
+	if (!pool->free) {
+		uint64_t size = VPN_WS_POOL_ALIGN(pool->size);
+		uint8_t *slab = vpn_ws_slab_new(size * pool->slab);
+		if (!slab) return NULL;
+		// hand them out in address order
+		uint64_t i = pool->slab;
+		while(i > 0) {
+			i--;
+			void **obj = (void **) (slab + (size * i));
+			*obj = pool->free;
+			pool->free = obj;
+		}
+	}
+	void **obj = (void **) pool->free;
+	pool->free = *obj;
+	return obj;
+}
+
+void *vpn_ws_pool_calloc(vpn_ws_pool *pool) {
+	void *ptr = vpn_ws_pool_malloc(pool);
+	if (ptr) memset(ptr, 0, pool->size);
+	return ptr;
+}
+
+void vpn_ws_pool_free(vpn_ws_pool *pool, void *ptr) {
+	void **obj = (void **) ptr;
+	*obj = pool->free;
+	pool->free = obj;
+}
+
+/*
+	peers and frames are allocated and released by their owner worker,
+	so their pools are per-thread
+*/
+#ifndef __WIN32__
+static __thread vpn_ws_pool vpn_ws_peers_pool = { sizeof(vpn_ws_peer), 32, NULL };
+static __thread vpn_ws_pool vpn_ws_frames_pool = { sizeof(vpn_ws_frame), 256, NULL };
+#else
+static vpn_ws_pool vpn_ws_peers_pool = { sizeof(vpn_ws_peer), 32, NULL };
+static vpn_ws_pool vpn_ws_frames_pool = { sizeof(vpn_ws_frame), 256, NULL };
+#endif
+
+vpn_ws_peer *vpn_ws_peer_new() {
+	return vpn_ws_pool_calloc(&vpn_ws_peers_pool);
+}
+
+/*
+	unregister a peer. Peers owned by a worker are freed (and their fd closed)
+	at the end of the cycle, so pointers (and fds) held by the current cycle
+	stay valid and cannot be reused
+*/
 void vpn_ws_peer_destroy(vpn_ws_peer *peer) {
+	if (peer->dead) return;
+
+	vpn_ws_peers_lock();
+
+	// unregister the MACs before the fd can be reused
+	if (peer->mac_collected) {
+		vpn_ws_macmap_del(peer->mac, peer);
+	}
+	vpn_ws_bridge_forget_macs(peer);
+
+#ifndef __WIN32__
+	if (peer->worker)
+		peer->worker->peers[peer->fd] = NULL;
+#endif
+
+	vpn_ws_peers_unlock();
+
+	if (!peer->worker) {
+		vpn_ws_peer_free(peer);
+		return;
+	}
+
+	// the worker will unlink it from the ready list
+	peer->dead = 1;
+	peer->dead_next = peer->worker->dead;
+	peer->worker->dead = peer;
+}
+
+void vpn_ws_peer_free(vpn_ws_peer *peer) {
 	vpn_ws_fd fd = peer->fd;
-	
 #ifndef __WIN32__
 	if (fd > -1) {
 #else
+	// TODO find a solution for windows
 	if (fd) {
 #endif
 		vpn_ws_announce_peer(peer, "removing");
+		if (peer->worker && peer->worker->uring) {
+			vpn_ws_uring_cancel(peer->worker->uring, peer);
+		}
 		close(fd);
 	}
 	if (peer->remote_addr) free(peer->remote_addr);
 	if (peer->remote_user) free(peer->remote_user);
 	if (peer->dn) free(peer->dn);
-	if (peer->buf) free(peer->buf);
-
-	vpn_ws_mac *macs = peer->macs;
-	while(macs) {
-		vpn_ws_mac *next = macs->next;
-		free(macs);
-		macs = next;
+	if (peer->rbuf) {
+		vpn_ws_fbuf_unref(peer->rbuf);
 	}
-	free(peer);
-
-#ifndef __WIN32__
-	if (vpn_ws_conf.peers)
-		vpn_ws_conf.peers[fd] = NULL;
-#else
-	// TODO find a solution for windows
-#endif
+	else if (peer->buf) {
+		free(peer->buf);
+	}
+	if (peer->agg) vpn_ws_fbuf_unref(peer->agg);
+	if (peer->zs) vpn_ws_deflate_free(peer->zs);
+	vpn_ws_frames_free(peer->out_head);
+	if (peer->worker) {
+		__atomic_store_n(&peer->worker->egress_bytes, peer->worker->egress_bytes - peer->out_bytes, __ATOMIC_RELAXED);
+	}
+	vpn_ws_pool_free(&vpn_ws_peers_pool, peer);
 }
 
 void *vpn_ws_malloc(uint64_t amount) {
@@ -49,3 +165,212 @@ void *vpn_ws_calloc(uint64_t amount) {
         }
         return ptr;
 }
+
+/*
+	make room for amount bytes at the end of a buffer whose data lives between
+	*off and *pos. The consumed head is reclaimed only when the data to move is
+	not bigger than it (so the copies are paid by the already consumed bytes),
+	otherwise the buffer grows geometrically: appending and consuming are O(1)
+	amortized.
+*/
+int vpn_ws_buf_reserve(uint8_t **buf, uint64_t *off, uint64_t *pos, uint64_t *len, uint64_t amount) {
+	if (*len - *pos >= amount) return 0;
+	uint64_t live = *pos - *off;
+	if (*off > 0 && *off >= live && *len - live >= amount) {
+		memmove(*buf, *buf + *off, live);
+		*off = 0;
+		*pos = live;
+		return 0;
+	}
+	uint64_t new_len = *len * 2;
+	if (new_len < *pos + amount) new_len = *pos + amount;
+	void *tmp = realloc(*buf, new_len);
+	if (!tmp) {
+		vpn_ws_error("vpn_ws_buf_reserve()/realloc()");
+		return -1;
+	}
+	*buf = tmp;
+	*len = new_len;
+	return 0;
+}
+
+#define VPN_WS_FBUF_CLASS_SIZE(c) (1ULL << (VPN_WS_FBUF_MIN_SHIFT + (2 * (c))))
+
+#ifndef __WIN32__
+static __thread vpn_ws_fbuf *vpn_ws_fbuf_pool[VPN_WS_FBUF_CLASSES];
+static __thread uint64_t vpn_ws_fbuf_pool_bytes[VPN_WS_FBUF_CLASSES];
+#else
+static vpn_ws_fbuf *vpn_ws_fbuf_pool[VPN_WS_FBUF_CLASSES];
+static uint64_t vpn_ws_fbuf_pool_bytes[VPN_WS_FBUF_CLASSES];
+#endif
+
+// the smallest class able to hold size bytes (-1 if it is too big for the pools)
+static int vpn_ws_fbuf_class(uint64_t size) {
+	int c;
+	for(c=0;c<VPN_WS_FBUF_CLASSES;c++) {
+		if (size <= VPN_WS_FBUF_CLASS_SIZE(c)) return c;
+	}
+	return -1;
+}
+
+/*
+	buffers are rounded up to their size class and recycled through (per-thread)
+	free lists, the bigger ones are simply malloc'ed
+*/
+vpn_ws_fbuf *vpn_ws_fbuf_new(uint64_t size) {
+	vpn_ws_fbuf *fb = NULL;
+	int c = vpn_ws_fbuf_class(size);
+	if (c >= 0) {
+		size = VPN_WS_FBUF_CLASS_SIZE(c);
+		fb = vpn_ws_fbuf_pool[c];
+	}
+	if (fb) {
+		vpn_ws_fbuf_pool[c] = fb->next;
+		vpn_ws_fbuf_pool_bytes[c] -= size;
+	}
+	else {
+		fb = vpn_ws_malloc(sizeof(vpn_ws_fbuf) + size);
+		if (!fb) return NULL;
+		fb->size = size;
+	}
+	fb->refs = 1;
+	fb->next = NULL;
+	return fb;
+}
+
+void vpn_ws_fbuf_unref(vpn_ws_fbuf *fb) {
+	if (--fb->refs > 0) return;
+	int c = vpn_ws_fbuf_class(fb->size);
+	if (c >= 0 && fb->size == VPN_WS_FBUF_CLASS_SIZE(c) && vpn_ws_fbuf_pool_bytes[c] + fb->size <= VPN_WS_FBUF_CACHE) {
+		fb->next = vpn_ws_fbuf_pool[c];
+		vpn_ws_fbuf_pool[c] = fb;
+		vpn_ws_fbuf_pool_bytes[c] += fb->size;
+		return;
+	}
+	free(fb);
+}
+
+/*
+	make room for amount bytes in the read buffer of a server peer.
+	Frames still referenced by egress queues must not be touched, so a shared
+	buffer is never rewound or compacted: the unparsed data is moved to a new one.
+	Raw devices read a single frame at a time, leaving headroom in front of it.
+*/
+int vpn_ws_peer_reserve(vpn_ws_peer *peer, uint64_t amount) {
+	vpn_ws_fbuf *fb = peer->rbuf;
+	uint64_t head = peer->raw ? VPN_WS_HEADROOM : 0;
+	uint64_t live = peer->pos - peer->off;
+
+	if (fb && fb->refs == 1) {
+		// empty, rewind
+		if (live == 0) {
+			peer->off = head;
+			peer->pos = head;
+		}
+		if (peer->len - peer->pos >= amount) return 0;
+		if (peer->off > head && peer->off - head >= live && peer->len - head - live >= amount) {
+			memmove(fb->data + head, fb->data + peer->off, live);
+			peer->off = head;
+			peer->pos = head + live;
+			return 0;
+		}
+		uint64_t new_len = peer->len * 2;
+		if (new_len < peer->pos + amount) new_len = peer->pos + amount;
+		// keep it poolable
+		int c = vpn_ws_fbuf_class(new_len);
+		if (c >= 0) new_len = VPN_WS_FBUF_CLASS_SIZE(c);
+		void *tmp = realloc(fb, sizeof(vpn_ws_fbuf) + new_len);
+		if (!tmp) {
+			vpn_ws_error("vpn_ws_peer_reserve()/realloc()");
+			return -1;
+		}
+		fb = (vpn_ws_fbuf *) tmp;
+		fb->size = new_len;
+		peer->rbuf = fb;
+		peer->buf = fb->data;
+		peer->len = new_len;
+		return 0;
+	}
+
+	if (fb) {
+		// the headroom of a raw frame must not overlap the (still queued) previous one
+		uint64_t gap = live == 0 ? head : 0;
+		if (peer->len - peer->pos >= gap + amount) {
+			peer->off += gap;
+			peer->pos += gap;
+			return 0;
+		}
+	}
+
+	uint64_t size = VPN_WS_FBUF_SIZE;
+	if (size < head + live + amount) size = head + live + amount;
+	vpn_ws_fbuf *new_fb = vpn_ws_fbuf_new(size);
+	if (!new_fb) return -1;
+	if (fb) {
+		memcpy(new_fb->data + head, fb->data + peer->off, live);
+		vpn_ws_fbuf_unref(fb);
+	}
+	peer->rbuf = new_fb;
+	peer->buf = new_fb->data;
+	peer->len = new_fb->size;
+	peer->off = head;
+	peer->pos = head + live;
+	return 0;
+}
+
+// queue a frame (taking a reference to its buffer)
+vpn_ws_frame *vpn_ws_frame_new(vpn_ws_fbuf *fb, uint8_t *data, uint64_t len) {
+	vpn_ws_frame *frame = vpn_ws_pool_malloc(&vpn_ws_frames_pool);
+	if (!frame) return NULL;
+	fb->refs++;
+	frame->next = NULL;
+	frame->fb = fb;
+	frame->data = data;
+	frame->len = len;
+	frame->pos = 0;
+	return frame;
+}
+
+static void vpn_ws_frame_free(vpn_ws_frame *frame) {
+	vpn_ws_fbuf_unref(frame->fb);
+	vpn_ws_pool_free(&vpn_ws_frames_pool, frame);
+}
+
+/*
+	advance a chain of frames by amount bytes (the sent ones are freed),
+	returns the new head of the chain
+*/
+vpn_ws_frame *vpn_ws_frames_consume(vpn_ws_frame *frame, uint64_t amount, uint64_t *freed) {
+	while(frame && amount > 0) {
+		uint64_t remains = frame->len - frame->pos;
+		if (amount < remains) {
+			frame->pos += amount;
+			break;
+		}
+		amount -= remains;
+		vpn_ws_frame *next = frame->next;
+		vpn_ws_frame_free(frame);
+		if (freed) (*freed)++;
+		frame = next;
+	}
+	return frame;
+}
+
+void vpn_ws_frames_free(vpn_ws_frame *frame) {
+	while(frame) {
+		vpn_ws_frame *next = frame->next;
+		vpn_ws_frame_free(frame);
+		frame = next;
+	}
+}
+
+// consume data from the head of the read buffer of a peer
+void vpn_ws_peer_consume(vpn_ws_peer *peer, uint64_t amount) {
+	peer->off += amount;
+	if (peer->off < peer->pos) return;
+	peer->off = peer->pos;
+	// empty, rewind (unless queued frames still point to the buffer)
+	if (peer->rbuf && peer->rbuf->refs > 1) return;
+	peer->off = 0;
+	peer->pos = 0;
+}
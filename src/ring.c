@@ -0,0 +1,46 @@
+#include "vpn-ws.h"
+
+/*
+
+	lock-free single-producer/single-consumer ring of messages
+
+	the producer only writes head, the consumer only writes tail, so the
+	two sides never contend on the same cache line
+
+*/
+
+vpn_ws_ring *vpn_ws_ring_new(uint64_t size) {
+	// size must be a power of 2
+	uint64_t n = 1;
+	while(n < size) n <<= 1;
+
+	vpn_ws_ring *ring = vpn_ws_calloc(sizeof(vpn_ws_ring));
+	if (!ring) return NULL;
+	ring->msgs = vpn_ws_calloc(sizeof(vpn_ws_ring_msg) * n);
+	if (!ring->msgs) {
+		free(ring);
+		return NULL;
+	}
+	ring->size = n;
+	return ring;
+}
+
+// returns -1 if the ring is full
+int vpn_ws_ring_push(vpn_ws_ring *ring, vpn_ws_ring_msg *msg) {
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= ring->size) return -1;
+	ring->msgs[head & (ring->size - 1)] = *msg;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// returns 0 if the ring is empty
+int vpn_ws_ring_pop(vpn_ws_ring *ring, vpn_ws_ring_msg *msg) {
+	uint64_t tail = ring->tail;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (tail == head) return 0;
+	*msg = ring->msgs[tail & (ring->size - 1)];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
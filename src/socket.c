@@ -159,13 +159,13 @@ vpn_ws_fd vpn_ws_bind(char *name) {
 	return vpn_ws_bind_ipv4(name);
 }
 
-void vpn_ws_peer_create(int queue, vpn_ws_fd client_fd, uint8_t *mac) {
+void vpn_ws_peer_create(vpn_ws_worker *w, vpn_ws_fd client_fd, uint8_t *mac) {
 	if (vpn_ws_nb(client_fd)) {
                 close(client_fd);
                 return;
         }
 
-        if (vpn_ws_event_add_read(queue, client_fd)) {
+        if (!w->uring && vpn_ws_event_add_rw(w->queue, client_fd)) {
                 close(client_fd);
                 return;
         }
@@ -173,32 +173,43 @@ void vpn_ws_peer_create(int queue, vpn_ws_fd client_fd, uint8_t *mac) {
         // create a new peer structure
         // we use >= so we can lazily allocate memory even if fd is 0
 #ifndef __WIN32__
-        if (client_fd >= vpn_ws_conf.peers_n) {
-                void *tmp = realloc(vpn_ws_conf.peers, sizeof(vpn_ws_peer *) * (client_fd+1));
+        if (client_fd >= w->peers_n) {
+		vpn_ws_peers_lock();
+                void *tmp = realloc(w->peers, sizeof(vpn_ws_peer *) * (client_fd+1));
                 if (!tmp) {
+			vpn_ws_peers_unlock();
                         vpn_ws_error("vpn_ws_peer_accept()/realloc()");
                         close(client_fd);
                         return;
                 }
-                uint64_t delta = (client_fd+1) - vpn_ws_conf.peers_n;
-                memset(tmp + (sizeof(vpn_ws_peer *) * vpn_ws_conf.peers_n), 0, sizeof(vpn_ws_peer *) * delta);
-                vpn_ws_conf.peers_n = client_fd+1;
-                vpn_ws_conf.peers = (vpn_ws_peer **) tmp;
+                uint64_t delta = (client_fd+1) - w->peers_n;
+                memset(tmp + (sizeof(vpn_ws_peer *) * w->peers_n), 0, sizeof(vpn_ws_peer *) * delta);
+                w->peers_n = client_fd+1;
+                w->peers = (vpn_ws_peer **) tmp;
+		vpn_ws_peers_unlock();
         }
 #else
 // TODO find a solution for windows
 #endif
 
-        vpn_ws_peer *peer = vpn_ws_calloc(sizeof(vpn_ws_peer));
+        vpn_ws_peer *peer = vpn_ws_peer_new();
         if (!peer) {
                 close(client_fd);
                 return;
         }
 
         peer->fd = client_fd;
+	peer->worker = w;
+	peer->id = __atomic_add_fetch(&vpn_ws_conf.peers_id, 1, __ATOMIC_RELAXED);
 
 	if (mac) {
 		memcpy(peer->mac, mac, 6);
+		if (vpn_ws_macmap_add(peer->mac, peer)) {
+			peer->fd = -1;
+			vpn_ws_peer_free(peer);
+			close(client_fd);
+			return;
+		}
 		vpn_ws_announce_peer(peer, "registered new");
 		peer->mac_collected = 1;
 		// if we have a mac, the handshake is not needed
@@ -208,14 +219,30 @@ void vpn_ws_peer_create(int queue, vpn_ws_fd client_fd, uint8_t *mac) {
 	}
 
 #ifndef __WIN32__
-        vpn_ws_conf.peers[client_fd] = peer;
+	vpn_ws_peers_lock();
+        w->peers[client_fd] = peer;
+	vpn_ws_peers_unlock();
 #else
 // TODO find a solution for windows
 #endif
 
+	if (vpn_ws_worker_index(w, peer)) {
+		vpn_ws_peer_destroy(peer);
+		return;
+	}
+
+	if (w->uring && vpn_ws_uring_recv(w->uring, peer)) {
+		vpn_ws_peer_destroy(peer);
+		return;
+	}
+
+	// the handshake will overwrite it
+	peer->t = vpn_ws_now();
+	vpn_ws_peer_timer_start(w, peer);
+
 }
 
-void vpn_ws_peer_accept(int queue, int fd) {
+void vpn_ws_peer_accept(vpn_ws_worker *w, int fd) {
 #ifndef __WIN32__
 	struct sockaddr_un s_un;
         memset(&s_un, 0, sizeof(struct sockaddr_un));
@@ -235,7 +262,7 @@ void vpn_ws_peer_accept(int queue, int fd) {
 	}
 
 #ifndef __WIN32__
-	vpn_ws_peer_create(queue, client_fd, NULL);
+	vpn_ws_peer_create(w, client_fd, NULL);
 #else
 	// TODO find a solution for windows
 #endif
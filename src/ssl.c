@@ -168,22 +168,26 @@ error:
          return NULL;
 }
 
-int vpn_ws_ssl_write(void *ctx, uint8_t *buf, uint64_t len) {
+// the I/O functions of SecureTransport wait for the socket, so *want is never used
+ssize_t vpn_ws_ssl_write(void *ctx, uint8_t *buf, uint64_t len, int *want) {
 	size_t processed = -1;
 	OSStatus err = SSLWrite((SSLContextRef) ctx, (const void *)buf, len, &processed);
 	if (processed != len) return -1;
-	if (err == noErr) return 0;
+	if (err == noErr) return len;
 	return -1;
 }
 
-ssize_t vpn_ws_ssl_read(void *ctx, uint8_t *buf, uint64_t len) {
+ssize_t vpn_ws_ssl_read(void *ctx, uint8_t *buf, uint64_t len, int *want) {
 	size_t processed = -1;
         OSStatus err = SSLRead((SSLContextRef) ctx, buf, len, &processed);
-        if (err == noErr) return processed;
-	if (err == errSSLClosedGraceful) return 0;
+        if (err == noErr && processed > 0) return processed;
         return -1;
 }
 
+int vpn_ws_ssl_ktls(void *ctx) {
+	return 0;
+}
+
 void vpn_ws_ssl_close(void *ctx) {
 	SSLClose((SSLContextRef)ctx);
 	CFRelease(ctx);
@@ -199,14 +203,18 @@ void *vpn_ws_ssl_handshake(vpn_ws_peer *peer, char *sni, char *key, char *crt) {
 	return sec;
 }
 
-ssize_t vpn_ws_ssl_read(void *ctx, uint8_t *buf, uint64_t len) {
+ssize_t vpn_ws_ssl_read(void *ctx, uint8_t *buf, uint64_t len, int *want) {
 	return -1;
 }
 
-int vpn_ws_ssl_write(void *ctx, uint8_t *buf, uint64_t len) {
+ssize_t vpn_ws_ssl_write(void *ctx, uint8_t *buf, uint64_t len, int *want) {
 	return -1;
 }
 
+int vpn_ws_ssl_ktls(void *ctx) {
+	return 0;
+}
+
 void vpn_ws_ssl_close(void *ctx) {
 }
 
@@ -246,10 +254,17 @@ void *vpn_ws_ssl_handshake(vpn_ws_peer *peer, char *sni, char *key, char *crt) {
 #ifdef SSL_OP_NO_COMPRESSION
         	ssloptions |= SSL_OP_NO_COMPRESSION;
 #endif
+// the kernel takes over the encryption (when it supports the negotiated cipher)
+#ifdef SSL_OP_ENABLE_KTLS
+		if (!vpn_ws_conf.no_ktls) ssloptions |= SSL_OP_ENABLE_KTLS;
+#endif
+		SSL_CTX_set_options(ssl_ctx, ssloptions);
 // release/reuse buffers as soon as possibile
 #ifdef SSL_MODE_RELEASE_BUFFERS
 		SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
+		// the egress queue of the client can be partially written, and moved when it grows
+		SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 		if (vpn_ws_conf.ssl_no_verify) {
 			SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
 		}
@@ -323,61 +338,63 @@ error:
 	return NULL;
 }
 
-int vpn_ws_ssl_write(void *ctx, uint8_t *buf, uint64_t len) {
-	vpn_ws_peer *peer = (vpn_ws_peer *) SSL_get_ex_data((SSL *)ctx, ssl_peer_index);
-	for(;;) {
-                int ret = SSL_write((SSL *)ctx, buf, len);
-                if (ret > 0) break;
-                int err = SSL_get_error((SSL *)ctx, ret);
-                if (err == SSL_ERROR_WANT_READ) {
-                        if (_vpn_ws_ssl_wait_read(peer->fd)) return -1;
-                        continue;
-                }
-                if (err == SSL_ERROR_WANT_WRITE) {
-                        if (_vpn_ws_ssl_wait_write(peer->fd)) return -1;
-                        continue;
-                }
-		return -1;
-        }
-	return 0;	
+/*
+	the result of a non blocking operation: 0 if it must be retried when the
+	socket is ready for *want (a read can need a writable socket and a write
+	a readable one), -1 on error (or when the connection has been closed)
+*/
+static ssize_t vpn_ws_ssl_want(SSL *ssl, int ret, int *want) {
+	int err = SSL_get_error(ssl, ret);
+	if (err == SSL_ERROR_WANT_READ) {
+		*want = VPN_WS_EVENT_READ;
+		return 0;
+	}
+	if (err == SSL_ERROR_WANT_WRITE) {
+		*want = VPN_WS_EVENT_WRITE;
+		return 0;
+	}
+	if (err != SSL_ERROR_ZERO_RETURN) {
+		unsigned long e = ERR_get_error();
+		if (e) vpn_ws_warning("vpn_ws_ssl_want(): %s", ERR_error_string(e, NULL));
+	}
+	ERR_clear_error();
+	return -1;
 }
 
-ssize_t vpn_ws_ssl_read(void *ctx, uint8_t *buf, uint64_t len) {
-	vpn_ws_peer *peer = (vpn_ws_peer *) SSL_get_ex_data((SSL *)ctx, ssl_peer_index);
-	ssize_t ret = -1;
-	for(;;) {
-                ret = SSL_read((SSL *)ctx, buf, len);
-                if (ret > 0) break;
-                int err = SSL_get_error((SSL *)ctx, ret);
-                if (err == SSL_ERROR_WANT_READ) {
-                        if (_vpn_ws_ssl_wait_read(peer->fd)) return -1;
-                        continue;
-                }
-                if (err == SSL_ERROR_WANT_WRITE) {
-                        if (_vpn_ws_ssl_wait_write(peer->fd)) return -1;
-                        continue;
-                }
-                return -1;
-        }
-        return ret;
+/*
+	non blocking write: returns the amount of written bytes (it can be less than len),
+	0 if it must be retried (with the same data) when the socket is ready for *want
+*/
+ssize_t vpn_ws_ssl_write(void *ctx, uint8_t *buf, uint64_t len, int *want) {
+	int ret = SSL_write((SSL *)ctx, buf, len);
+	if (ret > 0) return ret;
+	return vpn_ws_ssl_want((SSL *)ctx, ret, want);
+}
+
+// non blocking read: returns the amount of read bytes, 0 if it must be retried when the socket is ready for *want
+ssize_t vpn_ws_ssl_read(void *ctx, uint8_t *buf, uint64_t len, int *want) {
+	int ret = SSL_read((SSL *)ctx, buf, len);
+	if (ret > 0) return ret;
+	return vpn_ws_ssl_want((SSL *)ctx, ret, want);
 }
 
+/*
+	kTLS: after the handshake OpenSSL passes the keys to the kernel if the tls module
+	is loaded and supports the cipher, otherwise the encryption stays in userspace.
+	With VPN_WS_KTLS_TX the socket can be written directly
+*/
+int vpn_ws_ssl_ktls(void *ctx) {
+	int ret = 0;
+#ifdef BIO_get_ktls_send
+	if (BIO_get_ktls_send(SSL_get_wbio((SSL *)ctx))) ret |= VPN_WS_KTLS_TX;
+	if (BIO_get_ktls_recv(SSL_get_rbio((SSL *)ctx))) ret |= VPN_WS_KTLS_RX;
+#endif
+	return ret;
+}
+
+// the socket is non blocking (and it is going to be closed), so the shutdown is only attempted
 void vpn_ws_ssl_close(void *ctx) {
-	vpn_ws_peer *peer = (vpn_ws_peer *) SSL_get_ex_data((SSL *)ctx, ssl_peer_index);
-	for(;;) {
-		int ret = SSL_shutdown((SSL *)ctx);
-		if (ret > 0) break;
-		int err = SSL_get_error((SSL *)ctx, ret);
-                if (err == SSL_ERROR_WANT_READ) {
-                        if (_vpn_ws_ssl_wait_read(peer->fd)) break;
-                        continue;
-                }
-                if (err == SSL_ERROR_WANT_WRITE) {
-                        if (_vpn_ws_ssl_wait_write(peer->fd)) break;
-                        continue;
-                }	
-		break;
-	}	
+	SSL_shutdown((SSL *)ctx);
 	ERR_clear_error();
 	SSL_free((SSL *) ctx);
 }
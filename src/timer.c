@@ -0,0 +1,125 @@
+#include "vpn-ws.h"
+
+/*
+
+	hierarchical timer wheel (one for each worker)
+
+	the resolution is 1 second: level 0 has a slot for each of the next 64 seconds,
+	level 1 for each of the next 64 minutes (of 64 seconds) and so on.
+	When the level 0 wraps, the next slot of level 1 is cascaded to level 0
+	(and so on for the upper levels), so adding, removing and expiring a timer
+	are O(1).
+
+*/
+
+#define VPN_WS_WHEEL_MASK (VPN_WS_WHEEL_SLOTS - 1)
+
+/*
+	first is the earliest tick the timer can be linked to: the next one for new
+	timers, the current one when cascading (its level 0 slot has still to run)
+*/
+static void vpn_ws_timer_link(vpn_ws_worker *w, vpn_ws_timer *t, uint64_t first) {
+	uint64_t expires = t->expires;
+	// already expired ? run it as soon as possible
+	if (expires < first) expires = first;
+	uint64_t delta = expires - w->wheel_tick;
+
+	int level = 0;
+	while(level < VPN_WS_WHEEL_LEVELS - 1 && delta >= (1ULL << (VPN_WS_WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+	// too far in the future, it will be cascaded again
+	if (delta >= (1ULL << (VPN_WS_WHEEL_BITS * (level + 1)))) {
+		expires = w->wheel_tick + (1ULL << (VPN_WS_WHEEL_BITS * (level + 1))) - 1;
+	}
+
+	vpn_ws_timer **slot = &w->wheel[level][(expires >> (VPN_WS_WHEEL_BITS * level)) & VPN_WS_WHEEL_MASK];
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = *slot;
+	if (*slot) (*slot)->prev = t;
+	*slot = t;
+}
+
+static void vpn_ws_timer_unlink(vpn_ws_timer *t) {
+	if (t->prev) {
+		t->prev->next = t->next;
+	}
+	else {
+		*t->slot = t->next;
+	}
+	if (t->next) {
+		t->next->prev = t->prev;
+	}
+	t->slot = NULL;
+	t->prev = NULL;
+	t->next = NULL;
+}
+
+// (re)schedule a timer at the specified time
+void vpn_ws_timer_add(vpn_ws_worker *w, vpn_ws_timer *t, time_t expires) {
+	vpn_ws_timer_del(w, t);
+	t->expires = expires;
+	vpn_ws_timer_link(w, t, w->wheel_tick + 1);
+	w->timers_n++;
+}
+
+void vpn_ws_timer_del(vpn_ws_worker *w, vpn_ws_timer *t) {
+	if (!t->slot) return;
+	vpn_ws_timer_unlink(t);
+	w->timers_n--;
+}
+
+// move the timers of an upper level slot to the lower levels
+static int vpn_ws_timers_cascade(vpn_ws_worker *w, int level) {
+	uint64_t idx = (w->wheel_tick >> (VPN_WS_WHEEL_BITS * level)) & VPN_WS_WHEEL_MASK;
+	vpn_ws_timer *t = w->wheel[level][idx];
+	w->wheel[level][idx] = NULL;
+	while(t) {
+		vpn_ws_timer *next = t->next;
+		vpn_ws_timer_link(w, t, w->wheel_tick);
+		t = next;
+	}
+	return idx;
+}
+
+// run the expired timers (up to vpn_ws_now())
+void vpn_ws_timers_run(vpn_ws_worker *w) {
+	uint64_t now = vpn_ws_now();
+	// the clock went back ? wait for it
+	while(w->wheel_tick < now) {
+		w->wheel_tick++;
+		uint64_t idx = w->wheel_tick & VPN_WS_WHEEL_MASK;
+		if (!idx) {
+			int level;
+			for(level=1;level<VPN_WS_WHEEL_LEVELS;level++) {
+				if (vpn_ws_timers_cascade(w, level)) break;
+			}
+		}
+		vpn_ws_timer **slot = &w->wheel[0][idx];
+		while(*slot) {
+			vpn_ws_timer *t = *slot;
+			vpn_ws_timer_del(w, t);
+			t->func(w, t);
+		}
+	}
+}
+
+// how much (in milliseconds) the event loop can sleep
+int vpn_ws_timers_timeout(vpn_ws_worker *w) {
+	if (!w->timers_n) return -1;
+	// late ? (the clock is checked only after a wakeup)
+	if (w->wheel_tick < (uint64_t) vpn_ws_now()) return 0;
+	uint64_t i;
+	for(i=1;i<=VPN_WS_WHEEL_SLOTS;i++) {
+		uint64_t tick = w->wheel_tick + i;
+		if (w->wheel[0][tick & VPN_WS_WHEEL_MASK]) return i * 1000;
+		// the upper levels are cascaded when the level 0 wraps
+		if (!(tick & VPN_WS_WHEEL_MASK)) return i * 1000;
+	}
+	return VPN_WS_WHEEL_SLOTS * 1000;
+}
+
+void vpn_ws_timers_init(vpn_ws_worker *w) {
+	w->wheel_tick = time(NULL);
+}
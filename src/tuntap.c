@@ -21,6 +21,10 @@ int vpn_ws_tuntap(char *name) {
 	memset(&ifr, 0, sizeof(struct ifreq));
 
         ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	// offloads: frames are prefixed by a virtio-net header
+	if (vpn_ws_conf.offload) {
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	}
 	strncpy(ifr.ifr_name, name, IFNAMSIZ);
 
 	if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
@@ -28,6 +32,15 @@ int vpn_ws_tuntap(char *name) {
                 return -1;
         }
 
+	if (vpn_ws_conf.offload) {
+		// the header is always little endian (as on the wire), needed only on big endian hosts
+#ifdef TUNSETVNETLE
+		int le = 1;
+		ioctl(fd, TUNSETVNETLE, &le);
+#endif
+		vpn_ws_conf.tuntap_vnet = 1;
+	}
+
 	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
 		vpn_ws_error("vpn_ws_tuntap()/ioctl()");
                 return -1;
@@ -40,6 +53,21 @@ int vpn_ws_tuntap(char *name) {
 	return fd;
 }
 
+/*
+	choose the offloads the kernel can use for the frames we read:
+	checksums only or TSO too (super-frames up to 64k)
+*/
+int vpn_ws_tuntap_offload(vpn_ws_fd fd, int level) {
+	unsigned int flags = 0;
+	if (level >= VPN_WS_OFFLOAD_CSUM) flags |= TUN_F_CSUM;
+	if (level >= VPN_WS_OFFLOAD_TSO) flags |= TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+	if (ioctl(fd, TUNSETOFFLOAD, flags) < 0) {
+		vpn_ws_error("vpn_ws_tuntap_offload()/ioctl()");
+		return -1;
+	}
+	return 0;
+}
+
 int vpn_ws_update_tuntap_mac(uint8_t *mac_updated) {
 	struct ifreq ifr;
 	if (mac_updated == NULL) {
@@ -169,6 +197,10 @@ end:
 	return NULL;
 }
 
+int vpn_ws_tuntap_offload(vpn_ws_fd fd, int level) {
+	return 0;
+}
+
 int vpn_ws_update_tuntap_mac(uint8_t *mac_updated) {
 	return 0;
 }
@@ -277,6 +309,10 @@ int vpn_ws_tuntap(char *name) {
 	return fd;
 }
 
+int vpn_ws_tuntap_offload(vpn_ws_fd fd, int level) {
+	return 0;
+}
+
 int vpn_ws_update_tuntap_mac(uint8_t *mac_updated) {
 	return 0;
 }
@@ -0,0 +1,431 @@
+#include "vpn-ws.h"
+
+/*
+	io_uring backend (linux only)
+
+	peers receive with multishot recv (or poll+read for raw devices) into a ring
+	of provided buffers, sends are queued as sqes and submitted together
+	with the wait, so a whole cycle of the event loop costs a single syscall.
+
+	the raw io_uring interface is used (no liburing dependency)
+*/
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// multishot recv and provided buffer rings are 6.0 features
+#if defined(IORING_RECV_MULTISHOT)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <stdint.h>
+
+struct vpn_ws_uring {
+	int fd;
+
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	uint32_t *sq_array;
+	struct io_uring_sqe *sqes;
+	// sqes filled but not yet submitted
+	uint32_t sq_local_tail;
+	uint32_t sq_pending;
+
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// provided buffers
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+	uint16_t br_tail;
+};
+
+static int vpn_ws_uring_enter(struct vpn_ws_uring *u, uint32_t min_complete, int timeout) {
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	void *arg = NULL;
+	size_t argsz = 0;
+	struct io_uring_getevents_arg gea;
+	struct __kernel_timespec ts;
+	if (min_complete && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		memset(&gea, 0, sizeof(struct io_uring_getevents_arg));
+		gea.ts = (uint64_t) (uintptr_t) &ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		arg = &gea;
+		argsz = sizeof(struct io_uring_getevents_arg);
+	}
+	for(;;) {
+		int ret = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, min_complete, flags, arg, argsz);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				// the caller will retry the wait
+				if (min_complete) return -1;
+				continue;
+			}
+			// timeout, or the completion queue is full (the sqes will be submitted at the next cycle)
+			if (errno == ETIME || errno == EBUSY || errno == EAGAIN) return 0;
+			vpn_ws_error("vpn_ws_uring_enter()/io_uring_enter()");
+			return -1;
+		}
+		u->sq_pending -= ret;
+		return 0;
+	}
+}
+
+static struct io_uring_sqe *vpn_ws_uring_sqe(struct vpn_ws_uring *u) {
+	// submission queue full ? flush it
+	if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		if (vpn_ws_uring_enter(u, 0, 0)) return NULL;
+		if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+			vpn_ws_log("[BUG] io_uring submission queue full");
+			return NULL;
+		}
+	}
+	uint32_t idx = u->sq_local_tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local_tail++;
+	u->sq_pending++;
+	return sqe;
+}
+
+static void vpn_ws_uring_buf_add(struct vpn_ws_uring *u, uint16_t bid) {
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (VPN_WS_URING_BUFS-1)];
+	buf->addr = (uint64_t) (uintptr_t) (u->bufs + ((uint64_t) bid * VPN_WS_URING_BUF_SIZE));
+	buf->len = VPN_WS_URING_BUF_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+struct vpn_ws_uring *vpn_ws_uring_new(uint32_t entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(struct io_uring_params));
+	// sends and receives can be a lot more than the sqes submitted in a cycle
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0) {
+		vpn_ws_error("vpn_ws_uring_new()/io_uring_setup()");
+		return NULL;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		vpn_ws_log("your kernel is too old for io_uring support");
+		close(fd);
+		return NULL;
+	}
+
+	struct vpn_ws_uring *u = vpn_ws_calloc(sizeof(struct vpn_ws_uring));
+	if (!u) {
+		close(fd);
+		return NULL;
+	}
+	u->fd = fd;
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len) sq_len = cq_len;
+
+	uint8_t *rings = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		vpn_ws_error("vpn_ws_uring_new()/mmap()");
+		goto error;
+	}
+
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		vpn_ws_error("vpn_ws_uring_new()/mmap()");
+		goto error;
+	}
+
+	u->sq_head = (uint32_t *) (rings + p.sq_off.head);
+	u->sq_tail = (uint32_t *) (rings + p.sq_off.tail);
+	u->sq_mask = *(uint32_t *) (rings + p.sq_off.ring_mask);
+	u->sq_entries = *(uint32_t *) (rings + p.sq_off.ring_entries);
+	u->sq_array = (uint32_t *) (rings + p.sq_off.array);
+	u->sq_local_tail = *u->sq_tail;
+
+	u->cq_head = (uint32_t *) (rings + p.cq_off.head);
+	u->cq_tail = (uint32_t *) (rings + p.cq_off.tail);
+	u->cq_mask = *(uint32_t *) (rings + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+
+	// the buffer ring must be page aligned
+	void *br = NULL;
+	if (posix_memalign(&br, 4096, sizeof(struct io_uring_buf) * VPN_WS_URING_BUFS)) {
+		vpn_ws_error("vpn_ws_uring_new()/posix_memalign()");
+		goto error;
+	}
+	memset(br, 0, sizeof(struct io_uring_buf) * VPN_WS_URING_BUFS);
+	u->br = br;
+
+	u->bufs = vpn_ws_malloc((uint64_t) VPN_WS_URING_BUFS * VPN_WS_URING_BUF_SIZE);
+	if (!u->bufs) goto error;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) br;
+	reg.ring_entries = VPN_WS_URING_BUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		vpn_ws_error("vpn_ws_uring_new()/io_uring_register()");
+		goto error;
+	}
+
+	uint16_t i;
+	for(i=0;i<VPN_WS_URING_BUFS;i++) {
+		vpn_ws_uring_buf_add(u, i);
+	}
+
+	return u;
+
+error:
+	// the worker cannot start, no need to unmap memory
+	close(fd);
+	return NULL;
+}
+
+// multishot poll, used for the workers notification fd
+int vpn_ws_uring_poll(struct vpn_ws_uring *u, vpn_ws_uring_op *op) {
+	struct io_uring_sqe *sqe = vpn_ws_uring_sqe(u);
+	if (!sqe) return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = op->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+	return 0;
+}
+
+// multishot accept, used for the listening socket
+int vpn_ws_uring_accept(struct vpn_ws_uring *u, vpn_ws_uring_op *op) {
+	struct io_uring_sqe *sqe = vpn_ws_uring_sqe(u);
+	if (!sqe) return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = op->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+	return 0;
+}
+
+/*
+	arm the receive of a peer: sockets use a multishot recv,
+	raw devices (that do not support it) a poll linked to a read
+*/
+int vpn_ws_uring_recv(struct vpn_ws_uring *u, vpn_ws_peer *peer) {
+	vpn_ws_uring_op *op = peer->uring_recv;
+	if (!op) {
+		op = vpn_ws_calloc(sizeof(vpn_ws_uring_op));
+		if (!op) return -1;
+		op->type = VPN_WS_URING_RECV;
+		op->fd = peer->fd;
+		op->id = peer->id;
+		op->raw = peer->raw;
+		peer->uring_recv = op;
+	}
+
+	struct io_uring_sqe *sqe = NULL;
+	if (op->raw) {
+		sqe = vpn_ws_uring_sqe(u);
+		if (!sqe) return -1;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = op->fd;
+		sqe->poll32_events = POLLIN;
+		sqe->flags = IOSQE_IO_LINK;
+		// the poll completion is ignored
+		sqe->user_data = 0;
+	}
+
+	sqe = vpn_ws_uring_sqe(u);
+	if (!sqe) return -1;
+	sqe->opcode = op->raw ? IORING_OP_READ : IORING_OP_RECV;
+	sqe->fd = op->fd;
+	if (op->raw) {
+		sqe->off = (uint64_t) -1;
+	}
+	else {
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	}
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+	return 0;
+}
+
+// (re)submit the unsent part of a send
+int vpn_ws_uring_resend(struct vpn_ws_uring *u, vpn_ws_uring_op *op) {
+	struct io_uring_sqe *sqe = vpn_ws_uring_sqe(u);
+	if (!sqe) return -1;
+	// map the unsent part of the frames
+	op->iov_n = 0;
+	vpn_ws_frame *frame = op->frames;
+	while(frame && op->iov_n < VPN_WS_IOV_MAX) {
+		op->iov[op->iov_n].iov_base = frame->data + frame->pos;
+		op->iov[op->iov_n].iov_len = frame->len - frame->pos;
+		op->iov_n++;
+		frame = frame->next;
+	}
+	sqe->fd = op->fd;
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->addr = (uint64_t) (uintptr_t) op->iov;
+	sqe->len = op->iov_n;
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+	return 0;
+}
+
+/*
+	hand the egress queue of a peer to the kernel.
+	Stream peers have at most one writev in flight (to preserve ordering),
+	the frames queued in the meantime are sent in a single op on completion.
+	Raw devices get one write for each frame (all of them submitted together).
+	Returns 0 (the data is pending) or -1 on error.
+*/
+int vpn_ws_uring_send(struct vpn_ws_uring *u, vpn_ws_peer *peer) {
+	if (!peer->raw && peer->uring_sending) return 0;
+
+	while(peer->out_head) {
+		vpn_ws_uring_op *op = vpn_ws_malloc(sizeof(vpn_ws_uring_op));
+		if (!op) return -1;
+		op->type = VPN_WS_URING_SEND;
+		op->fd = peer->fd;
+		op->id = peer->id;
+		op->raw = peer->raw;
+
+		// detach the frames from the queue
+		uint64_t n = 0;
+		int max = peer->raw ? 1 : VPN_WS_IOV_MAX;
+		vpn_ws_frame *last = peer->out_head;
+		for(;;) {
+			n++;
+			if (!last->next || (int) n >= max) break;
+			last = last->next;
+		}
+		op->frames = peer->out_head;
+		peer->out_head = last->next;
+		last->next = NULL;
+
+		if (vpn_ws_uring_resend(u, op)) {
+			// put them back
+			last->next = peer->out_head;
+			peer->out_head = op->frames;
+			free(op);
+			return -1;
+		}
+
+		if (!peer->out_head) peer->out_tail = NULL;
+		// the bytes in flight are still accounted in out_bytes
+		peer->out_frames -= n;
+		peer->uring_sending++;
+		if (!peer->raw) break;
+	}
+	return 0;
+}
+
+/*
+	cancel all of the ops of a peer (must be called before closing the fd).
+	The ops are freed when their last completion arrives
+*/
+void vpn_ws_uring_cancel(struct vpn_ws_uring *u, vpn_ws_peer *peer) {
+	peer->uring_recv = NULL;
+	struct io_uring_sqe *sqe = vpn_ws_uring_sqe(u);
+	if (!sqe) return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = peer->fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = 0;
+	// the fd is going to be closed, submit now
+	vpn_ws_uring_enter(u, 0, 0);
+}
+
+/*
+	submit the pending sqes and wait for at least one completion
+	(timeout is in milliseconds, -1 for waiting forever)
+*/
+int vpn_ws_uring_wait(struct vpn_ws_uring *u, int timeout) {
+	if (timeout == 0) {
+		if (!u->sq_pending) return 0;
+		return vpn_ws_uring_enter(u, 0, 0);
+	}
+	return vpn_ws_uring_enter(u, 1, timeout);
+}
+
+// get the next completion (0 if there are no more)
+int vpn_ws_uring_next(struct vpn_ws_uring *u, vpn_ws_uring_cqe *c) {
+	uint32_t head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+	struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+	c->op = (vpn_ws_uring_op *) (uintptr_t) cqe->user_data;
+	c->res = cqe->res;
+	c->more = (cqe->flags & IORING_CQE_F_MORE) ? 1 : 0;
+	c->buf = NULL;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		c->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		c->buf = u->bufs + ((uint64_t) c->bid * VPN_WS_URING_BUF_SIZE);
+	}
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// give back the provided buffer of a completion
+void vpn_ws_uring_put(struct vpn_ws_uring *u, vpn_ws_uring_cqe *c) {
+	if (!c->buf) return;
+	vpn_ws_uring_buf_add(u, c->bid);
+	c->buf = NULL;
+}
+
+#else
+
+struct vpn_ws_uring *vpn_ws_uring_new(uint32_t entries) {
+	vpn_ws_log("io_uring support is not available");
+	return NULL;
+}
+
+int vpn_ws_uring_poll(struct vpn_ws_uring *u, vpn_ws_uring_op *op) {
+	return -1;
+}
+
+int vpn_ws_uring_accept(struct vpn_ws_uring *u, vpn_ws_uring_op *op) {
+	return -1;
+}
+
+int vpn_ws_uring_recv(struct vpn_ws_uring *u, vpn_ws_peer *peer) {
+	return -1;
+}
+
+int vpn_ws_uring_resend(struct vpn_ws_uring *u, vpn_ws_uring_op *op) {
+	return -1;
+}
+
+int vpn_ws_uring_send(struct vpn_ws_uring *u, vpn_ws_peer *peer) {
+	return -1;
+}
+
+void vpn_ws_uring_cancel(struct vpn_ws_uring *u, vpn_ws_peer *peer) {
+}
+
+int vpn_ws_uring_wait(struct vpn_ws_uring *u, int timeout) {
+	return -1;
+}
+
+int vpn_ws_uring_next(struct vpn_ws_uring *u, vpn_ws_uring_cqe *c) {
+	return 0;
+}
+
+void vpn_ws_uring_put(struct vpn_ws_uring *u, vpn_ws_uring_cqe *c) {
+}
+
+#endif
@@ -7,13 +7,15 @@
 */
 
 ssize_t vpn_ws_uwsgi_parse(vpn_ws_peer *peer, uint8_t *modifier1, uint8_t *modifier2) {
-	if (peer->pos < 4) return 0;
-	*modifier1 = peer->buf[0];
-	*modifier2 = peer->buf[3];
-	uint16_t uwsgi_pktsize = vpn_ws_le16(peer->buf+1);
-	if (peer->pos < (4 + uwsgi_pktsize)) return 0;
+	uint8_t *buf = peer->buf + peer->off;
+	uint64_t available = peer->pos - peer->off;
+	if (available < 4) return 0;
+	*modifier1 = buf[0];
+	*modifier2 = buf[3];
+	uint16_t uwsgi_pktsize = vpn_ws_le16(buf+1);
+	if (available < (uint64_t) (4 + uwsgi_pktsize)) return 0;
 
-	uint8_t *pkt = peer->buf+4;
+	uint8_t *pkt = buf+4;
 
 	ssize_t ret = 4 + uwsgi_pktsize;
 
@@ -44,34 +46,40 @@ ssize_t vpn_ws_uwsgi_parse(vpn_ws_peer *peer, uint8_t *modifier1, uint8_t *modif
 }
 
 int vpn_ws_peer_add_var(vpn_ws_peer *peer, char *key, uint16_t keylen, char *val, uint16_t vallen) {
+	vpn_ws_vars *vars = peer->vars;
 	// max 64 vars
-	uint16_t pos = peer->vars_n;
+	uint16_t pos = vars->n;
 	if (pos >= 64) return -1;
 
-	peer->vars[pos].key = key;
-	peer->vars[pos].keylen = keylen;
-	peer->vars[pos].value = val;
-	peer->vars[pos].vallen = vallen;
-	peer->vars_n++;
+	vars->vars[pos].key = key;
+	vars->vars[pos].keylen = keylen;
+	vars->vars[pos].value = val;
+	vars->vars[pos].vallen = vallen;
+	vars->n++;
 	return 0;
 }
 
 char *vpn_ws_peer_get_var(vpn_ws_peer *peer, char *key, uint16_t keylen, uint16_t *vallen) {
+	vpn_ws_vars *vars = peer->vars;
 	int i;
-	if (peer->vars_n == 0) return NULL;
-	for(i=peer->vars_n-1;i>=0;i--) {
-		if (keylen != peer->vars[i].keylen) continue;
-		if (!memcmp(key, peer->vars[i].key, keylen)) {
-			*vallen = peer->vars[i].vallen;
-			return peer->vars[i].value;
+	if (!vars || vars->n == 0) return NULL;
+	for(i=vars->n-1;i>=0;i--) {
+		if (keylen != vars->vars[i].keylen) continue;
+		if (!memcmp(key, vars->vars[i].key, keylen)) {
+			*vallen = vars->vars[i].vallen;
+			return vars->vars[i].value;
 		}
 	}
 	return NULL;
 }
 
 #define HTTP_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+#define HTTP_OFFLOAD "\r\nX-vpn-ws-Offload: on"
+#define HTTP_BATCH "\r\nSec-WebSocket-Protocol: " VPN_WS_BATCH_PROTO
+#define HTTP_DEFLATE "\r\nSec-WebSocket-Extensions: "
+#define HTTP_STREAMS "\r\nX-vpn-ws-Streams: on"
 
-int64_t vpn_ws_handshake(int queue, vpn_ws_peer *peer) {
+static int64_t vpn_ws_handshake_vars(vpn_ws_peer *peer) {
 	uint8_t modifier1 = 0;
 	uint8_t modifier2 = 0;
 	ssize_t rlen = vpn_ws_uwsgi_parse(peer, &modifier1, &modifier2);
@@ -103,7 +111,7 @@ int64_t vpn_ws_handshake(int queue, vpn_ws_peer *peer) {
 	// control request ?
 	if (modifier1 == 1) {
 		peer->ctrl = 1;
-		return vpn_ws_ctrl_json(queue, peer);
+		return vpn_ws_ctrl_json(peer);
 	}
 
 	// now check for websocket request
@@ -112,6 +120,17 @@ int64_t vpn_ws_handshake(int queue, vpn_ws_peer *peer) {
 	if (!ws_key) return -1;
 
 
+	// --streams: the connections with the same id (and MAC) are a single peer
+	uint16_t ws_streams_len = 0;
+	char *ws_streams = vpn_ws_peer_get_var(peer, "HTTP_X_VPN_WS_STREAMS", 21, &ws_streams_len);
+	if (ws_streams) {
+		char streams_id[17];
+		if (ws_streams_len == 0 || ws_streams_len > 16) return -1;
+		memcpy(streams_id, ws_streams, ws_streams_len);
+		streams_id[ws_streams_len] = 0;
+		peer->streams_id = strtoull(streams_id, NULL, 16);
+	}
+
 	// check if the X-vpn-ws-MAC header is available
 	uint16_t ws_mac_len = 0;
 	char *ws_mac = vpn_ws_peer_get_var(peer, "HTTP_X_VPN_WS_MAC", 17, &ws_mac_len);
@@ -123,6 +142,7 @@ int64_t vpn_ws_handshake(int queue, vpn_ws_peer *peer) {
 			uint8_t n = strtoul(ws_mac + (i*3), NULL, 16);
 			peer->mac[i] = n;
 		}
+		if (vpn_ws_macmap_add(peer->mac, peer)) return -1;
 		peer->mac_collected = 1;
 		vpn_ws_announce_peer(peer, "registered new");
 	}
@@ -135,16 +155,39 @@ int64_t vpn_ws_handshake(int queue, vpn_ws_peer *peer) {
 		}
 	}
 
+	// the peer sends (and accepts) frames with a virtio-net header
+	uint16_t ws_offload_len = 0;
+	char *ws_offload = vpn_ws_peer_get_var(peer, "HTTP_X_VPN_WS_OFFLOAD", 21, &ws_offload_len);
+	if (ws_offload && vpn_ws_conf.offload) {
+		if (ws_offload_len == 2 && ws_offload[0] == 'o' && ws_offload[1] == 'n') {
+			peer->vnet = 1;
+		}
+	}
+
+	// multiple frames in a websocket message (legacy clients do not ask for it)
+	uint16_t ws_protocol_len = 0;
+	char *ws_protocol = vpn_ws_peer_get_var(peer, "HTTP_SEC_WEBSOCKET_PROTOCOL", 27, &ws_protocol_len);
+	if (ws_protocol && !vpn_ws_conf.no_batch) {
+		peer->multi = vpn_ws_websocket_has_protocol(ws_protocol, ws_protocol_len, VPN_WS_BATCH_PROTO);
+	}
+
+	// permessage-deflate (compressing costs cpu, so only if enabled)
+	vpn_ws_deflate_params deflate_params;
+	uint16_t ws_extensions_len = 0;
+	char *ws_extensions = vpn_ws_peer_get_var(peer, "HTTP_SEC_WEBSOCKET_EXTENSIONS", 29, &ws_extensions_len);
+	if (ws_extensions && vpn_ws_conf.deflate) {
+		if (vpn_ws_deflate_negotiate(ws_extensions, ws_extensions_len, 1, &deflate_params) > 0) {
+			peer->zs = vpn_ws_deflate_new(&deflate_params);
+			if (!peer->zs) return -1;
+		}
+	}
+
 	peer->t = time(NULL);
 
 	// build the response to complete the handshake
-	// use a static malloc'ed are to prebuild the response and changing only
-	// the result key
-	static uint8_t *http_response = NULL;
-	if (!http_response) {
-		http_response = vpn_ws_malloc(1024);
-		memcpy(http_response, HTTP_RESPONSE, sizeof(HTTP_RESPONSE)-1);	
-	}
+	// (on the stack, as multiple workers could run handshakes at the same time)
+	uint8_t http_response[1024];
+	memcpy(http_response, HTTP_RESPONSE, sizeof(HTTP_RESPONSE)-1);
 
 	uint8_t sha1[20];
 	struct sha1_ctxt ctxt;
@@ -159,39 +202,70 @@ int64_t vpn_ws_handshake(int queue, vpn_ws_peer *peer) {
 	
 	// append the result to the http response
 
-	memcpy(http_response + sizeof(HTTP_RESPONSE)-1, ws_accept, ws_accept_len);
-	memcpy(http_response + sizeof(HTTP_RESPONSE)-1 + ws_accept_len, "\r\n\r\n", 4);
+	uint64_t http_response_len = sizeof(HTTP_RESPONSE)-1;
+	memcpy(http_response + http_response_len, ws_accept, ws_accept_len);
+	http_response_len += ws_accept_len;
+	if (peer->vnet) {
+		memcpy(http_response + http_response_len, HTTP_OFFLOAD, sizeof(HTTP_OFFLOAD)-1);
+		http_response_len += sizeof(HTTP_OFFLOAD)-1;
+	}
+	if (peer->multi) {
+		memcpy(http_response + http_response_len, HTTP_BATCH, sizeof(HTTP_BATCH)-1);
+		http_response_len += sizeof(HTTP_BATCH)-1;
+	}
+	if (peer->streams_id) {
+		memcpy(http_response + http_response_len, HTTP_STREAMS, sizeof(HTTP_STREAMS)-1);
+		http_response_len += sizeof(HTTP_STREAMS)-1;
+	}
+	if (peer->zs) {
+		memcpy(http_response + http_response_len, HTTP_DEFLATE, sizeof(HTTP_DEFLATE)-1);
+		http_response_len += sizeof(HTTP_DEFLATE)-1;
+		int zret = vpn_ws_deflate_response(&deflate_params, (char *) http_response + http_response_len, sizeof(http_response) - http_response_len - 4);
+		if (zret < 0) return -1;
+		http_response_len += zret;
+	}
+	memcpy(http_response + http_response_len, "\r\n\r\n", 4);
+	http_response_len += 4;
 
 	// send the response
-	int ret = vpn_ws_write(peer, http_response, sizeof(HTTP_RESPONSE)-1 + ws_accept_len + 4);
+	int ret = vpn_ws_write(peer, http_response, http_response_len);
 	if (ret < 0) return -1;
-	// again ?
+	// again ? (the handshake is complete anyway, the response will be flushed later)
 	if (ret == 0) {
 		peer->is_writing = 1;
-		return vpn_ws_event_read_to_write(queue, peer->fd);
 	}
 
 	return rlen;
 }
 
-static int json_append(char *json, uint64_t *pos, uint64_t *len, char *buf, uint64_t buf_len) {
+// the vars point to the read buffer, so they live only during the handshake
+int64_t vpn_ws_handshake(vpn_ws_peer *peer) {
+	vpn_ws_vars vars;
+	vars.n = 0;
+	peer->vars = &vars;
+	int64_t ret = vpn_ws_handshake_vars(peer);
+	peer->vars = NULL;
+	return ret;
+}
+
+static int json_append(char **json, uint64_t *pos, uint64_t *len, char *buf, uint64_t buf_len) {
 	if (*pos + buf_len > *len) {
 		uint64_t delta = (*pos + buf_len) - *len;
 		if (delta < 8192) delta = 8192;
 		*len += delta;
-		char *tmp = realloc(json, *len);
+		char *tmp = realloc(*json, *len);
 		if (!tmp) {
 			vpn_ws_error("json_append()/realloc()");
 			return -1;
 		}
-		json = tmp;
+		*json = tmp;
 	}
-	memcpy(json+*pos, buf, buf_len);
+	memcpy(*json+*pos, buf, buf_len);
 	*pos += buf_len;
 	return 0;
 }
 
-static int json_append_num(char *json, uint64_t *pos, uint64_t *len, int64_t n) {
+static int json_append_num(char **json, uint64_t *pos, uint64_t *len, int64_t n) {
 	char buf[30];	
 #ifndef __WIN32__
 	int ret = snprintf(buf, 30, "%lld", (unsigned long long) n);
@@ -203,7 +277,7 @@ static int json_append_num(char *json, uint64_t *pos, uint64_t *len, int64_t n)
 	return json_append(json, pos, len, buf, ret);
 }
 
-static int json_append_mac(char *json, uint64_t *pos, uint64_t *len, uint8_t *mac) {
+static int json_append_mac(char **json, uint64_t *pos, uint64_t *len, uint8_t *mac) {
 	char buf[18];
 	int ret = snprintf(buf, 18, "%02X:%02X:%02X:%02X:%02X:%02X",
 		mac[0],
@@ -216,7 +290,7 @@ static int json_append_mac(char *json, uint64_t *pos, uint64_t *len, uint8_t *ma
 	return json_append(json, pos, len, buf, ret);
 }
 
-static int json_append_json(char *json, uint64_t *pos, uint64_t *len, char *buf, uint64_t buf_len) {
+static int json_append_json(char **json, uint64_t *pos, uint64_t *len, char *buf, uint64_t buf_len) {
 	uint64_t i;
 	for(i=0;i<buf_len;i++) {
 		if (buf[i] == '\t') {
@@ -241,6 +315,124 @@ static int json_append_json(char *json, uint64_t *pos, uint64_t *len, char *buf,
 	return 0;
 }
 
+struct json_macs {
+	char **json;
+	uint64_t *pos;
+	uint64_t *len;
+	uint8_t found;
+};
+
+static int json_append_learned_mac(vpn_ws_mac *b_mac, void *data) {
+	struct json_macs *jm = (struct json_macs *) data;
+	if (jm->found) {
+		if (json_append(jm->json, jm->pos, jm->len, ",", 1)) return -1;
+	}
+	jm->found = 1;
+	if (json_append(jm->json, jm->pos, jm->len, "\"", 1)) return -1;
+	if (json_append_mac(jm->json, jm->pos, jm->len, b_mac->mac)) return -1;
+	return json_append(jm->json, jm->pos, jm->len, "\"", 1);
+}
+
+static int json_append_peers(char **json, uint64_t *json_pos, uint64_t *json_len) {
+	uint8_t found = 0;
+	int w;
+	for(w=0;w<vpn_ws_conf.workers_n;w++) {
+		vpn_ws_worker *b_w = &vpn_ws_conf.workers[w];
+		uint64_t i;
+		for(i=0;i<b_w->peers_n;i++) {
+			vpn_ws_peer *b_peer = b_w->peers[i];
+
+			if (!b_peer) continue;
+			if (b_peer->ctrl) continue;
+
+			found = 1;
+
+			if (json_append(json, json_pos, json_len, "{\"id\":", 6)) return -1;
+			if (json_append_num(json, json_pos, json_len, (int) b_peer->fd)) return -1;
+
+			if (json_append(json, json_pos, json_len, ",\"MAC\":\"", 8)) return -1;
+			if (json_append_mac(json, json_pos, json_len, b_peer->mac)) return -1;
+
+			if (json_append(json, json_pos, json_len, "\",\"REMOTE_ADDR\":\"", 17)) return -1;
+			if (json_append_json(json, json_pos, json_len, b_peer->remote_addr, b_peer->remote_addr_len)) return -1;
+
+			if (json_append(json, json_pos, json_len, "\",\"REMOTE_USER\":\"", 17)) return -1;
+			if (json_append_json(json, json_pos, json_len, b_peer->remote_user, b_peer->remote_user_len)) return -1;
+
+			if (json_append(json, json_pos, json_len, "\",\"DN\":\"", 8)) return -1;
+			if (json_append_json(json, json_pos, json_len, b_peer->dn, b_peer->dn_len)) return -1;
+
+#ifndef __WIN32__
+			char ts[26];
+			ctime_r(&b_peer->t, ts);
+#else
+			char *ts = ctime(&b_peer->t);
+#endif
+			if (json_append(json, json_pos, json_len, "\",\"ts\":\"", 8)) return -1;
+			if (json_append_json(json, json_pos, json_len, ts, 24)) return -1;
+
+			if (json_append(json, json_pos, json_len, "\",\"bridge\":", 11)) return -1;
+			if (json_append_num(json, json_pos, json_len, b_peer->bridge)) return -1;
+
+			if (json_append(json, json_pos, json_len, ",\"macs\":[", 9)) return -1;
+
+			vpn_ws_bridge_mac_aging(b_peer);
+
+			struct json_macs jm;
+			jm.json = json;
+			jm.pos = json_pos;
+			jm.len = json_len;
+			jm.found = 0;
+			if (vpn_ws_bridge_foreach_mac(b_peer, json_append_learned_mac, &jm)) return -1;
+
+			if (json_append(json, json_pos, json_len, "],\"unix\":", 9)) return -1;
+			if (json_append_num(json, json_pos, json_len, b_peer->t)) return -1;
+
+			if (json_append(json, json_pos, json_len, ",\"tx\":", 6)) return -1;
+			if (json_append_num(json, json_pos, json_len, __atomic_load_n(&b_peer->tx, __ATOMIC_RELAXED))) return -1;
+
+			if (json_append(json, json_pos, json_len, ",\"rx\":", 6)) return -1;
+			if (json_append_num(json, json_pos, json_len, __atomic_load_n(&b_peer->rx, __ATOMIC_RELAXED))) return -1;
+
+			if (json_append(json, json_pos, json_len, ",\"queued\":", 10)) return -1;
+			if (json_append_num(json, json_pos, json_len, __atomic_load_n(&b_peer->out_bytes, __ATOMIC_RELAXED))) return -1;
+
+			if (json_append(json, json_pos, json_len, ",\"drops\":", 9)) return -1;
+			if (json_append_num(json, json_pos, json_len, __atomic_load_n(&b_peer->drops, __ATOMIC_RELAXED))) return -1;
+
+			if (json_append(json, json_pos, json_len, "},", 2)) return -1;
+		}
+	}
+
+	// remove last comma
+	if (found)
+		(*json_pos)--;
+
+	return 0;
+}
+
+// the egress (and inter-worker) counters of all of the workers
+static int json_append_egress(char **json, uint64_t *json_pos, uint64_t *json_len) {
+	uint64_t bytes = 0, drops = 0, disconnects = 0, ring_drops = 0;
+	int w;
+	for(w=0;w<vpn_ws_conf.workers_n;w++) {
+		vpn_ws_worker *b_w = &vpn_ws_conf.workers[w];
+		bytes += __atomic_load_n(&b_w->egress_bytes, __ATOMIC_RELAXED);
+		drops += __atomic_load_n(&b_w->egress_drops, __ATOMIC_RELAXED);
+		disconnects += __atomic_load_n(&b_w->egress_disconnects, __ATOMIC_RELAXED);
+		ring_drops += __atomic_load_n(&b_w->ring_drops, __ATOMIC_RELAXED);
+	}
+	if (json_append(json, json_pos, json_len, ",\"egress\":{\"queued\":", 20)) return -1;
+	if (json_append_num(json, json_pos, json_len, bytes)) return -1;
+	if (json_append(json, json_pos, json_len, ",\"drops\":", 9)) return -1;
+	if (json_append_num(json, json_pos, json_len, drops)) return -1;
+	if (json_append(json, json_pos, json_len, ",\"disconnects\":", 15)) return -1;
+	if (json_append_num(json, json_pos, json_len, disconnects)) return -1;
+	if (json_append(json, json_pos, json_len, ",\"ring_drops\":", 14)) return -1;
+	if (json_append_num(json, json_pos, json_len, ring_drops)) return -1;
+	return json_append(json, json_pos, json_len, "}", 1);
+}
+
 /*
 	QUERY_STRING functions
 */
@@ -288,13 +480,13 @@ static char *qs_get(char *qs, uint16_t qs_len, char *key, uint16_t key_len, uint
 */
 
 #define HTTP_RESPONSE_JSON "HTTP/1.0 200 OK\r\nConnection: close\r\nCache-Control: no-cache, no-store, must-revalidate\r\nPragma: no-cache\r\nExpires: 0\r\nContent-Type: application/json\r\n\r\n"
-int64_t vpn_ws_ctrl_json(int queue, vpn_ws_peer *peer) {
+int64_t vpn_ws_ctrl_json(vpn_ws_peer *peer) {
 	int ret;
 	uint64_t json_pos = 0;
 	uint64_t json_len = 8192;
 	char *json = vpn_ws_malloc(json_len);
 	if (!json) return -1;
-	if (json_append(json, &json_pos, &json_len, HTTP_RESPONSE_JSON, sizeof(HTTP_RESPONSE_JSON)-1)) goto end;
+	if (json_append(&json, &json_pos, &json_len, HTTP_RESPONSE_JSON, sizeof(HTTP_RESPONSE_JSON)-1)) goto end;
 
 	uint16_t query_string_len = 0;
 	char *query_string = vpn_ws_peer_get_var(peer, "QUERY_STRING", 12, &query_string_len);
@@ -303,104 +495,75 @@ int64_t vpn_ws_ctrl_json(int queue, vpn_ws_peer *peer) {
 		char *kill_peer = qs_get(query_string, query_string_len, "kill", 4, &kill_peer_len);
 		if (kill_peer) {
 			int fd = vpn_ws_str_to_uint(kill_peer, kill_peer_len);
-			if (fd < 0 || fd > vpn_ws_conf.peers_n) {
+			vpn_ws_peer *b_peer = NULL;
+			vpn_ws_worker *b_w = NULL;
+			uint64_t b_id = 0;
+			// fds are unique, so search in every worker
+			vpn_ws_peers_lock();
+			int i;
+			for(i=0;i<vpn_ws_conf.workers_n;i++) {
+				b_w = &vpn_ws_conf.workers[i];
+				if (fd < 0 || fd >= b_w->peers_n) continue;
+				b_peer = b_w->peers[fd];
+				if (b_peer) break;
+			}
+			if (b_peer && !b_peer->raw && !b_peer->ctrl) {
+				b_id = b_peer->id;
+			}
+			vpn_ws_peers_unlock();
+			if (!b_id) {
 				json[9] = '4';
 				json[10] = '0';
 				json[11] = '4';
-				if (json_append(json, &json_pos, &json_len, "{\"status\":\"not found\"}", 22)) goto end;	
+				if (json_append(&json, &json_pos, &json_len, "{\"status\":\"not found\"}", 22)) goto end;	
 				goto commit;
 			}
-			vpn_ws_peer *b_peer = vpn_ws_conf.peers[fd];
-			if (!b_peer || b_peer->raw || b_peer->ctrl) {
-				json[9] = '4';
+			// only the owner worker can destroy the peer
+			if (b_w == peer->worker) {
+				vpn_ws_peer_destroy(b_peer);
+			}
+#ifndef __WIN32__
+			// the ring of the owner is full, let the client retry
+			else if (vpn_ws_worker_post(peer->worker, b_w, VPN_WS_MSG_KILL, fd, b_id, NULL, NULL, 0)) {
+				vpn_ws_log("worker %d is overloaded, unable to kill peer %d", b_w->id, fd);
+				json[9] = '5';
 				json[10] = '0';
-				json[11] = '4';
-				if (json_append(json, &json_pos, &json_len, "{\"status\":\"not found\"}", 22)) goto end;	
+				json[11] = '3';
+				if (json_append(&json, &json_pos, &json_len, "{\"status\":\"busy\"}", 17)) goto end;
 				goto commit;
 			}
-			vpn_ws_peer_destroy(b_peer);
-			if (json_append(json, &json_pos, &json_len, "{\"status\":\"ok\"}", 15)) goto end;
+#endif
+			if (json_append(&json, &json_pos, &json_len, "{\"status\":\"ok\"}", 15)) goto end;
                         goto commit;
 		}
 	}
 
-	if (json_append(json, &json_pos, &json_len, "{\"status\":\"ok\",\"peers\":[", 24)) goto end;
-
-	uint64_t i;
-	uint8_t found = 0;
-        for(i=0;i<vpn_ws_conf.peers_n;i++) {
-                vpn_ws_peer *b_peer = vpn_ws_conf.peers[i];
-
-                if (!b_peer) continue;
-		if (b_peer->ctrl) continue;
+	if (json_append(&json, &json_pos, &json_len, "{\"status\":\"ok\",\"peers\":[", 24)) goto end;
 
-		found = 1;
+	vpn_ws_peers_lock();
+	ret = json_append_peers(&json, &json_pos, &json_len);
+	vpn_ws_peers_unlock();
+	if (ret) goto end;
 
-		if (json_append(json, &json_pos, &json_len, "{\"id\":", 6)) goto end;
-		if (json_append_num(json, &json_pos, &json_len, (int) b_peer->fd)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, ",\"MAC\":\"", 8)) goto end;
-		if (json_append_mac(json, &json_pos, &json_len, b_peer->mac)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, "\",\"REMOTE_ADDR\":\"", 17)) goto end;
-		if (json_append_json(json, &json_pos, &json_len, b_peer->remote_addr, b_peer->remote_addr_len)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, "\",\"REMOTE_USER\":\"", 17)) goto end;
-		if (json_append_json(json, &json_pos, &json_len, b_peer->remote_user, b_peer->remote_user_len)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, "\",\"DN\":\"", 8)) goto end;
-		if (json_append_json(json, &json_pos, &json_len, b_peer->dn, b_peer->dn_len)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, "\",\"ts\":\"", 8)) goto end;
-		if (json_append_json(json, &json_pos, &json_len, ctime(&b_peer->t), 24)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, "\",\"bridge\":", 11)) goto end;
-		if (json_append_num(json, &json_pos, &json_len, b_peer->bridge)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, ",\"macs\":[", 9)) goto end; 
-
-		vpn_ws_mac *macs = b_peer->macs;
-		while(macs) {
-			if (json_append(json, &json_pos, &json_len, "\"",1)) goto end;
-			if (json_append_mac(json, &json_pos, &json_len, macs->mac)) goto end;
-			if (macs->next) {
-				if (json_append(json, &json_pos, &json_len, "\",",2)) goto end;
-			}
-			else {
-				if (json_append(json, &json_pos, &json_len, "\"",1)) goto end;
-			}
-			macs = macs->next;
-		}
-
-		if (json_append(json, &json_pos, &json_len, "],\"unix\":", 9)) goto end;
-		if (json_append_num(json, &json_pos, &json_len, b_peer->t)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, ",\"tx\":", 6)) goto end;
-		if (json_append_num(json, &json_pos, &json_len, b_peer->tx)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, ",\"rx\":", 6)) goto end;
-		if (json_append_num(json, &json_pos, &json_len, b_peer->rx)) goto end;
-
-		if (json_append(json, &json_pos, &json_len, "},", 2)) goto end;
-	}
-
-	// remove last comma
-	if (found)
-		json_pos--;
-
-	if (json_append(json, &json_pos, &json_len, "]}", 2)) goto end;
+	if (json_append(&json, &json_pos, &json_len, "]", 1)) goto end;
+	if (json_append_egress(&json, &json_pos, &json_len)) goto end;
+	if (json_append(&json, &json_pos, &json_len, "}", 1)) goto end;
 
 commit:
 	// send the response
         ret = vpn_ws_write(peer, (uint8_t *)json, json_pos);
+	free(json);
         if (ret < 0) return -1;
         // again ?
         if (ret == 0) {
-		peer->handshake++;
+		// close the connection as soon as the response has been written
+		peer->handshake = 2;
                 peer->is_writing = 1;
-                return vpn_ws_event_read_to_write(queue, peer->fd);
+                return 0;
         }
 	// force connection close
+	return -1;
+
 end:
 	free(json);
         return -1;
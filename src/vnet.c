@@ -0,0 +1,205 @@
+#include "vpn-ws.h"
+
+/*
+
+	tap offloads: frames of offload peers start with a virtio-net header
+	(little endian), they can be GSO super-frames (TCP over IPv4/IPv6) and
+	can have a partial checksum.
+
+	When they are sent to a peer not supporting offloads, the segmentation
+	and the checksums are completed here.
+
+*/
+
+#define VPN_WS_VNET_F_NEEDS_CSUM	1
+
+#define VPN_WS_VNET_GSO_NONE	0
+#define VPN_WS_VNET_GSO_TCPV4	1
+#define VPN_WS_VNET_GSO_TCPV6	4
+#define VPN_WS_VNET_GSO_ECN	0x80
+
+#define VPN_WS_TCP_FIN	0x01
+#define VPN_WS_TCP_PSH	0x08
+#define VPN_WS_TCP_CWR	0x80
+
+static void vpn_ws_put_be16(uint8_t *buf, uint16_t n) {
+	buf[0] = (uint8_t) ((n >> 8) & 0xff);
+	buf[1] = (uint8_t) (n & 0xff);
+}
+
+static uint32_t vpn_ws_get_be32(uint8_t *buf) {
+	return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3];
+}
+
+static void vpn_ws_put_be32(uint8_t *buf, uint32_t n) {
+	buf[0] = (uint8_t) ((n >> 24) & 0xff);
+	buf[1] = (uint8_t) ((n >> 16) & 0xff);
+	buf[2] = (uint8_t) ((n >> 8) & 0xff);
+	buf[3] = (uint8_t) (n & 0xff);
+}
+
+// one's complement sum of big endian 16 bit words
+static uint64_t vpn_ws_csum_add(uint64_t sum, uint8_t *buf, uint64_t len) {
+	uint64_t i;
+	for(i=0;i+1<len;i+=2) {
+		sum += ((uint32_t) buf[i] << 8) | buf[i+1];
+	}
+	if (len & 1) sum += (uint32_t) buf[len-1] << 8;
+	return sum;
+}
+
+static uint16_t vpn_ws_csum_fold(uint64_t sum) {
+	while(sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t) ~sum;
+}
+
+// the offset of the network header (a single VLAN tag is supported)
+static uint64_t vpn_ws_vnet_l3(uint8_t *eth, uint64_t len, uint16_t *type) {
+	*type = vpn_ws_be16(eth + 12);
+	if (*type == 0x8100 || *type == 0x88a8) {
+		if (len < 18) return 0;
+		*type = vpn_ws_be16(eth + 16);
+		return 18;
+	}
+	return 14;
+}
+
+/*
+	check the header of a frame coming from an offload peer, so that it can be
+	written to a tap device (a malformed one would be refused by the kernel)
+*/
+int vpn_ws_vnet_valid(uint8_t *vnet, uint64_t len) {
+	uint8_t gso_type = vnet[1] & ~VPN_WS_VNET_GSO_ECN;
+	if (gso_type != VPN_WS_VNET_GSO_NONE && gso_type != VPN_WS_VNET_GSO_TCPV4 && gso_type != VPN_WS_VNET_GSO_TCPV6) return 0;
+	if (gso_type != VPN_WS_VNET_GSO_NONE) {
+		if (!(vnet[0] & VPN_WS_VNET_F_NEEDS_CSUM)) return 0;
+		if (vpn_ws_le16(vnet + 4) == 0) return 0;
+	}
+	if (vnet[0] & VPN_WS_VNET_F_NEEDS_CSUM) {
+		uint64_t csum_start = vpn_ws_le16(vnet + 6);
+		uint64_t csum_offset = vpn_ws_le16(vnet + 8);
+		if (csum_start + csum_offset + 2 > len) return 0;
+	}
+	return 1;
+}
+
+// has the frame to be completed before being sent to a peer without offloads ?
+int vpn_ws_vnet_pending(uint8_t *vnet) {
+	return (vnet[0] & VPN_WS_VNET_F_NEEDS_CSUM) || (vnet[1] & ~VPN_WS_VNET_GSO_ECN) != VPN_WS_VNET_GSO_NONE;
+}
+
+// a copy of the frame (with headroom) with the checksum completed
+static int vpn_ws_vnet_csum(uint8_t *vnet, uint8_t *eth, uint64_t len, int (*fn)(vpn_ws_fbuf *, uint8_t *, uint64_t, void *), void *data) {
+	uint64_t csum_start = vpn_ws_le16(vnet + 6);
+	uint64_t csum_offset = vpn_ws_le16(vnet + 8);
+
+	vpn_ws_fbuf *fb = vpn_ws_fbuf_new(VPN_WS_HEADROOM + len);
+	if (!fb) return -1;
+	uint8_t *frame = fb->data + VPN_WS_HEADROOM;
+	memcpy(frame, eth, len);
+
+	// the checksum field already contains the sum of the pseudo header
+	uint16_t csum = vpn_ws_csum_fold(vpn_ws_csum_add(0, frame + csum_start, len - csum_start));
+	// UDP uses 0 for "no checksum"
+	if (csum == 0 && csum_offset == 6) csum = 0xffff;
+	vpn_ws_put_be16(frame + csum_start + csum_offset, csum);
+
+	int ret = fn(fb, frame, len, data);
+	vpn_ws_fbuf_unref(fb);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+	split a TCP super-frame in segments of gso_size bytes, each one with its
+	IP header and its checksums fixed
+*/
+static int vpn_ws_vnet_tso(uint8_t *vnet, uint8_t *eth, uint64_t len, int (*fn)(vpn_ws_fbuf *, uint8_t *, uint64_t, void *), void *data) {
+	uint8_t gso_type = vnet[1] & ~VPN_WS_VNET_GSO_ECN;
+	uint64_t mss = vpn_ws_le16(vnet + 4);
+
+	uint16_t type = 0;
+	uint64_t l3 = vpn_ws_vnet_l3(eth, len, &type);
+	if (!l3) return 0;
+
+	uint64_t l4 = 0;
+	if (gso_type == VPN_WS_VNET_GSO_TCPV4) {
+		if (type != 0x0800 || len < l3 + 20) return 0;
+		if (eth[l3 + 9] != 6) return 0;
+		l4 = l3 + ((eth[l3] & 0xf) * 4);
+	}
+	else {
+		// extension headers are not supported
+		if (type != 0x86dd || len < l3 + 40) return 0;
+		if (eth[l3 + 6] != 6) return 0;
+		l4 = l3 + 40;
+	}
+	if (len < l4 + 20) return 0;
+	uint64_t hdrs = l4 + ((eth[l4 + 12] >> 4) * 4);
+	if (hdrs > len || hdrs < l4 + 20) return 0;
+
+	uint64_t payload = len - hdrs;
+	uint32_t seq = vpn_ws_get_be32(eth + l4 + 4);
+	uint16_t ip_id = vpn_ws_be16(eth + l3 + 4);
+	uint8_t tcp_flags = eth[l4 + 13];
+
+	uint64_t pos = 0;
+	uint16_t i = 0;
+	do {
+		uint64_t seg = payload - pos < mss ? payload - pos : mss;
+		uint64_t seg_len = hdrs + seg;
+		vpn_ws_fbuf *fb = vpn_ws_fbuf_new(VPN_WS_HEADROOM + seg_len);
+		if (!fb) return -1;
+		uint8_t *frame = fb->data + VPN_WS_HEADROOM;
+		memcpy(frame, eth, hdrs);
+		memcpy(frame + hdrs, eth + hdrs + pos, seg);
+
+		uint8_t *ip = frame + l3;
+		uint8_t *tcp = frame + l4;
+		uint64_t tcp_len = seg_len - l4;
+		uint64_t sum = 0;
+		if (gso_type == VPN_WS_VNET_GSO_TCPV4) {
+			vpn_ws_put_be16(ip + 2, seg_len - l3);
+			vpn_ws_put_be16(ip + 4, ip_id + i);
+			vpn_ws_put_be16(ip + 10, 0);
+			vpn_ws_put_be16(ip + 10, vpn_ws_csum_fold(vpn_ws_csum_add(0, ip, l4 - l3)));
+			// pseudo header: addresses, protocol and length
+			sum = vpn_ws_csum_add(0, ip + 12, 8);
+		}
+		else {
+			vpn_ws_put_be16(ip + 4, seg_len - l4);
+			sum = vpn_ws_csum_add(0, ip + 8, 32);
+		}
+		sum += 6 + tcp_len;
+
+		vpn_ws_put_be32(tcp + 4, seq + pos);
+		uint8_t flags = tcp_flags;
+		if (pos + seg < payload) flags &= ~(VPN_WS_TCP_FIN | VPN_WS_TCP_PSH);
+		if (i > 0) flags &= ~VPN_WS_TCP_CWR;
+		tcp[13] = flags;
+		vpn_ws_put_be16(tcp + 16, 0);
+		vpn_ws_put_be16(tcp + 16, vpn_ws_csum_fold(vpn_ws_csum_add(sum, tcp, tcp_len)));
+
+		int ret = fn(fb, frame, seg_len, data);
+		vpn_ws_fbuf_unref(fb);
+		if (ret < 0) return -1;
+		pos += seg;
+		i++;
+	} while(pos < payload);
+
+	return 0;
+}
+
+/*
+	complete a frame for a peer without offloads, fn is called for each
+	resulting frame (living in a new frame buffer, with headroom).
+	Frames that cannot be completed are dropped.
+	Returns -1 if fn failed
+*/
+int vpn_ws_vnet_finish(uint8_t *vnet, uint8_t *eth, uint64_t len, int (*fn)(vpn_ws_fbuf *, uint8_t *, uint64_t, void *), void *data) {
+	if ((vnet[1] & ~VPN_WS_VNET_GSO_ECN) != VPN_WS_VNET_GSO_NONE) {
+		return vpn_ws_vnet_tso(vnet, eth, len, fn, data);
+	}
+	return vpn_ws_vnet_csum(vnet, eth, len, fn, data);
+}
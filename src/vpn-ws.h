@@ -16,6 +16,8 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #endif
 #include <string.h>
 #include <unistd.h>
@@ -48,8 +50,52 @@ typedef HANDLE vpn_ws_fd;
 #define vpn_ws_send(x, y, z, w) ssize_t w = -1; if (!WriteFile(x, y, z, (LPDWORD) &w, 0)) { w = -1; }
 #define vpn_ws_recv(x, y, z, r) ssize_t r = -1; if (!ReadFile(x, y, z, (LPDWORD) &r, 0)) { r = -1; }
 #define vpn_ws_socket_cast(x) (SOCKET)x
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
 #endif
 
+#define VPN_WS_EGRESS_TAIL_DROP		0
+#define VPN_WS_EGRESS_DROP_BROADCAST	1
+#define VPN_WS_EGRESS_DISCONNECT	2
+
+#define VPN_WS_CACHELINE 64
+
+// the virtio-net header in front of the frames of offload peers
+#define VPN_WS_VNET_HDR_LEN	10
+// the biggest frame read from a tap device (virtio-net header + a 64k GSO packet)
+#define VPN_WS_TAP_MAX	(VPN_WS_VNET_HDR_LEN + 18 + 65535)
+
+// offloads of a tap device
+#define VPN_WS_OFFLOAD_NONE	0
+#define VPN_WS_OFFLOAD_CSUM	1
+#define VPN_WS_OFFLOAD_TSO	2
+
+// max number of frames flushed with a single writev()
+#define VPN_WS_IOV_MAX 64
+
+// the subprotocol of multi-frame messages (each frame is prefixed by its 16 bit length)
+#define VPN_WS_BATCH_PROTO	"vpn-ws-batch"
+#define VPN_WS_BATCH_PREFIX	2
+
+// websocket compression (RFC 7692)
+#define VPN_WS_DEFLATE_EXT	"permessage-deflate"
+// max size of an inflated message (a compression bomb would exhaust the memory)
+#define VPN_WS_INFLATE_MAX	(1024 * 1024)
+
+// the negotiated permessage-deflate parameters, seen from the local side
+struct vpn_ws_deflate_params {
+	// window of the local compressor
+	int out_bits;
+	// the server_max_window_bits of the accepted offer (0 if not specified)
+	int bits_offered;
+	// reset the compressor (or the decompressor) after each message
+	uint8_t out_no_takeover;
+	uint8_t in_no_takeover;
+};
+typedef struct vpn_ws_deflate_params vpn_ws_deflate_params;
+
 
 struct vpn_ws_var {
 	char *key;
@@ -59,54 +105,400 @@ struct vpn_ws_var {
 };
 typedef struct vpn_ws_var vpn_ws_var;
 
+// the vars of a uwsgi request (they point to the read buffer)
+struct vpn_ws_vars {
+	uint16_t n;
+	vpn_ws_var vars[64];
+};
+typedef struct vpn_ws_vars vpn_ws_vars;
+
 
 struct vpn_ws_mac {
 	uint8_t mac[6];
+	// last seen
+	time_t t;
+	struct vpn_ws_peer *peer;
+	struct vpn_ws_mac *prev;
 	struct vpn_ws_mac *next;
 };
 typedef struct vpn_ws_mac vpn_ws_mac;
 
-struct vpn_ws_peer {
-	vpn_ws_fd fd;
-	uint8_t *buf;
-	uint64_t pos;
+// default size of the read buffers
+#define VPN_WS_FBUF_SIZE	32768
+// frame buffers are pooled in size classes (powers of 4, from 512 bytes to 128k)
+#define VPN_WS_FBUF_CLASSES	5
+#define VPN_WS_FBUF_MIN_SHIFT	9
+// bytes of pooled buffers cached by each thread (for each class)
+#define VPN_WS_FBUF_CACHE	(64 * 32768)
+// room for a websocket header in front of frames coming from tap devices (or from other workers)
+#define VPN_WS_HEADROOM		16
+
+/*
+	a reference counted buffer: ingress data is read in it and egress queues
+	point to the frames in it, so a frame is never copied, even when flooded.
+	References are owned by a single worker at a time.
+*/
+struct vpn_ws_fbuf {
+	uint64_t refs;
+	uint64_t size;
+	struct vpn_ws_fbuf *next;
+	uint8_t data[];
+};
+typedef struct vpn_ws_fbuf vpn_ws_fbuf;
+
+// a frame (or a part of it) waiting in an egress queue
+struct vpn_ws_frame {
+	struct vpn_ws_frame *next;
+	// the queue holds a reference to the buffer
+	vpn_ws_fbuf *fb;
+	uint8_t *data;
 	uint64_t len;
+	// already sent
+	uint64_t pos;
+};
+typedef struct vpn_ws_frame vpn_ws_frame;
+
+/*
+	a pool of fixed size objects: they are carved from slabs (never released)
+	and recycled through a free list, so connection churn does not hit malloc()
+*/
+struct vpn_ws_pool {
+	uint64_t size;
+	// objects for each slab
+	uint64_t slab;
+	void *free;
+};
+typedef struct vpn_ws_pool vpn_ws_pool;
 
-	uint8_t *write_buf;
-        uint64_t write_pos;
-        uint64_t write_len;
+// a dense array of peers (members store their position + 1, 0 if not in it)
+struct vpn_ws_peer_list {
+	struct vpn_ws_peer **peers;
+	uint64_t n;
+	uint64_t size;
+};
+typedef struct vpn_ws_peer_list vpn_ws_peer_list;
+
+struct vpn_ws_worker;
+
+struct vpn_ws_timer {
+	time_t expires;
+	// the head of the wheel slot (NULL if not scheduled)
+	struct vpn_ws_timer **slot;
+	struct vpn_ws_timer *prev;
+	struct vpn_ws_timer *next;
+	void (*func)(struct vpn_ws_worker *, struct vpn_ws_timer *);
+	void *data;
+};
+typedef struct vpn_ws_timer vpn_ws_timer;
 
-	uint16_t vars_n;	
-	vpn_ws_var vars[64];
+#define VPN_WS_WHEEL_BITS	6
+#define VPN_WS_WHEEL_SLOTS	(1 << VPN_WS_WHEEL_BITS)
+#define VPN_WS_WHEEL_LEVELS	4
 
+/*
+	a peer: the fields used for each frame come first (in the first cache
+	lines), the connection metadata (used only by the control interface and
+	the logs) is at the end. The uwsgi vars of the handshake are not kept.
+*/
+struct vpn_ws_peer {
+	// hot: parsing and forwarding
+	vpn_ws_fd fd;
 	uint8_t handshake;
-	uint8_t is_writing;
-	
+	uint8_t raw;
+	uint8_t bridge;
+	uint8_t mac_collected;
+	uint8_t mac[6];
+	// frames start with a virtio-net header (tap offloads)
+	uint8_t vnet;
+	// vpn-ws-batch: messages carry multiple frames
+	uint8_t multi;
 	uint8_t has_mask;
 	uint8_t mask[4];
+	// the last parsed message is compressed (RSV1)
+	uint8_t deflated;
+	// destroyed, it will be freed at the end of the cycle
+	uint8_t dead;
+	// scheduling: the socket has not been drained yet
+	uint8_t readable;
+	// in the worker ready list
+	uint8_t ready;
+	// the write buffer has data waiting for the socket to be writable
+	uint8_t is_writing;
+	uint8_t ctrl;
+	// --streams: another connection of the client gets the floods (changed by any worker)
+	uint8_t stream_secondary;
 
-	uint8_t mac_collected;
-	uint8_t mac[6];
+	// the unparsed data lives between off and pos
+	// (server peers read in rbuf, buf points to its data)
+	vpn_ws_fbuf *rbuf;
+	uint8_t *buf;
+	uint64_t off;
+	uint64_t pos;
+	uint64_t len;
+
+	// permessage-deflate contexts (NULL if not negotiated)
+	struct vpn_ws_deflate *zs;
+
+	// the owner worker (NULL in the client)
+	struct vpn_ws_worker *worker;
+	// unique id, used to detect fd reuse
+	uint64_t id;
 
+	// egress queue (only the unsent part of the frames is copied in it)
+	vpn_ws_frame *out_head;
+	vpn_ws_frame *out_tail;
+	uint64_t out_frames;
+	// not written yet (queued or in flight), limited by the egress policy
+	uint64_t out_bytes;
+	// frames dropped by the egress policy
+	uint64_t drops;
+
+	// rx, tx, out_bytes and drops are read by the ctrl peers of every worker (relaxed atomics)
 	uint64_t rx;
 	uint64_t tx;
+	// last time we received data
+	time_t t_seen;
+
+	// io_uring mode: the armed receive and the number of sends in flight
+	struct vpn_ws_uring_op *uring_recv;
+	uint64_t uring_sending;
+
+	struct vpn_ws_peer *ready_prev;
+	struct vpn_ws_peer *ready_next;
+	struct vpn_ws_peer *dead_next;
+	// pipeline mode: in the flush list of the worker
+	uint8_t flushing;
+	struct vpn_ws_peer *flush_next;
+
+	// vpn-ws-batch: the message being aggregated (frames are copied in it, after the headroom)
+	vpn_ws_fbuf *agg;
+	uint64_t agg_len;
+	uint64_t agg_frames;
+	// in the aggregating list of the worker
+	uint8_t aggregating;
+	struct vpn_ws_peer *agg_next;
+
+	// position (+ 1) in the flooding indexes of the worker
+	uint64_t registered_idx;
+	uint64_t bridge_idx;
+
+	// --streams: the id announced by the client (0 if it does not stripe) and its connections
+	uint64_t streams_id;
+	struct vpn_ws_streams *streams;
+
+	// learned MACs (most recently seen first)
+	vpn_ws_mac *macs;
+	vpn_ws_mac *macs_tail;
+	uint64_t macs_n;
 
-	uint8_t raw;
+	// handshake deadline, idle timeout and pings
+	vpn_ws_timer timer;
+	// last ping sent
+	time_t t_ping;
 
+	// cold: metadata
 	char *remote_addr;
 	uint16_t remote_addr_len;
 	char *remote_user;
 	uint16_t remote_user_len;
 	char *dn;
 	uint16_t dn_len;
-
+	// connection (then handshake) time
 	time_t t;
-	uint8_t bridge;
-	vpn_ws_mac *macs;
-	uint8_t ctrl;
-};
+
+	// the uwsgi vars, only during the handshake
+	struct vpn_ws_vars *vars;
+} __attribute__((aligned(VPN_WS_CACHELINE)));
 typedef struct vpn_ws_peer vpn_ws_peer;
 
+// io_uring operations
+#define VPN_WS_URING_POLL	1
+#define VPN_WS_URING_ACCEPT	2
+#define VPN_WS_URING_RECV	3
+#define VPN_WS_URING_SEND	4
+
+// what a ready peer can consume in a single round
+#define VPN_WS_BUDGET_FRAMES	64
+#define VPN_WS_BUDGET_BYTES	(128*1024)
+
+// provided buffers for receives (per worker)
+#define VPN_WS_URING_BUFS	128
+#define VPN_WS_URING_BUF_SIZE	16384
+
+struct vpn_ws_uring_op {
+	uint8_t type;
+	// the peer (or the listening socket) the op refers to
+	vpn_ws_fd fd;
+	uint64_t id;
+	// sends own the frames
+	vpn_ws_frame *frames;
+	uint8_t raw;
+	int iov_n;
+	struct iovec iov[VPN_WS_IOV_MAX];
+};
+typedef struct vpn_ws_uring_op vpn_ws_uring_op;
+
+// a completion
+struct vpn_ws_uring_cqe {
+	vpn_ws_uring_op *op;
+	int32_t res;
+	// the op is still armed (multishot)
+	uint8_t more;
+	// the provided buffer filled by a receive (or NULL)
+	uint8_t *buf;
+	uint16_t bid;
+};
+typedef struct vpn_ws_uring_cqe vpn_ws_uring_cqe;
+
+// messages exchanged between workers
+#define VPN_WS_MSG_ACCEPT	1
+#define VPN_WS_MSG_UNICAST	2
+#define VPN_WS_MSG_BROADCAST	3
+#define VPN_WS_MSG_FLOOD	4
+#define VPN_WS_MSG_KILL		5
+
+struct vpn_ws_ring_msg {
+	uint8_t type;
+	vpn_ws_fd fd;
+	uint64_t id;
+	// the frame (with headroom) is in fb, the consumer releases it
+	vpn_ws_fbuf *fb;
+	uint8_t *buf;
+	uint64_t len;
+	// the frame starts with a virtio-net header
+	uint8_t vnet;
+};
+typedef struct vpn_ws_ring_msg vpn_ws_ring_msg;
+
+struct vpn_ws_ring {
+	// written by the producer
+	uint64_t head;
+	uint8_t pad0[56];
+	// written by the consumer
+	uint64_t tail;
+	uint8_t pad1[56];
+	uint64_t size;
+	vpn_ws_ring_msg *msgs;
+};
+typedef struct vpn_ws_ring vpn_ws_ring;
+
+// the result of a MAC lookup
+struct vpn_ws_route {
+	vpn_ws_peer *peer;
+	struct vpn_ws_worker *worker;
+	vpn_ws_fd fd;
+	uint64_t id;
+};
+typedef struct vpn_ws_route vpn_ws_route;
+
+// max frames parsed from a peer before routing them (pipeline mode)
+#define VPN_WS_BATCH 64
+
+// a parsed frame waiting to be routed
+struct vpn_ws_batch_frame {
+	// the buffer the frame lives in (the batch holds a reference to it)
+	vpn_ws_fbuf *fb;
+	// the (unmasked) websocket packet, NULL if there was no headroom for it
+	uint8_t *ws;
+	uint64_t ws_len;
+	// the virtio-net header (in front of eth), NULL if the sender has no offloads
+	uint8_t *vnet;
+	uint8_t *eth;
+	uint64_t eth_len;
+	// broadcast or multicast
+	uint8_t flood;
+	// the destination was found in the MAC map
+	uint8_t found;
+	vpn_ws_route route;
+};
+typedef struct vpn_ws_batch_frame vpn_ws_batch_frame;
+
+struct vpn_ws_worker {
+	int id;
+	int queue;
+	void *events;
+
+	// this is the highest fd used
+	uint64_t peers_n;
+	// fd-indexed, this memory is dynamically increased
+	vpn_ws_peer **peers;
+
+	// multi-worker mode only
+	vpn_ws_fd notify_fd[2];
+	// inbound rings (one for each worker, plus the acceptor one)
+	vpn_ws_ring **rings;
+	// workers to wake up at the end of the cycle
+	uint8_t *wakeup;
+	uint64_t ring_drops;
+
+	// not NULL in io_uring mode (replaces queue and events)
+	struct vpn_ws_uring *uring;
+
+	// peers with data to consume, served in round robin
+	vpn_ws_peer *ready_head;
+	vpn_ws_peer *ready_tail;
+	uint64_t ready_n;
+	// the budget of the peer being served
+	uint64_t budget_frames;
+	uint64_t budget_bytes;
+	// peers destroyed in this cycle
+	vpn_ws_peer *dead;
+
+	// frames parsed from the peer being served, not routed yet
+	vpn_ws_batch_frame batch[VPN_WS_BATCH];
+	uint64_t batch_n;
+	// pipeline mode: peers with frames queued in this cycle
+	vpn_ws_peer *flush_head;
+	// peers with a multi-frame message to close at the end of the cycle
+	vpn_ws_peer *agg_head;
+
+	// flooding indexes: peers with a MAC, and bridges among them
+	vpn_ws_peer_list registered;
+	vpn_ws_peer_list bridges;
+
+	// egress bytes of the peers of the worker (read by the other workers for the global limit)
+	// (the counters are read by the ctrl peers too, relaxed atomics)
+	uint64_t egress_bytes;
+	uint64_t egress_drops;
+	uint64_t egress_disconnects;
+
+	// timer wheel
+	vpn_ws_timer *wheel[VPN_WS_WHEEL_LEVELS][VPN_WS_WHEEL_SLOTS];
+	uint64_t wheel_tick;
+	uint64_t timers_n;
+	// periodic sweep of the learned MACs
+	vpn_ws_timer mac_aging_timer;
+#ifndef __WIN32__
+	pthread_t thread;
+#endif
+};
+typedef struct vpn_ws_worker vpn_ws_worker;
+
+
+struct vpn_ws_macmap_slot {
+	// 48bit MAC (0 means the slot is empty)
+	uint64_t key;
+	vpn_ws_peer *peer;
+	// not NULL if learned behind a bridge peer
+	vpn_ws_mac *entry;
+};
+typedef struct vpn_ws_macmap_slot vpn_ws_macmap_slot;
+
+// --streams: max connections of a client
+#define VPN_WS_STREAMS_MAX	16
+
+/*
+	the connections of a client striping its frames (same MAC and streams id),
+	forwarded as a single peer: unicast frames are spread among them by flow,
+	floods go only to the first one. Changed with the MAC map write lock held
+*/
+struct vpn_ws_streams {
+	uint64_t id;
+	uint64_t n;
+	vpn_ws_peer *peers[VPN_WS_STREAMS_MAX];
+};
+typedef struct vpn_ws_streams vpn_ws_streams;
+
 struct vpn_ws_config {
 	char *server_addr;	
 	char *tuntap_name;
@@ -123,13 +515,66 @@ struct vpn_ws_config {
 	int no_broadcast;
 	int bridge;
 	int ssl_no_verify;
+	int no_ktls;
 
 	uint8_t tuntap_mac[6];
-
-	// this is the highest fd used
-	uint64_t peers_n;
-	// this memory is dynamically increased
-	vpn_ws_peer **peers;
+	// tap offloads: accepted from (or requested to) the peers
+	int offload;
+	// the tap device has been opened with the virtio-net header
+	int tuntap_vnet;
+
+	// multi-frame messages (vpn-ws-batch): max bytes and frames of a message,
+	// max delay before sending it (usecs, client only)
+	int no_batch;
+	uint64_t batch_bytes;
+	uint64_t batch_frames;
+	int batch_delay;
+
+	// permessage-deflate: accepted from (or offered to) the peers, without
+	// context takeover, min size of a compressed message
+	int deflate;
+	int deflate_no_takeover;
+	uint64_t deflate_min;
+
+	int workers_n;
+	vpn_ws_worker *workers;
+	// used for generating peer ids
+	uint64_t peers_id;
+
+	// the MAC forwarding table (power of 2 sized)
+	uint64_t macmap_size;
+	uint64_t macmap_n;
+	vpn_ws_macmap_slot *macmap;
+
+	// bridge MAC learning (seconds, and max entries per peer)
+	int mac_aging;
+	uint64_t mac_limit;
+
+	// updated at every event loop iteration (use vpn_ws_now())
+	time_t now;
+
+	// use io_uring instead of epoll (linux only)
+	int io_uring;
+	// route the frames of a read in batch and flush each peer once per cycle
+	int pipeline;
+
+	// egress limits (bytes, 0 for unlimited) and the policy applied when they are hit
+	uint64_t egress_limit;
+	uint64_t egress_global_limit;
+	int egress_policy;
+
+	// peer timeouts and server pings (seconds, 0 to disable)
+	int handshake_timeout;
+	int idle_timeout;
+	int ping_interval;
+
+	// connections of the client (frames are spread among them by flow) and the
+	// devices their sockets are bound to (round robin)
+	int streams;
+	char *streams_dev[VPN_WS_STREAMS_MAX];
+	int streams_dev_n;
+	// a thread for each direction (client only)
+	int threads;
 
 	// used for ssl/tls context
 	void *ssl_ctx;
@@ -138,46 +583,96 @@ typedef struct vpn_ws_config vpn_ws_config;
 
 extern vpn_ws_config vpn_ws_conf;
 
+// now is written by every worker (relaxed atomics, only the seconds matter)
+#define vpn_ws_now() __atomic_load_n(&vpn_ws_conf.now, __ATOMIC_RELAXED)
+#define vpn_ws_now_update() __atomic_store_n(&vpn_ws_conf.now, time(NULL), __ATOMIC_RELAXED)
+
 void vpn_ws_error(const char *);
 void vpn_ws_exit(int);
 
 vpn_ws_fd vpn_ws_bind(char *);
 
+#define VPN_WS_EVENT_READ	1
+#define VPN_WS_EVENT_WRITE	2
+
 int vpn_ws_event_queue(int);
 int vpn_ws_event_add_read(int, vpn_ws_fd);
-int vpn_ws_event_wait(int, void *);
+int vpn_ws_event_wait(int, void *, int);
 void *vpn_ws_event_events(int);
 int vpn_ws_event_fd(void *, int);
-int vpn_ws_event_read_to_write(int, vpn_ws_fd);
-int vpn_ws_event_write_to_read(int, vpn_ws_fd);
+int vpn_ws_event_add_rw(int, vpn_ws_fd);
+int vpn_ws_event_mask(void *, int);
 
 vpn_ws_fd vpn_ws_tuntap(char *);
+int vpn_ws_tuntap_offload(vpn_ws_fd, int);
+int vpn_ws_vnet_valid(uint8_t *, uint64_t);
+int vpn_ws_vnet_pending(uint8_t *);
+int vpn_ws_vnet_finish(uint8_t *, uint8_t *, uint64_t, int (*)(vpn_ws_fbuf *, uint8_t *, uint64_t, void *), void *);
 int vpn_ws_update_tuntap_mac(uint8_t *);
 
 uint16_t vpn_ws_be16(uint8_t *);
 uint64_t vpn_ws_be64(uint8_t *);
 uint16_t vpn_ws_le16(uint8_t *);
+uint64_t vpn_ws_flow_hash(uint8_t *, uint64_t);
 
 int vpn_ws_peer_add_var(vpn_ws_peer *, char *, uint16_t, char *, uint16_t);
 
 void *vpn_ws_malloc(uint64_t);
 void *vpn_ws_calloc(uint64_t);
+int vpn_ws_buf_reserve(uint8_t **, uint64_t *, uint64_t *, uint64_t *, uint64_t);
+void *vpn_ws_pool_malloc(vpn_ws_pool *);
+void *vpn_ws_pool_calloc(vpn_ws_pool *);
+void vpn_ws_pool_free(vpn_ws_pool *, void *);
+vpn_ws_peer *vpn_ws_peer_new(void);
+vpn_ws_fbuf *vpn_ws_fbuf_new(uint64_t);
+void vpn_ws_fbuf_unref(vpn_ws_fbuf *);
+int vpn_ws_peer_reserve(vpn_ws_peer *, uint64_t);
+vpn_ws_frame *vpn_ws_frame_new(vpn_ws_fbuf *, uint8_t *, uint64_t);
+vpn_ws_frame *vpn_ws_frames_consume(vpn_ws_frame *, uint64_t, uint64_t *);
+void vpn_ws_frames_free(vpn_ws_frame *);
+void vpn_ws_peer_consume(vpn_ws_peer *, uint64_t);
 void vpn_ws_peer_destroy(vpn_ws_peer *);
 
-void vpn_ws_peer_accept(int, int);
+void vpn_ws_peer_accept(vpn_ws_worker *, int);
 
-int vpn_ws_manage_fd(int, vpn_ws_fd);
+int vpn_ws_manage_fd(vpn_ws_worker *, vpn_ws_fd, int);
+int vpn_ws_peer_process(vpn_ws_worker *, vpn_ws_peer *);
+vpn_ws_fbuf *vpn_ws_peer_inflate(vpn_ws_peer *, uint8_t *, uint64_t, uint64_t *);
+int vpn_ws_peer_serve(vpn_ws_worker *, vpn_ws_peer *);
+int vpn_ws_uring_manage(vpn_ws_worker *, vpn_ws_uring_cqe *);
+int vpn_ws_peer_write_frame(vpn_ws_worker *, vpn_ws_peer *, vpn_ws_fbuf *, uint8_t *, uint64_t, uint8_t *, uint8_t *, uint64_t);
+int vpn_ws_flood(vpn_ws_worker *, vpn_ws_peer *, vpn_ws_fbuf *, uint8_t *, uint64_t, uint8_t *, uint8_t *, uint64_t, uint8_t, uint64_t);
 
-int64_t vpn_ws_handshake(int, vpn_ws_peer *);
+int64_t vpn_ws_handshake(vpn_ws_peer *);
 char *vpn_ws_peer_get_var(vpn_ws_peer *, char *, uint16_t, uint16_t *);
 
 uint16_t vpn_ws_base64_encode(uint8_t *, uint16_t, uint8_t *);
 
 int vpn_ws_read(vpn_ws_peer *, uint64_t);
 int vpn_ws_write(vpn_ws_peer *, uint8_t *, uint64_t);
+int vpn_ws_writev(vpn_ws_peer *, struct iovec *, int);
+int vpn_ws_write_fbuf(vpn_ws_peer *, vpn_ws_fbuf *, uint8_t *, uint64_t);
+int vpn_ws_write_websocket(vpn_ws_peer *, vpn_ws_fbuf *, uint8_t *, uint64_t);
+int vpn_ws_aggregate_close(vpn_ws_peer *);
 int vpn_ws_continue_write(vpn_ws_peer *);
 
 int64_t vpn_ws_websocket_parse(vpn_ws_peer *, uint16_t *);
+uint8_t vpn_ws_websocket_header(uint8_t *, uint64_t);
+void vpn_ws_mask(uint8_t *, uint64_t, uint8_t *);
+uint8_t *vpn_ws_websocket_prepend(uint8_t *, uint64_t, uint64_t, uint64_t *);
+int vpn_ws_websocket_has_protocol(char *, uint64_t, char *);
+void vpn_ws_batch_prefix(uint8_t *, uint64_t);
+int64_t vpn_ws_batch_next(uint8_t *, uint64_t, uint64_t *, uint8_t **);
+
+int vpn_ws_deflate_negotiate(char *, uint64_t, int, vpn_ws_deflate_params *);
+int vpn_ws_deflate_response(vpn_ws_deflate_params *, char *, uint64_t);
+struct vpn_ws_deflate *vpn_ws_deflate_new(vpn_ws_deflate_params *);
+void vpn_ws_deflate_free(struct vpn_ws_deflate *);
+int vpn_ws_deflate_wanted(struct vpn_ws_deflate *, uint64_t);
+uint64_t vpn_ws_deflate_bound(uint64_t);
+int64_t vpn_ws_deflate(struct vpn_ws_deflate *, struct iovec *, int, uint8_t *, uint64_t);
+int vpn_ws_inflate_begin(struct vpn_ws_deflate *, uint8_t *, uint64_t);
+int64_t vpn_ws_inflate_next(struct vpn_ws_deflate *, uint8_t *, uint64_t);
 
 int vpn_ws_mac_is_broadcast(uint8_t *);
 int vpn_ws_mac_is_zero(uint8_t *);
@@ -185,24 +680,29 @@ int vpn_ws_mac_is_valid(uint8_t *);
 int vpn_ws_mac_is_loop(uint8_t *, uint8_t *);
 int vpn_ws_mac_is_multicast(uint8_t *);
 
-vpn_ws_peer *vpn_ws_peer_by_mac(uint8_t *);
+int vpn_ws_macmap_lookup(uint8_t *, uint64_t, vpn_ws_route *);
+void vpn_ws_macmap_lookup_batch(vpn_ws_batch_frame *, uint64_t);
 
 int vpn_ws_nb(vpn_ws_fd);
-void vpn_ws_peer_create(int, vpn_ws_fd, uint8_t *);
+void vpn_ws_peer_create(vpn_ws_worker *, vpn_ws_fd, uint8_t *);
 
 void vpn_ws_log(const char *, ...);
 void vpn_ws_warning(const char *, ...);
 void vpn_ws_notice(const char *, ...);
 
 void *vpn_ws_ssl_handshake(vpn_ws_peer *, char *, char *, char *);
-int vpn_ws_ssl_write(void *, uint8_t *, uint64_t);
-ssize_t vpn_ws_ssl_read(void *, uint8_t *, uint64_t);
+ssize_t vpn_ws_ssl_write(void *, uint8_t *, uint64_t, int *);
+ssize_t vpn_ws_ssl_read(void *, uint8_t *, uint64_t, int *);
 void vpn_ws_ssl_close(void *);
+// the directions encrypted by the kernel
+#define VPN_WS_KTLS_TX	1
+#define VPN_WS_KTLS_RX	2
+int vpn_ws_ssl_ktls(void *);
 
 int vpn_ws_exec(char *);
 void vpn_ws_announce_peer(vpn_ws_peer *, char *);
 
-int64_t vpn_ws_ctrl_json(int, vpn_ws_peer *);
+int64_t vpn_ws_ctrl_json(vpn_ws_peer *);
 
 int vpn_ws_str_to_uint(char *, uint64_t);
 char *vpn_ws_strndup(char *, size_t);
@@ -210,4 +710,53 @@ int vpn_ws_is_a_number(char *);
 
 int vpn_ws_bridge_collect_mac(vpn_ws_peer *, uint8_t *);
 
-vpn_ws_peer * vpn_ws_peer_by_bridge_mac(uint8_t *);
+int vpn_ws_macmap_add(uint8_t *, vpn_ws_peer *);
+void vpn_ws_macmap_del(uint8_t *, vpn_ws_peer *);
+void vpn_ws_bridge_mac_aging(vpn_ws_peer *);
+void vpn_ws_bridge_forget_macs(vpn_ws_peer *);
+int vpn_ws_bridge_foreach_mac(vpn_ws_peer *, int (*)(vpn_ws_mac *, void *), void *);
+
+void vpn_ws_peers_lock(void);
+void vpn_ws_peers_unlock(void);
+
+vpn_ws_ring *vpn_ws_ring_new(uint64_t);
+int vpn_ws_ring_push(vpn_ws_ring *, vpn_ws_ring_msg *);
+int vpn_ws_ring_pop(vpn_ws_ring *, vpn_ws_ring_msg *);
+
+int vpn_ws_workers_init(int);
+int vpn_ws_workers_start(void);
+void vpn_ws_worker_loop(vpn_ws_worker *, vpn_ws_fd);
+void vpn_ws_acceptor_loop(vpn_ws_fd);
+int vpn_ws_worker_post(vpn_ws_worker *, vpn_ws_worker *, uint8_t, vpn_ws_fd, uint64_t, uint8_t *, uint8_t *, uint64_t);
+void vpn_ws_worker_wakeup(vpn_ws_worker *);
+void vpn_ws_worker_flush(vpn_ws_worker *);
+void vpn_ws_worker_defer_write(vpn_ws_worker *, vpn_ws_peer *);
+void vpn_ws_worker_flush_writes(vpn_ws_worker *);
+void vpn_ws_worker_aggregate(vpn_ws_worker *, vpn_ws_peer *);
+void vpn_ws_worker_close_messages(vpn_ws_worker *);
+void vpn_ws_worker_drain(vpn_ws_worker *);
+int vpn_ws_worker_uring_arm(vpn_ws_worker *, uint8_t, vpn_ws_fd);
+void vpn_ws_worker_ready(vpn_ws_worker *, vpn_ws_peer *);
+void vpn_ws_worker_unready(vpn_ws_worker *, vpn_ws_peer *);
+void vpn_ws_worker_run(vpn_ws_worker *);
+void vpn_ws_worker_reap(vpn_ws_worker *);
+int vpn_ws_worker_index(vpn_ws_worker *, vpn_ws_peer *);
+void vpn_ws_peer_free(vpn_ws_peer *);
+
+void vpn_ws_timers_init(vpn_ws_worker *);
+void vpn_ws_timer_add(vpn_ws_worker *, vpn_ws_timer *, time_t);
+void vpn_ws_timer_del(vpn_ws_worker *, vpn_ws_timer *);
+void vpn_ws_timers_run(vpn_ws_worker *);
+int vpn_ws_timers_timeout(vpn_ws_worker *);
+void vpn_ws_peer_timer_start(vpn_ws_worker *, vpn_ws_peer *);
+
+struct vpn_ws_uring *vpn_ws_uring_new(uint32_t);
+int vpn_ws_uring_poll(struct vpn_ws_uring *, vpn_ws_uring_op *);
+int vpn_ws_uring_accept(struct vpn_ws_uring *, vpn_ws_uring_op *);
+int vpn_ws_uring_recv(struct vpn_ws_uring *, vpn_ws_peer *);
+int vpn_ws_uring_send(struct vpn_ws_uring *, vpn_ws_peer *);
+int vpn_ws_uring_resend(struct vpn_ws_uring *, vpn_ws_uring_op *);
+void vpn_ws_uring_cancel(struct vpn_ws_uring *, vpn_ws_peer *);
+int vpn_ws_uring_wait(struct vpn_ws_uring *, int);
+int vpn_ws_uring_next(struct vpn_ws_uring *, vpn_ws_uring_cqe *);
+void vpn_ws_uring_put(struct vpn_ws_uring *, vpn_ws_uring_cqe *);
@@ -1,12 +1,16 @@
 #include "vpn-ws.h"
 
 int64_t vpn_ws_websocket_parse(vpn_ws_peer *peer, uint16_t *ws_header) {
-	if (peer->pos < 2) return 0;
+	uint8_t *buf = peer->buf + peer->off;
+	uint64_t available = peer->pos - peer->off;
+	if (available < 2) return 0;
 
-	uint8_t byte1 = peer->buf[0];
-        uint8_t byte2 = peer->buf[1];	
+	uint8_t byte1 = buf[0];
+        uint8_t byte2 = buf[1];	
 
 	uint8_t opcode = byte1 & 0xf;
+	// RSV1: a compressed message (permessage-deflate)
+	peer->deflated = (byte1 >> 6) & 1;
 	peer->has_mask = byte2 >> 7;
         uint64_t pktsize = byte2 & 0x7f;
 
@@ -15,23 +19,23 @@ int64_t vpn_ws_websocket_parse(vpn_ws_peer *peer, uint16_t *ws_header) {
 	// 16bit len
 	if (pktsize == 126) {
 		needed += 2;
-		if (peer->pos < needed) return 0;
-		pktsize = vpn_ws_be16(peer->buf + 2);
+		if (available < needed) return 0;
+		pktsize = vpn_ws_be16(buf + 2);
 	}
 	// 64bit
 	else if (pktsize == 127) {
 		needed += 8;
-		if (peer->pos < needed) return 0;
-		pktsize = vpn_ws_be64(peer->buf + 2);
+		if (available < needed) return 0;
+		pktsize = vpn_ws_be64(buf + 2);
 	}
 
 	if (peer->has_mask) {
 		needed += 4;
-		if (peer->pos < needed) return 0;
-		memcpy(peer->mask, peer->buf + needed - 4, 4);
+		if (available < needed) return 0;
+		memcpy(peer->mask, buf + needed - 4, 4);
 	}
 
-	if (peer->pos < needed + pktsize) return 0;
+	if (available < needed + pktsize) return 0;
 
 	*ws_header = needed;
 
@@ -40,6 +44,8 @@ int64_t vpn_ws_websocket_parse(vpn_ws_peer *peer, uint16_t *ws_header) {
 		case 0:
 		case 1:
 		case 2:
+			// compression must have been negotiated
+			if (peer->deflated && !peer->zs) return -1;
 			return needed + pktsize;
 		// 8 -> close connection
 		case 8:
@@ -57,3 +63,81 @@ int64_t vpn_ws_websocket_parse(vpn_ws_peer *peer, uint16_t *ws_header) {
 	// never here
 	return -1;
 }
+
+// build the header of a binary (unmasked) packet, returns its size
+uint8_t vpn_ws_websocket_header(uint8_t *header, uint64_t amount) {
+	header[0] = 0x82;
+	if (amount < 126) {
+		header[1] = amount;
+		return 2;
+	}
+	if (amount <= (uint16_t) 0xffff) {
+		header[1] = 126;
+		header[2] = (uint8_t) ((amount >> 8) & 0xff);
+		header[3] = (uint8_t) (amount & 0xff);
+		return 4;
+	}
+	header[1] = 127;
+	header[2] = (uint8_t) ((amount >> 56) & 0xff);
+	header[3] = (uint8_t) ((amount >> 48) & 0xff);
+	header[4] = (uint8_t) ((amount >> 40) & 0xff);
+	header[5] = (uint8_t) ((amount >> 32) & 0xff);
+	header[6] = (uint8_t) ((amount >> 24) & 0xff);
+	header[7] = (uint8_t) ((amount >> 16) & 0xff);
+	header[8] = (uint8_t) ((amount >> 8) & 0xff);
+	header[9] = (uint8_t) (amount & 0xff);
+	return 10;
+}
+
+/*
+	encapsulate a frame in place, using the headroom in front of it.
+	Returns the websocket packet (NULL if there is not enough headroom)
+*/
+uint8_t *vpn_ws_websocket_prepend(uint8_t *buf, uint64_t amount, uint64_t headroom, uint64_t *ws_len) {
+	uint8_t header[10];
+	uint8_t header_size = vpn_ws_websocket_header(header, amount);
+	if (headroom < header_size) return NULL;
+	memcpy(buf - header_size, header, header_size);
+	*ws_len = amount + header_size;
+	return buf - header_size;
+}
+
+// check for a subprotocol in a (comma separated) Sec-WebSocket-Protocol value
+int vpn_ws_websocket_has_protocol(char *value, uint64_t len, char *proto) {
+	uint64_t proto_len = strlen(proto);
+	uint64_t i = 0;
+	while(i < len) {
+		while(i < len && (value[i] == ' ' || value[i] == ',')) i++;
+		uint64_t start = i;
+		while(i < len && value[i] != ',' && value[i] != ' ') i++;
+		if (i - start == proto_len && !memcmp(value + start, proto, proto_len)) return 1;
+	}
+	return 0;
+}
+
+/*
+	vpn-ws-batch: the frames of a multi-frame message are prefixed by their
+	16 bit (big endian) length. A length of 0 means the rest of the message,
+	it is used for frames bigger than 64k, that are always sent alone
+*/
+void vpn_ws_batch_prefix(uint8_t *buf, uint64_t len) {
+	if (len > 0xffff) len = 0;
+	buf[0] = (uint8_t) ((len >> 8) & 0xff);
+	buf[1] = (uint8_t) (len & 0xff);
+}
+
+/*
+	get the next frame of a multi-frame message, pos is advanced.
+	Returns the frame length, 0 at the end of the message, -1 if it is malformed
+*/
+int64_t vpn_ws_batch_next(uint8_t *buf, uint64_t len, uint64_t *pos, uint8_t **frame) {
+	if (*pos >= len) return 0;
+	if (len - *pos < VPN_WS_BATCH_PREFIX) return -1;
+	uint64_t frame_len = vpn_ws_be16(buf + *pos);
+	*pos += VPN_WS_BATCH_PREFIX;
+	if (frame_len == 0) frame_len = len - *pos;
+	if (frame_len == 0 || frame_len > len - *pos) return -1;
+	*frame = buf + *pos;
+	*pos += frame_len;
+	return frame_len;
+}
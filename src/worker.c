@@ -0,0 +1,462 @@
+#include "vpn-ws.h"
+
+/*
+
+	sharded switch engine
+
+	every worker owns an event queue and a subset of peers, only the owner
+	touches a peer. Frames (and commands) for peers owned by other workers
+	are passed over single-producer/single-consumer rings, one for each
+	(producer, consumer) couple, and the consumer is woken up via its
+	notification fd (an eventfd on Linux, a pipe elsewhere).
+
+	The main thread is the acceptor, it spreads new connections over the
+	workers in round robin.
+
+*/
+
+#ifndef __WIN32__
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+static int vpn_ws_worker_notify_init(vpn_ws_worker *w) {
+#ifdef __linux__
+	int fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0) {
+		vpn_ws_error("vpn_ws_worker_notify_init()/eventfd()");
+		return -1;
+	}
+	w->notify_fd[0] = fd;
+	w->notify_fd[1] = fd;
+#else
+	if (pipe(w->notify_fd)) {
+		vpn_ws_error("vpn_ws_worker_notify_init()/pipe()");
+		return -1;
+	}
+	if (vpn_ws_nb(w->notify_fd[0]) || vpn_ws_nb(w->notify_fd[1])) return -1;
+#endif
+	return 0;
+}
+
+void vpn_ws_worker_wakeup(vpn_ws_worker *w) {
+	uint64_t one = 1;
+	// a full pipe (or counter) already guarantees a wakeup
+	if (write(w->notify_fd[1], &one, sizeof(uint64_t)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			vpn_ws_error("vpn_ws_worker_wakeup()/write()");
+		}
+	}
+}
+
+// wake up the workers we posted messages to
+void vpn_ws_worker_flush(vpn_ws_worker *w) {
+	int i;
+	for(i=0;i<vpn_ws_conf.workers_n;i++) {
+		if (!w->wakeup[i]) continue;
+		w->wakeup[i] = 0;
+		vpn_ws_worker_wakeup(&vpn_ws_conf.workers[i]);
+	}
+}
+
+/*
+	post a message to another worker (src is NULL for the acceptor)
+	the frame (with its virtio-net header, if any) is copied, the consumer will free it
+*/
+int vpn_ws_worker_post(vpn_ws_worker *src, vpn_ws_worker *dst, uint8_t type, vpn_ws_fd fd, uint64_t id, uint8_t *vnet, uint8_t *eth, uint64_t eth_len) {
+	uint8_t *buf = vnet ? vnet : eth;
+	uint64_t len = vnet ? eth_len + VPN_WS_VNET_HDR_LEN : eth_len;
+	vpn_ws_ring_msg msg;
+	msg.type = type;
+	msg.fd = fd;
+	msg.id = id;
+	msg.fb = NULL;
+	msg.buf = NULL;
+	msg.len = len;
+	msg.vnet = vnet != NULL;
+
+	// leave headroom for the websocket header, the consumer will encapsulate the frame in place
+	if (len > 0) {
+		msg.fb = vpn_ws_fbuf_new(VPN_WS_HEADROOM + len);
+		if (!msg.fb) return -1;
+		msg.buf = msg.fb->data + VPN_WS_HEADROOM;
+		memcpy(msg.buf, buf, len);
+	}
+
+	vpn_ws_ring *ring = dst->rings[src ? src->id : vpn_ws_conf.workers_n];
+	if (vpn_ws_ring_push(ring, &msg)) {
+		// the consumer is too slow, drop the message
+		if (msg.fb) vpn_ws_fbuf_unref(msg.fb);
+		__atomic_add_fetch(&dst->ring_drops, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (src) {
+		src->wakeup[dst->id] = 1;
+	}
+	else {
+		vpn_ws_worker_wakeup(dst);
+	}
+	return 0;
+}
+
+static void vpn_ws_worker_dispatch(vpn_ws_worker *w, vpn_ws_ring_msg *msg) {
+	if (msg->type == VPN_WS_MSG_ACCEPT) {
+		vpn_ws_peer_create(w, msg->fd, NULL);
+		return;
+	}
+
+	uint64_t ws_len = 0;
+	uint8_t *ws = NULL;
+	if (msg->fb) {
+		ws = vpn_ws_websocket_prepend(msg->buf, msg->len, VPN_WS_HEADROOM, &ws_len);
+	}
+
+	uint8_t *vnet = NULL;
+	uint8_t *eth = msg->buf;
+	uint64_t eth_len = msg->len;
+	if (msg->vnet) {
+		vnet = msg->buf;
+		eth += VPN_WS_VNET_HDR_LEN;
+		eth_len -= VPN_WS_VNET_HDR_LEN;
+	}
+
+	if (msg->type == VPN_WS_MSG_BROADCAST || msg->type == VPN_WS_MSG_FLOOD) {
+		// the id carries the streams id of the sender
+		vpn_ws_flood(w, NULL, msg->fb, ws, ws_len, vnet, eth, eth_len, msg->type == VPN_WS_MSG_FLOOD, msg->id);
+		return;
+	}
+
+	// the peer could be gone (and its fd reused)
+	if (msg->fd < 0 || msg->fd >= w->peers_n) return;
+	vpn_ws_peer *peer = w->peers[msg->fd];
+	if (!peer || peer->id != msg->id) return;
+
+	if (msg->type == VPN_WS_MSG_UNICAST) {
+		vpn_ws_peer_write_frame(w, peer, msg->fb, ws, ws_len, vnet, eth, eth_len);
+	}
+	else if (msg->type == VPN_WS_MSG_KILL) {
+		vpn_ws_peer_destroy(peer);
+	}
+}
+
+// consume the messages posted to this worker
+void vpn_ws_worker_drain(vpn_ws_worker *w) {
+	uint64_t counter;
+	while(read(w->notify_fd[0], &counter, sizeof(uint64_t)) > 0);
+
+	int i;
+	for(i=0;i<=vpn_ws_conf.workers_n;i++) {
+		vpn_ws_ring_msg msg;
+		while(vpn_ws_ring_pop(w->rings[i], &msg)) {
+			vpn_ws_worker_dispatch(w, &msg);
+			if (msg.fb) vpn_ws_fbuf_unref(msg.fb);
+		}
+	}
+}
+
+static void *vpn_ws_worker_thread(void *arg) {
+	vpn_ws_worker *w = (vpn_ws_worker *) arg;
+	vpn_ws_worker_loop(w, vpn_ws_invalid_fd);
+	vpn_ws_exit(1);
+	return NULL;
+}
+
+#endif
+
+// append a peer to the ready list (if not already there)
+void vpn_ws_worker_ready(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	if (peer->ready || peer->dead) return;
+	peer->ready = 1;
+	peer->ready_next = NULL;
+	peer->ready_prev = w->ready_tail;
+	if (w->ready_tail) {
+		w->ready_tail->ready_next = peer;
+	}
+	else {
+		w->ready_head = peer;
+	}
+	w->ready_tail = peer;
+	w->ready_n++;
+}
+
+void vpn_ws_worker_unready(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	if (!peer->ready) return;
+	if (peer->ready_prev) {
+		peer->ready_prev->ready_next = peer->ready_next;
+	}
+	else {
+		w->ready_head = peer->ready_next;
+	}
+	if (peer->ready_next) {
+		peer->ready_next->ready_prev = peer->ready_prev;
+	}
+	else {
+		w->ready_tail = peer->ready_prev;
+	}
+	peer->ready_prev = NULL;
+	peer->ready_next = NULL;
+	peer->ready = 0;
+	w->ready_n--;
+}
+
+/*
+	serve each ready peer once (round robin), the ones that exhaust their
+	budget go back to the tail of the list and will be served at the next cycle
+*/
+void vpn_ws_worker_run(vpn_ws_worker *w) {
+	uint64_t n = w->ready_n;
+	while(n-- > 0 && w->ready_head) {
+		vpn_ws_peer *peer = w->ready_head;
+		vpn_ws_worker_unready(w, peer);
+		if (peer->dead) continue;
+		if (vpn_ws_peer_serve(w, peer) > 0) {
+			vpn_ws_worker_ready(w, peer);
+		}
+	}
+}
+
+// pipeline mode: flush the egress queue of a peer at the end of the cycle
+void vpn_ws_worker_defer_write(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	if (peer->flushing) return;
+	peer->flushing = 1;
+	peer->flush_next = w->flush_head;
+	w->flush_head = peer;
+}
+
+/*
+	pipeline mode: write the frames queued in this cycle, with a single
+	writev() (or io_uring send) for each peer. It must run before the reaping
+*/
+void vpn_ws_worker_flush_writes(vpn_ws_worker *w) {
+	while(w->flush_head) {
+		vpn_ws_peer *peer = w->flush_head;
+		w->flush_head = peer->flush_next;
+		peer->flush_next = NULL;
+		peer->flushing = 0;
+		if (peer->dead) continue;
+
+		int ret = vpn_ws_continue_write(peer);
+		if (ret < 0) {
+			vpn_ws_peer_destroy(peer);
+			continue;
+		}
+		// the rest will be flushed when the peer becomes writable
+		if (ret == 0) {
+			peer->is_writing = 1;
+			continue;
+		}
+		peer->is_writing = 0;
+		// if handshake is higher than 1, it means we want to close the connection
+		if (peer->handshake > 1) {
+			vpn_ws_peer_destroy(peer);
+		}
+	}
+}
+
+// vpn-ws-batch: the message of a peer will be closed at the end of the cycle
+void vpn_ws_worker_aggregate(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	if (peer->aggregating) return;
+	peer->aggregating = 1;
+	peer->agg_next = w->agg_head;
+	w->agg_head = peer;
+}
+
+/*
+	vpn-ws-batch: close the multi-frame messages aggregated in this cycle,
+	it must run before flushing the writes of the pipeline mode
+*/
+void vpn_ws_worker_close_messages(vpn_ws_worker *w) {
+	while(w->agg_head) {
+		vpn_ws_peer *peer = w->agg_head;
+		w->agg_head = peer->agg_next;
+		peer->agg_next = NULL;
+		peer->aggregating = 0;
+		if (peer->dead) continue;
+
+		int ret = vpn_ws_aggregate_close(peer);
+		if (ret < 0) {
+			vpn_ws_peer_destroy(peer);
+			continue;
+		}
+		// the rest will be flushed when the peer becomes writable
+		if (ret == 0) {
+			peer->is_writing = 1;
+		}
+	}
+}
+
+// the position (+ 1) of a peer in one of the flooding indexes
+static uint64_t *vpn_ws_peer_list_idx(vpn_ws_worker *w, vpn_ws_peer_list *l, vpn_ws_peer *peer) {
+	return l == &w->bridges ? &peer->bridge_idx : &peer->registered_idx;
+}
+
+static int vpn_ws_peer_list_add(vpn_ws_worker *w, vpn_ws_peer_list *l, vpn_ws_peer *peer) {
+	uint64_t *idx = vpn_ws_peer_list_idx(w, l, peer);
+	if (*idx) return 0;
+	if (l->n >= l->size) {
+		uint64_t size = l->size ? l->size * 2 : 64;
+		void *tmp = realloc(l->peers, sizeof(vpn_ws_peer *) * size);
+		if (!tmp) {
+			vpn_ws_error("vpn_ws_peer_list_add()/realloc()");
+			return -1;
+		}
+		l->peers = (vpn_ws_peer **) tmp;
+		l->size = size;
+	}
+	l->peers[l->n++] = peer;
+	*idx = l->n;
+	return 0;
+}
+
+// the last peer takes the place of the removed one
+static void vpn_ws_peer_list_del(vpn_ws_worker *w, vpn_ws_peer_list *l, vpn_ws_peer *peer) {
+	uint64_t *idx = vpn_ws_peer_list_idx(w, l, peer);
+	if (!*idx) return;
+	vpn_ws_peer *last = l->peers[--l->n];
+	l->peers[*idx - 1] = last;
+	*vpn_ws_peer_list_idx(w, l, last) = *idx;
+	*idx = 0;
+}
+
+/*
+	add a peer with a MAC (and a bridge) to the flooding indexes of the worker,
+	so floods only touch real recipients. Dead peers stay in them until they are
+	reaped (and are skipped by floods)
+*/
+int vpn_ws_worker_index(vpn_ws_worker *w, vpn_ws_peer *peer) {
+	if (!peer->mac_collected || peer->dead) return 0;
+	if (vpn_ws_peer_list_add(w, &w->registered, peer)) return -1;
+	if (peer->bridge && vpn_ws_peer_list_add(w, &w->bridges, peer)) return -1;
+	return 0;
+}
+
+// free the peers destroyed in this cycle
+void vpn_ws_worker_reap(vpn_ws_worker *w) {
+	while(w->dead) {
+		vpn_ws_peer *peer = w->dead;
+		w->dead = peer->dead_next;
+		vpn_ws_worker_unready(w, peer);
+		vpn_ws_peer_list_del(w, &w->registered, peer);
+		vpn_ws_peer_list_del(w, &w->bridges, peer);
+		vpn_ws_timer_del(w, &peer->timer);
+		vpn_ws_peer_free(peer);
+	}
+}
+
+// release the expired MACs learned behind the bridge peers of the worker
+static void vpn_ws_worker_mac_aging(vpn_ws_worker *w, vpn_ws_timer *t) {
+	uint64_t i;
+	for(i=0;i<w->bridges.n;i++) {
+		vpn_ws_peer *peer = w->bridges.peers[i];
+		if (peer->dead || !peer->macs) continue;
+		vpn_ws_bridge_mac_aging(peer);
+	}
+	int interval = vpn_ws_conf.mac_aging / 2;
+	if (interval < 1) interval = 1;
+	vpn_ws_timer_add(w, t, vpn_ws_now() + interval);
+}
+
+// io_uring mode: arm a persistent op on the notification fd or on the listening socket
+int vpn_ws_worker_uring_arm(vpn_ws_worker *w, uint8_t type, vpn_ws_fd fd) {
+	vpn_ws_uring_op *op = vpn_ws_calloc(sizeof(vpn_ws_uring_op));
+	if (!op) return -1;
+	op->type = type;
+	op->fd = fd;
+	if (type == VPN_WS_URING_ACCEPT) {
+		return vpn_ws_uring_accept(w->uring, op);
+	}
+	return vpn_ws_uring_poll(w->uring, op);
+}
+
+int vpn_ws_workers_init(int n) {
+	if (n < 1) n = 1;
+#ifdef __WIN32__
+	n = 1;
+#endif
+	vpn_ws_conf.workers = vpn_ws_calloc(sizeof(vpn_ws_worker) * n);
+	if (!vpn_ws_conf.workers) return -1;
+	vpn_ws_conf.workers_n = n;
+
+	int i;
+	for(i=0;i<n;i++) {
+		vpn_ws_worker *w = &vpn_ws_conf.workers[i];
+		w->id = i;
+		vpn_ws_timers_init(w);
+		if (vpn_ws_conf.mac_aging > 0) {
+			w->mac_aging_timer.func = vpn_ws_worker_mac_aging;
+			w->mac_aging_timer.data = w;
+			vpn_ws_timer_add(w, &w->mac_aging_timer, w->wheel_tick + 1);
+		}
+		if (vpn_ws_conf.io_uring) {
+			w->queue = -1;
+			w->uring = vpn_ws_uring_new(256);
+			if (!w->uring) return -1;
+		}
+		else {
+			w->queue = vpn_ws_event_queue(256);
+			if (w->queue < 0) return -1;
+			w->events = vpn_ws_event_events(64);
+			if (!w->events) return -1;
+		}
+#ifndef __WIN32__
+		if (n == 1) continue;
+		if (vpn_ws_worker_notify_init(w)) return -1;
+		if (w->uring) {
+			if (vpn_ws_worker_uring_arm(w, VPN_WS_URING_POLL, w->notify_fd[0])) return -1;
+		}
+		else if (vpn_ws_event_add_read(w->queue, w->notify_fd[0])) return -1;
+		w->wakeup = vpn_ws_calloc(n);
+		if (!w->wakeup) return -1;
+		// one inbound ring for each worker, plus the acceptor one
+		w->rings = vpn_ws_calloc(sizeof(vpn_ws_ring *) * (n + 1));
+		if (!w->rings) return -1;
+		int j;
+		for(j=0;j<=n;j++) {
+			w->rings[j] = vpn_ws_ring_new(4096);
+			if (!w->rings[j]) return -1;
+		}
+#endif
+	}
+	return 0;
+}
+
+int vpn_ws_workers_start() {
+#ifndef __WIN32__
+	if (vpn_ws_conf.workers_n < 2) return 0;
+	int i;
+	for(i=0;i<vpn_ws_conf.workers_n;i++) {
+		vpn_ws_worker *w = &vpn_ws_conf.workers[i];
+		if (pthread_create(&w->thread, NULL, vpn_ws_worker_thread, w)) {
+			vpn_ws_error("vpn_ws_workers_start()/pthread_create()");
+			return -1;
+		}
+	}
+	vpn_ws_log("started %d workers", vpn_ws_conf.workers_n);
+#endif
+	return 0;
+}
+
+// the acceptor loop (used only in multi-worker mode)
+void vpn_ws_acceptor_loop(vpn_ws_fd server_fd) {
+#ifndef __WIN32__
+	int next = 0;
+	for(;;) {
+		int client_fd = accept(server_fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			vpn_ws_error("vpn_ws_acceptor_loop()/accept()");
+			// avoid burning the cpu on EMFILE and friends
+			sleep(1);
+			continue;
+		}
+		vpn_ws_worker *w = &vpn_ws_conf.workers[next];
+		next = (next + 1) % vpn_ws_conf.workers_n;
+		if (vpn_ws_worker_post(NULL, w, VPN_WS_MSG_ACCEPT, client_fd, 0, NULL, NULL, 0)) {
+			vpn_ws_log("worker %d is overloaded, dropping connection", w->id);
+			close(client_fd);
+		}
+	}
+#endif
+}
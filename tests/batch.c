@@ -0,0 +1,40 @@
+#include "tests.h"
+
+// the results of vpn_ws_batch_next() for a message, up to the end (0) or the error (-1)
+static struct vpn_ws_batch_case {
+	char *name;
+	uint8_t msg[16];
+	uint64_t len;
+	int64_t ret[4];
+} vpn_ws_batch_cases[] = {
+	{"empty", {0}, 0, {0}},
+	{"single frame", {0, 3, 'a', 'b', 'c'}, 5, {3, 0}},
+	{"two frames", {0, 2, 'a', 'b', 0, 1, 'c'}, 7, {2, 1, 0}},
+	{"zero-length tail", {0, 2, 'a', 'b', 0, 0, 'c', 'd', 'e'}, 9, {2, 3, 0}},
+	{"zero-length tail only", {0, 0, 'a', 'b'}, 4, {2, 0}},
+	{"empty zero-length tail", {0, 2, 'a', 'b', 0, 0}, 6, {2, -1}},
+	{"truncated prefix", {0, 2, 'a', 'b', 0}, 5, {2, -1}},
+	{"truncated frame", {0, 2, 'a', 'b', 0, 4, 'c', 'd', 'e'}, 9, {2, -1}},
+	{"oversized frame", {1, 0, 'a', 'b'}, 4, {-1}},
+	{NULL, {0}, 0, {0}},
+};
+
+void vpn_ws_test_batch() {
+	struct vpn_ws_batch_case *c;
+	for(c=vpn_ws_batch_cases;c->name;c++) {
+		uint64_t pos = 0;
+		uint64_t consumed = 0;
+		int i;
+		for(i=0;i<4;i++) {
+			uint8_t *frame = NULL;
+			int64_t ret = vpn_ws_batch_next(c->msg, c->len, &pos, &frame);
+			vpn_ws_check(ret == c->ret[i], c->name);
+			if (ret != c->ret[i] || ret <= 0) break;
+			// the frame follows its prefix
+			consumed += VPN_WS_BATCH_PREFIX;
+			vpn_ws_check(frame == c->msg + consumed, c->name);
+			consumed += ret;
+			vpn_ws_check(pos == consumed, c->name);
+		}
+	}
+}
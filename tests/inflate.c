@@ -0,0 +1,60 @@
+#include "tests.h"
+
+// messages are compressed and inflated back by the server, the big ones must be refused
+static struct vpn_ws_inflate_case {
+	char *name;
+	uint64_t len;
+	int ok;
+} vpn_ws_inflate_cases[] = {
+	{"small", 100, 1},
+	{"a frame", 1500, 1},
+	{"a super-frame", 65536, 1},
+	{"a buffer growth", 300000, 1},
+	{"just under the cap", VPN_WS_INFLATE_MAX - 1, 1},
+	{"just over the cap", VPN_WS_INFLATE_MAX + 1, 0},
+	{"compression bomb", VPN_WS_INFLATE_MAX * 8, 0},
+	{NULL, 0, 0},
+};
+
+void vpn_ws_test_inflate() {
+	vpn_ws_deflate_params p;
+	memset(&p, 0, sizeof(vpn_ws_deflate_params));
+	p.out_bits = 15;
+
+	struct vpn_ws_inflate_case *c;
+	for(c=vpn_ws_inflate_cases;c->name;c++) {
+		uint8_t *msg = vpn_ws_malloc(c->len);
+		uint64_t zlen = vpn_ws_deflate_bound(c->len);
+		uint8_t *z = vpn_ws_malloc(zlen);
+		vpn_ws_check(msg && z, c->name);
+		if (!msg || !z) goto next;
+		uint64_t i;
+		for(i=0;i<c->len;i++) msg[i] = i % 61;
+
+		struct vpn_ws_deflate *zs = vpn_ws_deflate_new(&p);
+		struct iovec iov;
+		iov.iov_base = msg;
+		iov.iov_len = c->len;
+		int64_t rlen = vpn_ws_deflate(zs, &iov, 1, z, zlen);
+		vpn_ws_deflate_free(zs);
+		vpn_ws_check(rlen > 0, c->name);
+		if (rlen <= 0) goto next;
+
+		vpn_ws_peer peer;
+		memset(&peer, 0, sizeof(vpn_ws_peer));
+		peer.fd = -1;
+		peer.zs = vpn_ws_deflate_new(&p);
+		uint64_t out_len = 0;
+		vpn_ws_fbuf *fb = vpn_ws_peer_inflate(&peer, z, rlen, &out_len);
+		vpn_ws_check(!fb == !c->ok, c->name);
+		if (fb) {
+			vpn_ws_check(out_len == c->len, c->name);
+			vpn_ws_check(!memcmp(fb->data + VPN_WS_HEADROOM, msg, c->len), c->name);
+			vpn_ws_fbuf_unref(fb);
+		}
+		vpn_ws_deflate_free(peer.zs);
+next:
+		free(msg);
+		free(z);
+	}
+}
@@ -0,0 +1,20 @@
+#include "tests.h"
+
+struct vpn_ws_config vpn_ws_conf;
+
+uint64_t vpn_ws_tests_n;
+uint64_t vpn_ws_tests_failed;
+
+// the event loop lives in src/main.c, no worker thread is started here
+void vpn_ws_worker_loop(vpn_ws_worker *w, vpn_ws_fd server_fd) {
+}
+
+int main(int argc, char *argv[]) {
+	vpn_ws_test_timer();
+	vpn_ws_test_batch();
+	vpn_ws_test_inflate();
+	vpn_ws_test_vnet();
+
+	printf("%llu checks, %llu failed\n", (unsigned long long) vpn_ws_tests_n, (unsigned long long) vpn_ws_tests_failed);
+	return vpn_ws_tests_failed ? 1 : 0;
+}
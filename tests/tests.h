@@ -0,0 +1,24 @@
+#include "../src/vpn-ws.h"
+
+/*
+
+	unit tests (make test): each suite walks a table of cases and checks
+	them with vpn_ws_check(), failures are reported on stderr
+
+*/
+
+extern uint64_t vpn_ws_tests_n;
+extern uint64_t vpn_ws_tests_failed;
+
+#define vpn_ws_check(cond, name) do {\
+	vpn_ws_tests_n++;\
+	if (!(cond)) {\
+		vpn_ws_tests_failed++;\
+		fprintf(stderr, "FAIL %s:%d [%s] %s\n", __FILE__, __LINE__, name, #cond);\
+	}\
+} while(0)
+
+void vpn_ws_test_timer(void);
+void vpn_ws_test_batch(void);
+void vpn_ws_test_inflate(void);
+void vpn_ws_test_vnet(void);
@@ -0,0 +1,86 @@
+#include "tests.h"
+
+// a tick at the start of a level 1 slot (and of the upper ones)
+#define B (64ULL * 64 * 64 * 1000)
+
+static struct vpn_ws_timer_case {
+	char *name;
+	uint64_t start;
+	uint64_t delay;
+} vpn_ws_timer_cases[] = {
+	{"next tick", B + 10, 1},
+	{"already expired", B + 10, 0},
+	{"last slot of level 0", B + 62, 1},
+	{"level 0 wrap", B + 63, 1},
+	{"across the level 0 wrap", B + 60, 10},
+	{"on the next level 0 wrap", B + 10, 54},
+	{"after the next level 0 wrap", B + 10, 55},
+	{"a full level 0 round", B + 10, 64},
+	{"on a level 1 cascade", B + 10, 118},
+	{"last tick of level 1", B, 4095},
+	{"on the level 2 cascade", B + 10, 4086},
+	{"level 2", B + 33, 10000},
+	{"level 3", B + 5, 64 * 64 * 64 + 7},
+	{NULL, 0, 0},
+};
+
+static uint64_t vpn_ws_timer_fired;
+static uint64_t vpn_ws_timer_fired_n;
+
+static void vpn_ws_timer_cb(vpn_ws_worker *w, vpn_ws_timer *t) {
+	vpn_ws_timer_fired = vpn_ws_now();
+	vpn_ws_timer_fired_n++;
+}
+
+// the clock advances one second at a time, the timer must run exactly at its tick
+void vpn_ws_test_timer() {
+	static vpn_ws_worker w;
+	struct vpn_ws_timer_case *c;
+	for(c=vpn_ws_timer_cases;c->name;c++) {
+		memset(&w, 0, sizeof(vpn_ws_worker));
+		vpn_ws_conf.now = c->start;
+		w.wheel_tick = c->start;
+		vpn_ws_timer t;
+		memset(&t, 0, sizeof(vpn_ws_timer));
+		t.func = vpn_ws_timer_cb;
+		vpn_ws_timer_fired = 0;
+		vpn_ws_timer_fired_n = 0;
+		vpn_ws_timer_add(&w, &t, c->start + c->delay);
+
+		// already expired timers run at the next tick
+		uint64_t expected = c->delay ? c->start + c->delay : c->start + 1;
+		while((uint64_t) vpn_ws_conf.now < expected + 2) {
+			vpn_ws_conf.now++;
+			vpn_ws_timers_run(&w);
+		}
+		vpn_ws_check(vpn_ws_timer_fired_n == 1, c->name);
+		vpn_ws_check(vpn_ws_timer_fired == expected, c->name);
+		vpn_ws_check(w.timers_n == 0, c->name);
+	}
+
+	// all of the timers in the same wheel
+	memset(&w, 0, sizeof(vpn_ws_worker));
+	vpn_ws_conf.now = B + 10;
+	w.wheel_tick = B + 10;
+	static vpn_ws_timer t[64];
+	memset(t, 0, sizeof(t));
+	uint64_t i;
+	for(i=0;i<64;i++) {
+		t[i].func = vpn_ws_timer_cb;
+		vpn_ws_timer_add(&w, &t[i], B + 10 + (i * i * 3) + 1);
+	}
+	// the timeout never goes past the next due tick
+	vpn_ws_check(vpn_ws_timers_timeout(&w) == 1000, "timeout");
+	vpn_ws_timer_fired_n = 0;
+	for(i=0;i<64;i++) {
+		uint64_t expires = B + 10 + (i * i * 3) + 1;
+		while((uint64_t) vpn_ws_conf.now < expires) {
+			vpn_ws_conf.now++;
+			vpn_ws_timers_run(&w);
+		}
+		vpn_ws_check(vpn_ws_timer_fired_n == i + 1, "same wheel");
+		vpn_ws_check(vpn_ws_timer_fired == expires, "same wheel");
+	}
+	vpn_ws_check(w.timers_n == 0, "same wheel");
+	vpn_ws_check(vpn_ws_timers_timeout(&w) == -1, "timeout");
+}
@@ -0,0 +1,161 @@
+#include "tests.h"
+
+// TCP super-frames (or frames with a partial checksum) completed for a peer without offloads
+static struct vpn_ws_vnet_case {
+	char *name;
+	int ipv6;
+	uint64_t payload;
+	// 0: no segmentation, only the checksum
+	uint16_t mss;
+	uint64_t segments;
+} vpn_ws_vnet_cases[] = {
+	{"checksum only", 0, 1000, 0, 1},
+	{"checksum only, odd length", 0, 777, 0, 1},
+	{"checksum only ipv6", 1, 1000, 0, 1},
+	{"single segment", 0, 1000, 1448, 1},
+	{"exactly one mss", 0, 1448, 1448, 1},
+	{"one byte more", 0, 1449, 1448, 2},
+	{"many segments", 0, 10000, 1448, 7},
+	{"max super-frame", 0, 65000, 1448, 45},
+	{"ipv6", 1, 3000, 1440, 3},
+	{"ipv6 odd tail", 1, 2881, 1440, 3},
+	{NULL, 0, 0, 0, 0},
+};
+
+#define VPN_WS_TEST_SEQ 0xfffffc00
+
+// the frames produced by vpn_ws_vnet_finish()
+struct vpn_ws_vnet_result {
+	struct vpn_ws_vnet_case *c;
+	uint8_t *orig;
+	uint64_t l4;
+	uint64_t pos;
+	uint64_t segments;
+};
+
+static uint64_t vpn_ws_test_sum(uint64_t sum, uint8_t *buf, uint64_t len) {
+	uint64_t i;
+	for(i=0;i<len;i++) {
+		sum += i & 1 ? buf[i] : (uint32_t) buf[i] << 8;
+	}
+	return sum;
+}
+
+static uint16_t vpn_ws_test_fold(uint64_t sum) {
+	while(sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+// the sum of the pseudo header
+static uint64_t vpn_ws_test_pseudo(int ipv6, uint8_t *ip, uint64_t tcp_len) {
+	if (ipv6) return vpn_ws_test_sum(0, ip + 8, 32) + 6 + tcp_len;
+	return vpn_ws_test_sum(0, ip + 12, 8) + 6 + tcp_len;
+}
+
+static int vpn_ws_test_vnet_frame(vpn_ws_fbuf *fb, uint8_t *frame, uint64_t len, void *data) {
+	struct vpn_ws_vnet_result *r = (struct vpn_ws_vnet_result *) data;
+	struct vpn_ws_vnet_case *c = r->c;
+	uint8_t *ip = frame + 14;
+	uint8_t *tcp = frame + r->l4;
+	uint64_t tcp_len = len - r->l4;
+	uint64_t seg = tcp_len - 20;
+
+	vpn_ws_check(frame == fb->data + VPN_WS_HEADROOM, c->name);
+	vpn_ws_check(!c->mss || seg <= c->mss, c->name);
+	vpn_ws_check(!memcmp(frame, r->orig, 14), c->name);
+	vpn_ws_check(!memcmp(tcp + 20, r->orig + r->l4 + 20 + r->pos, seg), c->name);
+
+	if (c->ipv6) {
+		vpn_ws_check(vpn_ws_be16(ip + 4) == tcp_len, c->name);
+	}
+	else {
+		vpn_ws_check(vpn_ws_be16(ip + 2) == len - 14, c->name);
+		vpn_ws_check(vpn_ws_be16(ip + 4) == 0x1234 + r->segments, c->name);
+		vpn_ws_check(vpn_ws_test_fold(vpn_ws_test_sum(0, ip, 20)) == 0xffff, c->name);
+	}
+	vpn_ws_check(vpn_ws_test_fold(vpn_ws_test_sum(vpn_ws_test_pseudo(c->ipv6, ip, tcp_len), tcp, tcp_len)) == 0xffff, c->name);
+
+	// the sequence number wraps
+	uint32_t seq = ((uint32_t) tcp[4] << 24) | ((uint32_t) tcp[5] << 16) | ((uint32_t) tcp[6] << 8) | tcp[7];
+	vpn_ws_check(seq == (uint32_t) (VPN_WS_TEST_SEQ + r->pos), c->name);
+	// FIN and PSH only on the last segment
+	int last = r->pos + seg == c->payload;
+	vpn_ws_check((tcp[13] & 0x09) == (last ? 0x09 : 0), c->name);
+
+	r->pos += seg;
+	r->segments++;
+	return 0;
+}
+
+void vpn_ws_test_vnet() {
+	struct vpn_ws_vnet_case *c;
+	for(c=vpn_ws_vnet_cases;c->name;c++) {
+		uint64_t l4 = c->ipv6 ? 14 + 40 : 14 + 20;
+		uint64_t len = l4 + 20 + c->payload;
+		uint8_t *eth = vpn_ws_calloc(len);
+		vpn_ws_check(eth != NULL, c->name);
+		if (!eth) continue;
+
+		memset(eth, 0xaa, 6);
+		memset(eth + 6, 0xbb, 6);
+		uint8_t *ip = eth + 14;
+		if (c->ipv6) {
+			eth[12] = 0x86; eth[13] = 0xdd;
+			ip[0] = 0x60;
+			ip[4] = (uint8_t) ((len - l4) >> 8); ip[5] = (uint8_t) (len - l4);
+			ip[6] = 6;
+			ip[7] = 64;
+			ip[8] = 0xfd; ip[23] = 1;
+			ip[24] = 0xfd; ip[39] = 2;
+		}
+		else {
+			eth[12] = 0x08; eth[13] = 0x00;
+			ip[0] = 0x45;
+			ip[2] = (uint8_t) ((len - 14) >> 8); ip[3] = (uint8_t) (len - 14);
+			ip[4] = 0x12; ip[5] = 0x34;
+			ip[8] = 64;
+			ip[9] = 6;
+			ip[12] = 10; ip[15] = 1;
+			ip[16] = 10; ip[19] = 2;
+			uint16_t ip_csum = ~vpn_ws_test_fold(vpn_ws_test_sum(0, ip, 20));
+			ip[10] = (uint8_t) (ip_csum >> 8); ip[11] = (uint8_t) ip_csum;
+		}
+		uint8_t *tcp = eth + l4;
+		tcp[0] = 0x30; tcp[1] = 0x39;
+		tcp[2] = 0x01; tcp[3] = 0xbb;
+		tcp[4] = 0xff; tcp[5] = 0xff; tcp[6] = 0xfc; tcp[7] = 0x00;
+		tcp[12] = 5 << 4;
+		// ACK, PSH and FIN
+		tcp[13] = 0x19;
+		tcp[14] = 0xff; tcp[15] = 0xff;
+		uint64_t i;
+		for(i=0;i<c->payload;i++) tcp[20 + i] = (uint8_t) (i * 7);
+		// as the kernel does, the checksum field holds the sum of the pseudo header
+		uint16_t pseudo = vpn_ws_test_fold(vpn_ws_test_pseudo(c->ipv6, ip, len - l4));
+		tcp[16] = (uint8_t) (pseudo >> 8); tcp[17] = (uint8_t) pseudo;
+
+		uint8_t vnet[VPN_WS_VNET_HDR_LEN];
+		memset(vnet, 0, VPN_WS_VNET_HDR_LEN);
+		// NEEDS_CSUM, csum_start and csum_offset
+		vnet[0] = 1;
+		vnet[6] = (uint8_t) l4; vnet[7] = 0;
+		vnet[8] = 16; vnet[9] = 0;
+		if (c->mss) {
+			vnet[1] = c->ipv6 ? 4 : 1;
+			vnet[2] = (uint8_t) (l4 + 20); vnet[3] = 0;
+			vnet[4] = (uint8_t) c->mss; vnet[5] = (uint8_t) (c->mss >> 8);
+		}
+		vpn_ws_check(vpn_ws_vnet_valid(vnet, len), c->name);
+		vpn_ws_check(vpn_ws_vnet_pending(vnet), c->name);
+
+		struct vpn_ws_vnet_result r;
+		memset(&r, 0, sizeof(struct vpn_ws_vnet_result));
+		r.c = c;
+		r.orig = eth;
+		r.l4 = l4;
+		vpn_ws_check(vpn_ws_vnet_finish(vnet, eth, len, vpn_ws_test_vnet_frame, &r) == 0, c->name);
+		vpn_ws_check(r.segments == c->segments, c->name);
+		vpn_ws_check(r.pos == c->payload, c->name);
+		free(eth);
+	}
+}